@@ -0,0 +1,371 @@
+#pragma once
+
+#ifndef DKM_BENCHMARK_H
+#define DKM_BENCHMARK_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../dkm/dkm.hpp"
+#include "../dkm/dkm_datasets.hpp"
+
+/*
+The benchmark grid shared by the benchmark tools: times the public dkm entry points over every
+combination of dataset size, k, dimensionality and element type, and writes the results as JSON.
+*/
+namespace dkm_bench {
+
+struct grid {
+	std::vector<size_t> sizes;
+	std::vector<uint32_t> ks;
+	std::vector<size_t> dimensions;
+	std::vector<std::string> types;
+	std::vector<std::string> functions;
+	// "blobs" for k well separated Gaussian blobs or "uniform" for points with no cluster structure
+	std::string dataset;
+	size_t repetitions;
+	// Untimed runs before the timed ones, to warm caches and page in the data
+	size_t warmup_runs;
+	uint64_t max_iterations;
+	uint64_t seed;
+	// Configurations whose dataset would take more memory than this are skipped
+	size_t max_dataset_bytes;
+
+	grid() :
+	sizes{10000, 100000}, ks{8, 64}, dimensions{1, 2, 3, 16, 128}, types{"float", "double", "int"},
+	functions{"kmeans_lloyd", "random_plusplus", "calculate_clusters", "calculate_means"},
+	dataset("blobs"), repetitions(5), warmup_runs(1), max_iterations(10), seed(1), max_dataset_bytes(size_t(256) << 20)
+	{}
+};
+
+inline std::vector<std::string> split(const std::string& list) {
+	std::vector<std::string> items;
+	std::stringstream stream(list);
+	std::string item;
+	while (std::getline(stream, item, ',')) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+	return items;
+}
+
+template <typename Integer>
+std::vector<Integer> split_numbers(const std::string& list) {
+	std::vector<Integer> numbers;
+	for (const std::string& item : split(list)) {
+		numbers.push_back(static_cast<Integer>(std::stoull(item)));
+	}
+	return numbers;
+}
+
+const char grid_usage[] =
+	"  --sizes LIST          dataset sizes, e.g. 10000,100000\n"
+	"  --ks LIST             cluster counts, e.g. 8,64\n"
+	"  --dims LIST           dimensionalities among 1,2,3,16,128\n"
+	"  --types LIST          element types among float,double,int\n"
+	"  --functions LIST      among kmeans_lloyd,random_plusplus,calculate_clusters,calculate_means\n"
+	"  --dataset NAME        blobs or uniform\n"
+	"  --repetitions R       timed runs per configuration\n"
+	"  --warmup R            untimed runs before the timed ones\n"
+	"  --max-iterations I    Lloyd iterations per kmeans_lloyd run\n"
+	"  --seed S              dataset and seeding seed\n"
+	"  --max-dataset-mb MB   skip configurations with larger datasets\n";
+
+/*
+Apply a command line option describing the grid (see `grid_usage`). Returns false if the option
+isn't one of them.
+*/
+inline bool parse_grid_option(grid& settings, const std::string& option, const std::string& value) {
+	if (option == "--sizes") {
+		settings.sizes = split_numbers<size_t>(value);
+	} else if (option == "--ks") {
+		settings.ks = split_numbers<uint32_t>(value);
+	} else if (option == "--dims") {
+		settings.dimensions = split_numbers<size_t>(value);
+	} else if (option == "--types") {
+		settings.types = split(value);
+	} else if (option == "--functions") {
+		settings.functions = split(value);
+	} else if (option == "--dataset") {
+		settings.dataset = value;
+	} else if (option == "--repetitions") {
+		settings.repetitions = std::stoul(value);
+	} else if (option == "--warmup") {
+		settings.warmup_runs = std::stoul(value);
+	} else if (option == "--max-iterations") {
+		settings.max_iterations = std::stoull(value);
+	} else if (option == "--seed") {
+		settings.seed = std::stoull(value);
+	} else if (option == "--max-dataset-mb") {
+		settings.max_dataset_bytes = size_t(std::stoull(value)) << 20;
+	} else {
+		return false;
+	}
+	if (settings.repetitions == 0 || settings.max_iterations == 0) {
+		throw std::invalid_argument("--repetitions and --max-iterations must be at least 1");
+	}
+	return true;
+}
+
+/*
+The timings of one function on one configuration, along with the work each run did:
+* iterations: Lloyd iterations per run (kmeans_lloyd only).
+* points: point visits, counting every pass over the data.
+* distance_evaluations: point-to-mean distances computed.
+* bytes: bytes of points and labels streamed from memory, counting every pass.
+*/
+struct result {
+	std::string function;
+	std::string type;
+	size_t dimensions;
+	size_t n;
+	uint32_t k;
+	uint64_t iterations;
+	double points;
+	double distance_evaluations;
+	double bytes;
+	std::vector<double> seconds;
+};
+
+inline double median(std::vector<double> values) {
+	if (values.empty()) {
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	const size_t middle = values.size() / 2;
+	return values.size() % 2 == 1 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+inline double mean(const std::vector<double>& values) {
+	double sum = 0;
+	for (double value : values) {
+		sum += value;
+	}
+	return values.empty() ? 0 : sum / values.size();
+}
+
+inline double standard_deviation(const std::vector<double>& values) {
+	if (values.size() < 2) {
+		return 0;
+	}
+	const double average = mean(values);
+	double sum = 0;
+	for (double value : values) {
+		sum += (value - average) * (value - average);
+	}
+	return std::sqrt(sum / (values.size() - 1));
+}
+
+/*
+The dataset for one configuration, the same for a given seed on every host (see dkm_datasets.hpp).
+*/
+template <typename T, size_t N>
+std::vector<std::array<T, N>> make_points(const std::string& dataset, size_t n, uint32_t k, uint64_t seed) {
+	if (dataset == "blobs") {
+		dkm::blob_settings settings(k);
+		settings.scale = 10;
+		return dkm::generate_dataset(dkm::gaussian_blobs<T, N>(n, settings, seed));
+	} else if (dataset == "uniform") {
+		return dkm::generate_dataset(dkm::uniform_noise<T, N>(n, -1000, 1000, seed));
+	}
+	throw std::invalid_argument("unknown dataset " + dataset);
+}
+
+template <typename Function>
+std::vector<double> time_runs(const grid& settings, Function function) {
+	for (size_t i = 0; i < settings.warmup_runs; ++i) {
+		function();
+	}
+	std::vector<double> seconds;
+	for (size_t i = 0; i < settings.repetitions; ++i) {
+		const auto start = std::chrono::steady_clock::now();
+		function();
+		seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+	}
+	return seconds;
+}
+
+// Keeps the optimizer from discarding results which are otherwise unused
+template <typename T>
+void consume(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+	asm volatile("" : : "g"(&value) : "memory");
+#else
+	static const void* volatile sink;
+	sink = &value;
+#endif
+}
+
+template <typename T, size_t N>
+void run_configuration(const grid& settings, const std::string& type, size_t n, uint32_t k,
+	std::vector<result>& results) {
+	const double point_bytes = sizeof(std::array<T, N>);
+	const auto data = make_points<T, N>(settings.dataset, n, k, settings.seed);
+	const auto means = dkm::details::random_plusplus(data, k, settings.seed);
+	const auto labels = dkm::details::calculate_clusters(data, means);
+	for (const std::string& function : settings.functions) {
+		result entry;
+		entry.function = function;
+		entry.type = type;
+		entry.dimensions = N;
+		entry.n = n;
+		entry.k = k;
+		entry.iterations = 0;
+		// kmeans++ makes one pass per mean after the first, measuring against every mean chosen so far
+		const double seeding_points = double(n) * (k - 1);
+		const double seeding_distances = double(n) * k * (k - 1) / 2;
+		if (function == "kmeans_lloyd") {
+			dkm::clustering_parameters<T> parameters(k);
+			parameters.set_random_seed(settings.seed);
+			parameters.set_max_iteration(settings.max_iterations);
+			// kmeans_lloyd only repackages kmeans_cluster's result as a tuple; calling kmeans_cluster
+			// gives the iteration count without an observer running inside the timed region
+			uint64_t iterations = 0;
+			entry.seconds = time_runs(settings, [&]() {
+				const auto clustered = dkm::kmeans_cluster<T, N>(data, parameters);
+				iterations = clustered.iterations;
+				consume(clustered);
+			});
+			entry.iterations = iterations;
+			entry.points = seeding_points + double(n) * iterations;
+			entry.distance_evaluations = seeding_distances + double(n) * k * iterations;
+			entry.bytes = seeding_points * point_bytes + double(n) * iterations * (point_bytes + sizeof(uint32_t));
+		} else if (function == "random_plusplus") {
+			entry.seconds = time_runs(settings, [&]() { consume(dkm::details::random_plusplus(data, k, settings.seed)); });
+			entry.points = seeding_points;
+			entry.distance_evaluations = seeding_distances;
+			entry.bytes = seeding_points * point_bytes;
+		} else if (function == "calculate_clusters") {
+			entry.seconds = time_runs(settings, [&]() { consume(dkm::details::calculate_clusters(data, means)); });
+			entry.points = double(n);
+			entry.distance_evaluations = double(n) * k;
+			entry.bytes = double(n) * (point_bytes + sizeof(uint32_t));
+		} else if (function == "calculate_means") {
+			entry.seconds = time_runs(settings, [&]() { consume(dkm::details::calculate_means(data, labels, means, k)); });
+			entry.points = double(n);
+			entry.distance_evaluations = 0;
+			entry.bytes = double(n) * (point_bytes + sizeof(uint32_t));
+		} else {
+			throw std::invalid_argument("unknown function " + function);
+		}
+		results.push_back(entry);
+	}
+}
+
+/*
+N is a template parameter of dkm, so only the dimensionalities compiled in here (1, 2, 3, 16 and
+128) can be selected at run time.
+*/
+template <typename T>
+void run_dimensions(const grid& settings, const std::string& type, size_t dimensions, size_t n, uint32_t k,
+	std::vector<result>& results) {
+	switch (dimensions) {
+	case 1: run_configuration<T, 1>(settings, type, n, k, results); break;
+	case 2: run_configuration<T, 2>(settings, type, n, k, results); break;
+	case 3: run_configuration<T, 3>(settings, type, n, k, results); break;
+	case 16: run_configuration<T, 16>(settings, type, n, k, results); break;
+	case 128: run_configuration<T, 128>(settings, type, n, k, results); break;
+	default: throw std::invalid_argument("unsupported dimensionality " + std::to_string(dimensions));
+	}
+}
+
+inline size_t type_size(const std::string& type) {
+	if (type == "float") {
+		return sizeof(float);
+	} else if (type == "double") {
+		return sizeof(double);
+	} else if (type == "int") {
+		return sizeof(int);
+	}
+	throw std::invalid_argument("unknown type " + type);
+}
+
+/*
+Run every configuration of the grid, calling `progress` before each one. Configurations with fewer
+points than k or too large a dataset are skipped.
+*/
+template <typename Progress>
+std::vector<result> run_grid(const grid& settings, Progress progress) {
+	std::vector<result> results;
+	for (const std::string& type : settings.types) {
+		for (size_t dimensions : settings.dimensions) {
+			for (size_t n : settings.sizes) {
+				for (uint32_t k : settings.ks) {
+					if (n < k || n * dimensions * type_size(type) > settings.max_dataset_bytes) {
+						continue;
+					}
+					progress(type, dimensions, n, k);
+					if (type == "float") {
+						run_dimensions<float>(settings, type, dimensions, n, k, results);
+					} else if (type == "double") {
+						run_dimensions<double>(settings, type, dimensions, n, k, results);
+					} else {
+						run_dimensions<int>(settings, type, dimensions, n, k, results);
+					}
+				}
+			}
+		}
+	}
+	return results;
+}
+
+inline void write_string(std::ostream& out, const std::string& value) {
+	out << '"';
+	for (char c : value) {
+		if (c == '"' || c == '\\') {
+			out << '\\';
+		}
+		out << c;
+	}
+	out << '"';
+}
+
+/*
+Write the results as JSON. Rates are derived from the median run time.
+*/
+inline void write_json(std::ostream& out, const grid& settings, const std::vector<result>& results) {
+	out.precision(9);
+	out << "{\n  \"schema\": 1,\n  \"repetitions\": " << settings.repetitions
+		<< ",\n  \"max_iterations\": " << settings.max_iterations
+		<< ",\n  \"seed\": " << settings.seed << ",\n  \"dataset\": ";
+	write_string(out, settings.dataset);
+	out << ",\n  \"results\": [";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const result& entry = results[i];
+		const double seconds = median(entry.seconds);
+		const double rate = seconds > 0 ? 1 / seconds : 0;
+		out << (i == 0 ? "\n" : ",\n") << "    {\"function\": ";
+		write_string(out, entry.function);
+		out << ", \"type\": ";
+		write_string(out, entry.type);
+		out << ", \"dimensions\": " << entry.dimensions << ", \"n\": " << entry.n << ", \"k\": " << entry.k
+			<< ", \"iterations\": " << entry.iterations
+			<< ", \"median_seconds\": " << seconds
+			<< ", \"min_seconds\": " << *std::min_element(entry.seconds.begin(), entry.seconds.end())
+			<< ", \"stddev_seconds\": " << standard_deviation(entry.seconds)
+			<< ", \"points_per_second\": " << entry.points * rate
+			<< ", \"distances_per_second\": " << entry.distance_evaluations * rate
+			<< ", \"bytes_per_second\": " << entry.bytes * rate
+			<< ", \"seconds\": [";
+		for (size_t j = 0; j < entry.seconds.size(); ++j) {
+			out << (j == 0 ? "" : ", ") << entry.seconds[j];
+		}
+		out << "]}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+} // namespace dkm_bench
+
+#endif /* DKM_BENCHMARK_H */
@@ -0,0 +1,74 @@
+/*
+Benchmarks kmeans_lloyd, random_plusplus, calculate_clusters and calculate_means over a grid of
+dataset sizes, k, dimensionalities and element types, and prints the results as JSON.
+
+Build with optimizations from the repository root, e.g.:
+
+	g++ -std=c++11 -O3 -march=native -pthread -o dkm_bench bench/dkm_bench.cpp
+
+Usage:
+
+	dkm_bench [grid options] [--output results.json]
+
+Run `dkm_bench --help` for the grid options. Progress goes to stderr and the JSON to stdout unless
+--output is given.
+*/
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include "benchmark.hpp"
+
+namespace {
+
+void usage() {
+	std::cerr << "usage: dkm_bench [options]\n" << dkm_bench::grid_usage
+		<< "  --output FILE         write the JSON to FILE instead of stdout\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	dkm_bench::grid settings;
+	std::string output;
+	try {
+		for (int i = 1; i < argc; ++i) {
+			const std::string option = argv[i];
+			if (option == "--help" || option == "-h") {
+				usage();
+				return 0;
+			}
+			if (i + 1 >= argc) {
+				throw std::invalid_argument("missing value for " + option);
+			}
+			const std::string value = argv[++i];
+			if (option == "--output") {
+				output = value;
+			} else if (!dkm_bench::parse_grid_option(settings, option, value)) {
+				throw std::invalid_argument("unknown option " + option);
+			}
+		}
+
+		const auto results = dkm_bench::run_grid(settings,
+			[](const std::string& type, size_t dimensions, size_t n, uint32_t k) {
+				std::cerr << type << " N=" << dimensions << " n=" << n << " k=" << k << std::endl;
+			});
+		if (output.empty()) {
+			dkm_bench::write_json(std::cout, settings, results);
+		} else {
+			std::ofstream file(output);
+			dkm_bench::write_json(file, settings, results);
+			if (!file) {
+				throw std::runtime_error("unable to write " + output);
+			}
+		}
+	} catch (const std::exception& error) {
+		std::cerr << "dkm_bench: " << error.what() << "\n";
+		usage();
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
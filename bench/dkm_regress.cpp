@@ -0,0 +1,332 @@
+/*
+Performance regression check: runs the benchmark grid (see benchmark.hpp) with repeated trials and
+compares every configuration against a baseline recorded earlier on the same machine, flagging
+statistically significant slowdowns.
+
+Build with the same flags as the code being checked, from the repository root, e.g.:
+
+	g++ -std=c++11 -O3 -march=native -pthread -o dkm_regress bench/dkm_regress.cpp
+
+Usage:
+
+	dkm_regress --baseline baseline.json [--update] [--threshold 0.05] [--confidence 0.95] [grid options]
+
+Baselines are stored per machine fingerprint (CPU model, hardware threads, compiler and the
+instruction sets and assertions it was built with), so one file can hold baselines for several
+hosts and builds; runs are only ever compared against the baseline of an identical fingerprint.
+If there is none yet, or with --update, the results of this run are stored as the baseline.
+
+For each configuration the mean run times are compared with Welch's t-test. A configuration counts
+as a regression when the whole confidence interval of the slowdown lies above zero and the
+estimated slowdown exceeds the threshold (as a fraction of the baseline time). The exit status is 1
+if anything regressed, 2 on errors and 0 otherwise.
+*/
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark.hpp"
+#include "json.hpp"
+
+namespace {
+
+void usage() {
+	std::cerr << "usage: dkm_regress --baseline FILE [options]\n"
+		"  --baseline FILE       baseline JSON, created if missing\n"
+		"  --update              store this run as the baseline for this machine\n"
+		"  --threshold F         smallest slowdown reported, as a fraction (default 0.05)\n"
+		"  --confidence F        confidence level of the intervals (default 0.95)\n"
+		<< dkm_bench::grid_usage;
+}
+
+std::string cpu_model() {
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	std::string line;
+	while (std::getline(cpuinfo, line)) {
+		if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos) {
+			return line.substr(line.find(':') + 2);
+		}
+	}
+	return "unknown";
+}
+
+std::string compiler() {
+#if defined(__clang__)
+	return "clang " __clang_version__;
+#elif defined(__GNUC__)
+	return "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+	return "msvc " + std::to_string(_MSC_VER);
+#else
+	return "unknown";
+#endif
+}
+
+std::string build_flags() {
+	std::string flags;
+#ifdef NDEBUG
+	flags += "NDEBUG ";
+#endif
+#ifdef __SSE4_2__
+	flags += "SSE4.2 ";
+#endif
+#ifdef __AVX2__
+	flags += "AVX2 ";
+#endif
+#ifdef __FMA__
+	flags += "FMA ";
+#endif
+#ifdef __AVX512F__
+	flags += "AVX512F ";
+#endif
+#ifdef __ARM_NEON
+	flags += "NEON ";
+#endif
+#ifdef DKM_ENABLE_COUNTERS
+	flags += "DKM_ENABLE_COUNTERS ";
+#endif
+	return flags.empty() ? flags : flags.substr(0, flags.size() - 1);
+}
+
+/*
+What identifies a machine and build, and its FNV-1a hash as the key of its baselines.
+*/
+dkm_bench::json_value machine_description() {
+	dkm_bench::json_value machine = dkm_bench::json_value::make_object();
+	machine.object["cpu"] = dkm_bench::json_value::make_string(cpu_model());
+	machine.object["threads"] = dkm_bench::json_value::make_number(std::thread::hardware_concurrency());
+	machine.object["compiler"] = dkm_bench::json_value::make_string(compiler());
+	machine.object["flags"] = dkm_bench::json_value::make_string(build_flags());
+	machine.object["pointer_bits"] = dkm_bench::json_value::make_number(8 * sizeof(void*));
+	return machine;
+}
+
+std::string fingerprint(const dkm_bench::json_value& machine) {
+	std::ostringstream text;
+	dkm_bench::write_json_value(text, machine);
+	uint64_t hash = 14695981039346656037ULL;
+	for (char c : text.str()) {
+		hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+	}
+	char hex[17];
+	std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+	return hex;
+}
+
+// Configurations are matched on everything that affects the work done
+std::string configuration_key(const std::string& function, const std::string& type, size_t dimensions,
+	size_t n, uint32_t k, const dkm_bench::grid& settings) {
+	std::ostringstream key;
+	key << function << " " << type << " N=" << dimensions << " n=" << n << " k=" << k
+		<< " " << settings.dataset << " iterations=" << settings.max_iterations << " seed=" << settings.seed;
+	return key.str();
+}
+
+std::string configuration_key(const dkm_bench::result& entry, const dkm_bench::grid& settings) {
+	return configuration_key(entry.function, entry.type, entry.dimensions, entry.n, entry.k, settings);
+}
+
+// The standard normal quantile, found by bisection on erfc
+double normal_quantile(double p) {
+	double low = -40;
+	double high = 40;
+	for (int i = 0; i < 200; ++i) {
+		const double middle = (low + high) / 2;
+		if (0.5 * std::erfc(-middle / std::sqrt(2.0)) < p) {
+			low = middle;
+		} else {
+			high = middle;
+		}
+	}
+	return (low + high) / 2;
+}
+
+// Student's t quantile by the Cornish-Fisher expansion, which is accurate to a few parts in a
+// thousand from 3 degrees of freedom up
+double t_quantile(double p, double degrees) {
+	const double z = normal_quantile(p);
+	const double z3 = z * z * z;
+	const double z5 = z3 * z * z;
+	const double z7 = z5 * z * z;
+	return z + (z3 + z) / (4 * degrees)
+		+ (5 * z5 + 16 * z3 + 3 * z) / (96 * degrees * degrees)
+		+ (3 * z7 + 19 * z5 + 17 * z3 - 15 * z) / (384 * degrees * degrees * degrees);
+}
+
+struct comparison {
+	double change;
+	double low;
+	double high;
+};
+
+/*
+The relative change of the mean time from `baseline` to `current`, with its confidence interval,
+from Welch's t-test.
+*/
+comparison compare(const std::vector<double>& baseline, const std::vector<double>& current, double confidence) {
+	const double baseline_mean = dkm_bench::mean(baseline);
+	const double current_mean = dkm_bench::mean(current);
+	const double baseline_variance = std::pow(dkm_bench::standard_deviation(baseline), 2) / baseline.size();
+	const double current_variance = std::pow(dkm_bench::standard_deviation(current), 2) / current.size();
+	const double error = std::sqrt(baseline_variance + current_variance);
+	double degrees = 1;
+	if (error > 0) {
+		degrees = std::pow(baseline_variance + current_variance, 2)
+			/ (std::pow(baseline_variance, 2) / std::max<size_t>(1, baseline.size() - 1)
+				+ std::pow(current_variance, 2) / std::max<size_t>(1, current.size() - 1));
+	}
+	const double margin = t_quantile(1 - (1 - confidence) / 2, std::max(1.0, degrees)) * error;
+	const double difference = current_mean - baseline_mean;
+	comparison result;
+	result.change = difference / baseline_mean;
+	result.low = (difference - margin) / baseline_mean;
+	result.high = (difference + margin) / baseline_mean;
+	return result;
+}
+
+dkm_bench::json_value results_json(const std::vector<dkm_bench::result>& results, const dkm_bench::grid& settings) {
+	dkm_bench::json_value stored = dkm_bench::json_value::make_object();
+	for (const auto& entry : results) {
+		dkm_bench::json_value seconds = dkm_bench::json_value::make_array();
+		for (double value : entry.seconds) {
+			seconds.array.push_back(dkm_bench::json_value::make_number(value));
+		}
+		stored.object[configuration_key(entry, settings)] = seconds;
+	}
+	return stored;
+}
+
+std::vector<double> numbers(const dkm_bench::json_value& array) {
+	std::vector<double> values;
+	for (const auto& value : array.array) {
+		values.push_back(value.number);
+	}
+	return values;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	dkm_bench::grid settings;
+	settings.repetitions = 10;
+	std::string baseline_path;
+	bool update = false;
+	double threshold = 0.05;
+	double confidence = 0.95;
+	try {
+		for (int i = 1; i < argc; ++i) {
+			const std::string option = argv[i];
+			if (option == "--help" || option == "-h") {
+				usage();
+				return 0;
+			} else if (option == "--update") {
+				update = true;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				throw std::invalid_argument("missing value for " + option);
+			}
+			const std::string value = argv[++i];
+			if (option == "--baseline") {
+				baseline_path = value;
+			} else if (option == "--threshold") {
+				threshold = std::stod(value);
+			} else if (option == "--confidence") {
+				confidence = std::stod(value);
+			} else if (!dkm_bench::parse_grid_option(settings, option, value)) {
+				throw std::invalid_argument("unknown option " + option);
+			}
+		}
+		if (baseline_path.empty()) {
+			throw std::invalid_argument("--baseline is required");
+		}
+		if (settings.repetitions < 3) {
+			throw std::invalid_argument("at least 3 repetitions are needed for confidence intervals");
+		}
+		if (confidence <= 0 || confidence >= 1) {
+			throw std::invalid_argument("--confidence must be between 0 and 1");
+		}
+
+		dkm_bench::json_value baselines = dkm_bench::json_value::make_object();
+		{
+			std::ifstream file(baseline_path);
+			if (file) {
+				std::stringstream text;
+				text << file.rdbuf();
+				baselines = dkm_bench::json_parser(text.str()).parse();
+			}
+		}
+		if (!baselines.has("machines")) {
+			baselines.object["schema"] = dkm_bench::json_value::make_number(1);
+			baselines.object["machines"] = dkm_bench::json_value::make_object();
+		}
+		const dkm_bench::json_value machine = machine_description();
+		const std::string key = fingerprint(machine);
+		std::cerr << "machine " << key << ": " << machine["cpu"].string << ", " << machine["compiler"].string << "\n";
+
+		const auto results = dkm_bench::run_grid(settings,
+			[](const std::string& type, size_t dimensions, size_t n, uint32_t k) {
+				std::cerr << type << " N=" << dimensions << " n=" << n << " k=" << k << std::endl;
+			});
+
+		size_t regressions = 0;
+		const bool has_baseline = baselines["machines"].has(key);
+		if (has_baseline) {
+			const dkm_bench::json_value& stored = baselines["machines"][key]["results"];
+			std::printf("%-70s %12s %12s %8s %20s\n", "configuration", "baseline s", "current s", "change", "interval");
+			for (const auto& entry : results) {
+				const std::string name = configuration_key(entry, settings);
+				if (!stored.has(name)) {
+					std::printf("%-70s %12s\n", name.c_str(), "no baseline");
+					continue;
+				}
+				const std::vector<double> baseline = numbers(stored[name]);
+				const comparison change = compare(baseline, entry.seconds, confidence);
+				const bool regressed = change.low > 0 && change.change > threshold;
+				const bool improved = change.high < 0 && -change.change > threshold;
+				regressions += regressed ? 1 : 0;
+				std::printf("%-70s %12.6g %12.6g %+7.1f%% [%+7.1f%%, %+7.1f%%] %s\n", name.c_str(),
+					dkm_bench::mean(baseline), dkm_bench::mean(entry.seconds), 100 * change.change,
+					100 * change.low, 100 * change.high, regressed ? "SLOWER" : improved ? "faster" : "");
+			}
+			std::printf("%zu regression(s) at %.0f%% confidence beyond a %.1f%% threshold\n",
+				regressions, 100 * confidence, 100 * threshold);
+		} else {
+			std::printf("no baseline for machine %s yet\n", key.c_str());
+		}
+
+		if (update || !has_baseline) {
+			dkm_bench::json_value entry = dkm_bench::json_value::make_object();
+			entry.object["machine"] = machine;
+			entry.object["results"] = results_json(results, settings);
+			if (has_baseline) {
+				// Keep the baselines of configurations this run didn't cover
+				for (const auto& member : baselines["machines"][key]["results"].object) {
+					entry.object["results"].object.insert(member);
+				}
+			}
+			baselines.object["machines"].object[key] = entry;
+			std::ofstream file(baseline_path, std::ios::trunc);
+			file.precision(17);
+			dkm_bench::write_json_value(file, baselines);
+			file << "\n";
+			if (!file) {
+				throw std::runtime_error("unable to write " + baseline_path);
+			}
+			std::printf("stored the baseline for machine %s in %s\n", key.c_str(), baseline_path.c_str());
+		}
+		return regressions > 0 ? 1 : 0;
+	} catch (const std::exception& error) {
+		std::cerr << "dkm_regress: " << error.what() << "\n";
+		return 2;
+	}
+}
@@ -0,0 +1,495 @@
+/*
+Equivalence check of every clustering engine against a reference Lloyd's algorithm, over many
+seeds and synthetic datasets (see dkm_datasets.hpp).
+
+The reference is the original, unoptimized formulation of kmeans_lloyd: kmeans++ seeding, then
+alternately `calculate_clusters` and `calculate_means` until the means stop changing. Every exact
+engine must reproduce its means, labels and iteration count bit for bit:
+* kmeans_cluster, with and without labels and with narrow label types
+* kmeans_cluster_chunked over in-memory spans and prefetched files
+* kmeans_cluster over a memory mapped file, writing labels to a file
+* kmeans_weighted with unit weights converges to a fixed point of the reference iteration, doubling
+  every weight changes nothing but the counts and inertia, and kmeans_streamkm with a coreset
+  holding every point matches it
+Approximate engines must stay within a bound:
+* kmeans_model's batch prediction computes |m|^2 - 2 x.m rather than |x - m|^2, so it may pick a
+  different mean only where the two are tied to within rounding
+* its top-m prediction must agree with its own batch prediction, and a model loaded from a file
+  must keep predicting the same after another model is saved over that file
+* kmeans_cluster on several threads and kmeans_distributed over several ranks merge partial sums in
+  a different order, so their inertia must stay within `parallel_tolerance` of the serial run's
+  (exactly equal for integer types, whose sums don't round). These run on datasets of
+  --parallel-size points, enough for every thread to get its own chunks.
+Streaming summaries must keep their invariants:
+* a streamkm_coreset's weights add up to the points added
+* online_kmeans's weights add up to the points seen, the points in the window, or the decayed sum
+  of the points' weights with a half-life
+
+Build from the repository root, e.g.:
+
+	g++ -std=c++11 -O2 -march=native -pthread -o dkm_verify bench/dkm_verify.cpp
+
+Usage:
+
+	dkm_verify [--seeds 20] [--size 5000] [--parallel-size 65536] [--scratch /tmp] [--verbose]
+
+The exit status is 1 if any check failed.
+*/
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../dkm/dkm.hpp"
+#include "../dkm/dkm_coreset.hpp"
+#include "../dkm/dkm_datasets.hpp"
+#include "../dkm/dkm_distributed.hpp"
+#include "../dkm/dkm_io.hpp"
+#include "../dkm/dkm_online.hpp"
+#include "../dkm/dkm_stream.hpp"
+
+namespace {
+
+struct checker {
+	bool verbose;
+	size_t checks;
+	size_t failures;
+
+	void expect(bool passed, const std::string& what) {
+		++checks;
+		if (!passed) {
+			++failures;
+		}
+		if (!passed || verbose) {
+			std::printf("%s %s\n", passed ? "ok  " : "FAIL", what.c_str());
+		}
+	}
+};
+
+template <typename T, size_t N>
+struct reference_result {
+	std::vector<std::array<T, N>> means;
+	std::vector<std::array<T, N>> previous_means;
+	std::vector<uint32_t> labels;
+	uint64_t iterations;
+};
+
+/*
+The reference algorithm, as kmeans_lloyd was originally written.
+*/
+template <typename T, size_t N>
+reference_result<T, N> reference_lloyd(const std::vector<std::array<T, N>>& data, const dkm::clustering_parameters<T>& parameters) {
+	reference_result<T, N> result;
+	result.means = dkm::details::random_plusplus(data, parameters.get_k(), parameters.get_random_seed());
+	std::vector<std::array<T, N>> old_old_means;
+	result.iterations = 0;
+	do {
+		result.labels = dkm::details::calculate_clusters(data, result.means);
+		old_old_means = result.previous_means;
+		result.previous_means = result.means;
+		result.means = dkm::details::calculate_means(data, result.labels, result.previous_means, parameters.get_k());
+		++result.iterations;
+	} while (result.means != result.previous_means && result.means != old_old_means
+		&& !(parameters.has_max_iteration() && result.iterations == parameters.get_max_iteration())
+		&& !(parameters.has_min_delta() && dkm::details::deltas_below_limit(
+			dkm::details::deltas(result.previous_means, result.means), parameters.get_min_delta())));
+	return result;
+}
+
+template <typename T, size_t N>
+double squared_distance(const std::array<T, N>& a, const std::array<T, N>& b) {
+	double sum = 0;
+	for (size_t j = 0; j < N; ++j) {
+		const double delta = static_cast<double>(a[j]) - static_cast<double>(b[j]);
+		sum += delta * delta;
+	}
+	return sum;
+}
+
+template <typename T, size_t N>
+double squared_norm(const std::array<T, N>& a) {
+	return squared_distance(a, std::array<T, N>());
+}
+
+template <typename T, size_t N>
+void verify(checker& check, const std::string& dataset, const std::vector<std::array<T, N>>& data,
+	const dkm::clustering_parameters<T>& parameters, const std::string& scratch) {
+	const std::string name = dataset + " k=" + std::to_string(parameters.get_k())
+		+ " seed=" + std::to_string(parameters.get_random_seed())
+		+ (parameters.has_max_iteration() ? " max_iter=" + std::to_string(parameters.get_max_iteration()) : "")
+		+ (parameters.has_min_delta() ? " min_delta" : "") + ": ";
+	const auto reference = reference_lloyd(data, parameters);
+	const uint32_t k = parameters.get_k();
+
+	// In-memory engine
+	const auto result = dkm::kmeans_cluster<T, N>(data, parameters);
+	check.expect(result.means == reference.means, name + "kmeans_cluster means");
+	check.expect(result.labels == reference.labels, name + "kmeans_cluster labels");
+	check.expect(result.iterations == reference.iterations, name + "kmeans_cluster iterations");
+	std::vector<uint64_t> counts(k);
+	double inertia = 0;
+	for (size_t i = 0; i < data.size(); ++i) {
+		++counts[reference.labels[i]];
+		inertia += squared_distance(data[i], reference.previous_means[reference.labels[i]]);
+	}
+	check.expect(result.counts == counts, name + "kmeans_cluster counts");
+	check.expect(std::fabs(result.inertia - inertia) <= 1e-6 * std::max(1.0, inertia), name + "kmeans_cluster inertia");
+
+	dkm::clustering_parameters<T> unlabeled = parameters;
+	unlabeled.set_keep_labels(false);
+	const auto means_only = dkm::kmeans_cluster<T, N>(data, unlabeled);
+	check.expect(means_only.means == reference.means && means_only.labels.empty(), name + "kmeans_cluster without labels");
+
+	if (k <= 256) {
+		const auto narrow = dkm::kmeans_cluster<T, N, uint8_t>(data, parameters);
+		check.expect(narrow.means == reference.means
+			&& std::equal(narrow.labels.begin(), narrow.labels.end(), reference.labels.begin()),
+			name + "kmeans_cluster with 8 bit labels");
+	}
+
+	// Streamed engines, seeded from every point so the seeds match
+	dkm::span_source<T, N> span(data, 1000);
+	check.expect(dkm::kmeans_cluster_chunked(span, parameters, data.size()).means == reference.means,
+		name + "kmeans_cluster_chunked over a span");
+
+	const std::string data_path = scratch + "/dkm_verify_" + std::to_string(::getpid()) + ".bin";
+	const std::string labels_path = data_path + ".labels";
+	{
+		std::ofstream file(data_path, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size() * sizeof(data[0])));
+		if (!file) {
+			throw std::runtime_error("unable to write " + data_path);
+		}
+	}
+	{
+		dkm::mapped_dataset<T, N> mapped(data_path);
+		// Small windows so the pass crosses many of them
+		const auto mapped_result = dkm::kmeans_cluster<T, N>(mapped, parameters, labels_path, 4096 * sizeof(data[0]), data.size());
+		check.expect(mapped_result.means == reference.means, name + "mapped kmeans_cluster means");
+		std::vector<uint32_t> labels(data.size());
+		std::ifstream file(labels_path, std::ios::binary);
+		file.read(reinterpret_cast<char*>(labels.data()), static_cast<std::streamsize>(labels.size() * sizeof(uint32_t)));
+		check.expect(file && labels == reference.labels, name + "mapped kmeans_cluster labels");
+	}
+	auto file_source = dkm::make_file_source<T, N>(data_path, 777, 3);
+	check.expect(dkm::kmeans_cluster_chunked(*file_source, parameters, data.size()).means == reference.means,
+		name + "kmeans_cluster_chunked over a prefetched file");
+	file_source.reset();
+	std::remove(data_path.c_str());
+	std::remove(labels_path.c_str());
+
+	// Prediction may only disagree with the exact assignment on ties within rounding
+	const dkm::kmeans_model<T, N> model(reference.means);
+	const auto predicted = model.predict_batch(data);
+	const auto exact = dkm::details::calculate_clusters(data, reference.means);
+	const double epsilon = std::is_integral<T>::value ? 0.0 : 64 * std::numeric_limits<T>::epsilon();
+	size_t differing = 0;
+	bool bounded = true;
+	for (size_t i = 0; i < data.size(); ++i) {
+		if (predicted[i] != exact[i]) {
+			++differing;
+			const double gap = squared_distance(data[i], reference.means[predicted[i]]) - squared_distance(data[i], reference.means[exact[i]]);
+			const double scale = squared_norm(data[i]) + squared_norm(reference.means[predicted[i]]) + squared_norm(reference.means[exact[i]]);
+			bounded = bounded && gap <= epsilon * scale;
+		}
+	}
+	check.expect(bounded, name + "kmeans_model predict_batch within rounding (" + std::to_string(differing) + " ties)");
+
+	// A loaded model keeps predicting from its own file even once a smaller model is saved over it
+	const std::string model_path = scratch + "/dkm_verify_" + std::to_string(::getpid()) + ".model";
+	dkm::save_model(model, model_path);
+	{
+		const auto loaded = dkm::load_model<T, N>(model_path);
+		dkm::save_model(dkm::kmeans_model<T, N>(std::vector<std::array<T, N>>(1, reference.means[0])), model_path);
+		check.expect(loaded.k() == k && loaded.predict_batch(data) == predicted, name + "loaded model survives save_model over its file");
+		check.expect(dkm::load_model<T, N>(model_path).k() == 1, name + "save_model replaces a loaded model's file");
+	}
+	std::remove(model_path.c_str());
+
+	const size_t m = std::min<size_t>(4, k);
+	std::vector<uint32_t> nearest(data.size() * m);
+	std::vector<T> distances(data.size() * m);
+	model.predict_nearest_batch(data.data(), data.size(), m, nearest.data(), distances.data());
+	bool consistent = true;
+	for (size_t i = 0; i < data.size(); ++i) {
+		consistent = consistent && nearest[i * m] == predicted[i];
+		for (size_t j = 1; j < m; ++j) {
+			consistent = consistent && distances[i * m + j - 1] <= distances[i * m + j];
+		}
+	}
+	check.expect(consistent, name + "kmeans_model predict_nearest_batch agrees with predict_batch");
+}
+
+/*
+Weighted k-means and StreamKM++, which seed differently from kmeans++ and so can't be compared with
+the reference directly.
+*/
+template <typename T, size_t N>
+void verify_weighted(checker& check, const std::string& dataset, const std::vector<std::array<T, N>>& data,
+	const dkm::clustering_parameters<T>& parameters) {
+	const std::string name = dataset + " k=" + std::to_string(parameters.get_k())
+		+ " seed=" + std::to_string(parameters.get_random_seed()) + ": ";
+	const uint32_t k = parameters.get_k();
+	const std::vector<uint64_t> ones(data.size(), 1);
+	const auto unit = dkm::kmeans_weighted<T, N>(data, ones, parameters);
+	if (unit.reason == dkm::convergence_reason::converged) {
+		const auto labels = dkm::details::calculate_clusters(data, unit.means);
+		check.expect(dkm::details::calculate_means(data, labels, unit.means, k) == unit.means && labels == unit.labels,
+			name + "kmeans_weighted converges to a fixed point");
+	}
+
+	// Doubling is exact, so seeding picks the same points and every mean is the same quotient
+	const std::vector<uint64_t> twos(data.size(), 2);
+	const auto doubled = dkm::kmeans_weighted<T, N>(data, twos, parameters);
+	bool scaled = doubled.means == unit.means && doubled.iterations == unit.iterations
+		&& doubled.counts.size() == unit.counts.size() && doubled.inertia == 2 * unit.inertia;
+	for (size_t i = 0; scaled && i < unit.counts.size(); ++i) {
+		scaled = doubled.counts[i] == 2 * unit.counts[i];
+	}
+	check.expect(scaled, name + "kmeans_weighted with doubled weights");
+
+	dkm::clustering_parameters<T> unlabeled = parameters;
+	unlabeled.set_keep_labels(false);
+	dkm::span_source<T, N> span(data, 1000);
+	check.expect(dkm::kmeans_streamkm(span, unlabeled, data.size() + 1).means == unit.means,
+		name + "kmeans_streamkm with every point in the coreset");
+
+	dkm::streamkm_coreset<T, N> builder(std::max<size_t>(k, data.size() / 10), parameters.get_random_seed());
+	bool weighed = true;
+	size_t largest = 0;
+	for (size_t begin = 0; begin < data.size(); begin += 997) {
+		builder.add(data.data() + begin, std::min<size_t>(997, data.size() - begin));
+		const auto coreset = builder.coreset();
+		uint64_t weight = 0;
+		for (uint64_t w : coreset.weights) {
+			weight += w;
+		}
+		weighed = weighed && weight == builder.points();
+		largest = std::max(largest, coreset.size());
+	}
+	check.expect(weighed && largest <= builder.coreset_size(), name + "streamkm_coreset weights add up to the points");
+}
+
+/*
+The weights of an online k-means fed the data in order, checked after every batch against what its
+forgetting mode makes them add up to.
+*/
+template <typename T, size_t N>
+void verify_online(checker& check, const std::string& dataset, const std::vector<std::array<T, N>>& data, uint32_t k,
+	uint64_t seed) {
+	const std::string name = dataset + " k=" + std::to_string(k) + " seed=" + std::to_string(seed) + ": ";
+	const size_t window = data.size() / 3;
+	const double half_life = static_cast<double>(data.size()) / 10;
+	for (int mode = 0; mode < 3; ++mode) {
+		dkm::online_parameters parameters(k);
+		parameters.set_random_seed(seed);
+		parameters.set_warmup_size(4 * k);
+		if (mode == 1) {
+			parameters.set_window(window);
+		} else if (mode == 2) {
+			parameters.set_half_life(half_life);
+		}
+		dkm::online_kmeans<T, N> online(parameters);
+		const size_t warmup = parameters.get_warmup_size();
+		bool weighed = true;
+		for (size_t begin = 0; begin < data.size(); begin += 997) {
+			online.add(data.data() + begin, std::min<size_t>(997, data.size() - begin));
+			const auto snapshot = online.snapshot();
+			if (snapshot.points < warmup) {
+				weighed = weighed && snapshot.weights.empty();
+				continue;
+			}
+			double weight = 0;
+			for (double w : snapshot.weights) {
+				weight += w;
+			}
+			double expected = static_cast<double>(snapshot.points);
+			if (mode == 1) {
+				expected = static_cast<double>(std::min<uint64_t>(snapshot.points, window));
+			} else if (mode == 2) {
+				// The warmup points all count from the time of the last of them
+				const double last = static_cast<double>(snapshot.points - 1);
+				expected = warmup * std::exp2(-(last - static_cast<double>(warmup - 1)) / half_life);
+				for (uint64_t i = warmup; i < snapshot.points; ++i) {
+					expected += std::exp2(-(last - static_cast<double>(i)) / half_life);
+				}
+			}
+			weighed = weighed && std::fabs(weight - expected) <= 1e-9 * expected;
+		}
+		check.expect(weighed, name + (mode == 0 ? "online_kmeans weights add up to the points"
+			: mode == 1 ? "online_kmeans window weights add up to the window"
+			: "online_kmeans half-life weights add up to the decayed points"));
+	}
+}
+
+/*
+How far the inertia of a run which merges partial sums in another order may be from the serial
+run's. Float sums of tens of thousands of points differ in their last few bits, which can tip a
+point between two nearly equidistant means and so take a slightly different path. The paths drift
+further apart the coarser T is: runs on float were seen to end about 1.5e-5 apart, so the bound is a
+thousand times T's epsilon, and no tighter than 1e-6.
+*/
+template <typename T>
+double parallel_tolerance() {
+	return std::is_integral<T>::value ? 0.0 : std::max(1e-6, 1e3 * std::numeric_limits<T>::epsilon());
+}
+
+template <typename T, size_t N, typename L>
+bool within_parallel_tolerance(const dkm::clustering_result<T, N, L>& result, const dkm::clustering_result<T, N, L>& serial,
+	size_t points) {
+	uint64_t counted = 0;
+	for (uint64_t c : result.counts) {
+		counted += c;
+	}
+	return result.means.size() == serial.means.size() && counted == points
+		&& std::fabs(result.inertia - serial.inertia) <= parallel_tolerance<T>() * serial.inertia;
+}
+
+/*
+kmeans_cluster on several threads and kmeans_distributed over shared memory ranks (threads of this
+process standing in for processes), against the serial run.
+*/
+template <typename T, size_t N>
+void verify_parallel(checker& check, const std::string& dataset, const std::vector<std::array<T, N>>& data,
+	const dkm::clustering_parameters<T>& parameters) {
+	const std::string name = dataset + " k=" + std::to_string(parameters.get_k())
+		+ " seed=" + std::to_string(parameters.get_random_seed()) + ": ";
+	const auto serial = dkm::kmeans_cluster<T, N>(data, parameters);
+
+	for (uint32_t threads : {2u, 4u}) {
+		dkm::clustering_parameters<T> threaded = parameters;
+		threaded.set_threads(threads);
+		const auto result = dkm::kmeans_cluster<T, N>(data, threaded);
+		check.expect(within_parallel_tolerance(result, serial, data.size())
+			&& (!std::is_integral<T>::value || result.means == serial.means),
+			name + "kmeans_cluster on " + std::to_string(threads) + " threads");
+	}
+
+	for (uint32_t ranks : {2u, 3u}) {
+		const std::string segment = "/dkm_verify_" + std::to_string(::getpid()) + "_" + std::to_string(ranks);
+		std::vector<dkm::clustering_result<T, N>> results(ranks);
+		std::vector<std::string> errors(ranks);
+		std::vector<std::thread> workers;
+		for (uint32_t rank = 0; rank < ranks; ++rank) {
+			workers.emplace_back([&, rank] {
+				try {
+					dkm::shared_memory_communicator peers(segment, rank, ranks);
+					const size_t begin = data.size() * rank / ranks;
+					const size_t end = data.size() * (rank + 1) / ranks;
+					// Sampling every point seeds the same means as the serial run
+					results[rank] = dkm::kmeans_distributed<T, N>(data.data() + begin, end - begin, parameters, peers,
+						data.size());
+				} catch (const std::exception& error) {
+					errors[rank] = error.what();
+				}
+			});
+		}
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		bool agreed = true;
+		for (uint32_t rank = 0; rank < ranks; ++rank) {
+			agreed = agreed && errors[rank].empty() && results[rank].means == results[0].means
+				&& results[rank].iterations == results[0].iterations && results[rank].counts == results[0].counts;
+		}
+		check.expect(agreed && within_parallel_tolerance(results[0], serial, data.size())
+			&& (!std::is_integral<T>::value || results[0].means == serial.means),
+			name + "kmeans_distributed over " + std::to_string(ranks) + " ranks" + (errors[0].empty() ? "" : ": " + errors[0]));
+	}
+}
+
+template <typename T, size_t N>
+void verify_datasets(checker& check, size_t seeds, size_t size, size_t parallel_size, const std::string& scratch) {
+	const std::string shape = std::string(std::is_same<T, float>::value ? "float" : std::is_same<T, double>::value ? "double" : "int")
+		+ " N=" + std::to_string(N) + " ";
+	for (uint64_t seed = 1; seed <= seeds; ++seed) {
+		const uint32_t k = static_cast<uint32_t>(2 + seed * 7 % 31);
+		dkm::blob_settings blobs(k);
+		blobs.scale = 20;
+		blobs.separation = 2 + seed % 8;
+		blobs.anisotropy = 1 + seed % 5;
+		blobs.imbalance = 1 + seed % 20;
+		blobs.outlier_fraction = (seed % 4) * 0.01;
+		const auto blob_data = dkm::generate_dataset(dkm::gaussian_blobs<T, N>(size, blobs, seed));
+		const auto noise = dkm::generate_dataset(dkm::uniform_noise<T, N>(size, -500, 500, seed));
+		const auto duplicates = dkm::generate_dataset(dkm::duplicated_points<T, N>(size, 3 * k, 2, -100, 100, seed));
+
+		dkm::clustering_parameters<T> parameters(k);
+		parameters.set_random_seed(seed);
+		dkm::clustering_parameters<T> limited = parameters;
+		limited.set_max_iteration(1 + seed % 5);
+		dkm::clustering_parameters<T> thresholded = parameters;
+		thresholded.set_min_delta(static_cast<T>(std::is_integral<T>::value ? 1 : 0.01));
+
+		verify(check, shape + "blobs", blob_data, parameters, scratch);
+		verify(check, shape + "blobs", blob_data, limited, scratch);
+		verify(check, shape + "blobs", blob_data, thresholded, scratch);
+		verify(check, shape + "uniform", noise, parameters, scratch);
+		verify(check, shape + "duplicates", duplicates, parameters, scratch);
+		verify_weighted(check, shape + "blobs", blob_data, parameters);
+		verify_weighted(check, shape + "duplicates", duplicates, parameters);
+		verify_online(check, shape + "blobs", blob_data, k, seed);
+
+		const auto parallel_data = dkm::generate_dataset(dkm::gaussian_blobs<T, N>(parallel_size, blobs, seed));
+		verify_parallel(check, shape + "large blobs", parallel_data, parameters);
+	}
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	checker check = {false, 0, 0};
+	size_t seeds = 20;
+	size_t size = 5000;
+	// Four threads' worth of the points each thread is given at least
+	size_t parallel_size = 4 * dkm::details::stop_check_interval;
+	std::string scratch = "/tmp";
+	try {
+		for (int i = 1; i < argc; ++i) {
+			const std::string option = argv[i];
+			if (option == "--verbose") {
+				check.verbose = true;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				throw std::invalid_argument("missing value for " + option);
+			}
+			const std::string value = argv[++i];
+			if (option == "--seeds") {
+				seeds = std::stoul(value);
+			} else if (option == "--size") {
+				size = std::stoul(value);
+			} else if (option == "--parallel-size") {
+				parallel_size = std::stoul(value);
+			} else if (option == "--scratch") {
+				scratch = value;
+			} else {
+				throw std::invalid_argument("unknown option " + option);
+			}
+		}
+		if (size < 64 || parallel_size < 64) {
+			throw std::invalid_argument("--size and --parallel-size must be at least 64");
+		}
+		verify_datasets<float, 2>(check, seeds, size, parallel_size, scratch);
+		verify_datasets<float, 3>(check, seeds, size, parallel_size, scratch);
+		verify_datasets<double, 16>(check, seeds, size, parallel_size, scratch);
+		verify_datasets<int, 3>(check, seeds, size, parallel_size, scratch);
+	} catch (const std::exception& error) {
+		std::cerr << "dkm_verify: " << error.what() << "\n"
+			"usage: dkm_verify [--seeds S] [--size N] [--parallel-size P] [--scratch DIR] [--verbose]\n";
+		return 2;
+	}
+	std::printf("%zu of %zu checks failed\n", check.failures, check.checks);
+	return check.failures > 0 ? 1 : 0;
+}
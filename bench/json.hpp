@@ -0,0 +1,254 @@
+#pragma once
+
+#ifndef DKM_BENCH_JSON_H
+#define DKM_BENCH_JSON_H
+
+#include <cctype>
+#include <cstddef>
+#include <cstdlib>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+Just enough JSON for the benchmark tools to read back the files they write: a value tree, a parser
+and a writer. Numbers are held as doubles and strings are limited to the escapes the tools produce.
+*/
+namespace dkm_bench {
+
+struct json_value {
+	enum class kind { null, boolean, number, string, array, object };
+
+	kind type;
+	bool boolean;
+	double number;
+	std::string string;
+	std::vector<json_value> array;
+	std::map<std::string, json_value> object;
+
+	json_value() : type(kind::null), boolean(false), number(0) {}
+
+	static json_value make_boolean(bool value) {
+		json_value result;
+		result.type = kind::boolean;
+		result.boolean = value;
+		return result;
+	}
+
+	static json_value make_number(double value) {
+		json_value result;
+		result.type = kind::number;
+		result.number = value;
+		return result;
+	}
+
+	static json_value make_string(const std::string& value) {
+		json_value result;
+		result.type = kind::string;
+		result.string = value;
+		return result;
+	}
+
+	static json_value make_array() {
+		json_value result;
+		result.type = kind::array;
+		return result;
+	}
+
+	static json_value make_object() {
+		json_value result;
+		result.type = kind::object;
+		return result;
+	}
+
+	// The member `name` of an object; throws if it is missing
+	const json_value& operator[](const std::string& name) const {
+		auto member = object.find(name);
+		if (type != kind::object || member == object.end()) {
+			throw std::runtime_error("missing JSON member " + name);
+		}
+		return member->second;
+	}
+
+	bool has(const std::string& name) const { return type == kind::object && object.count(name) > 0; }
+};
+
+class json_parser {
+public:
+	explicit json_parser(const std::string& text) : _text(text), _position(0) {}
+
+	json_value parse() {
+		json_value value = parse_value();
+		skip_space();
+		if (_position != _text.size()) {
+			fail("trailing characters");
+		}
+		return value;
+	}
+
+private:
+	void fail(const std::string& message) const {
+		throw std::runtime_error("invalid JSON at offset " + std::to_string(_position) + ": " + message);
+	}
+
+	void skip_space() {
+		while (_position < _text.size() && std::isspace(static_cast<unsigned char>(_text[_position]))) {
+			++_position;
+		}
+	}
+
+	bool consume(char expected) {
+		skip_space();
+		if (_position < _text.size() && _text[_position] == expected) {
+			++_position;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char expected) {
+		if (!consume(expected)) {
+			fail(std::string("expected '") + expected + "'");
+		}
+	}
+
+	bool consume_word(const char* word) {
+		const std::string expected(word);
+		if (_text.compare(_position, expected.size(), expected) == 0) {
+			_position += expected.size();
+			return true;
+		}
+		return false;
+	}
+
+	std::string parse_string() {
+		expect('"');
+		std::string value;
+		while (_position < _text.size() && _text[_position] != '"') {
+			char c = _text[_position++];
+			if (c == '\\') {
+				if (_position >= _text.size()) {
+					fail("unterminated escape");
+				}
+				c = _text[_position++];
+				switch (c) {
+				case 'n': c = '\n'; break;
+				case 't': c = '\t'; break;
+				case 'r': c = '\r'; break;
+				case '"': case '\\': case '/': break;
+				default: fail("unsupported escape");
+				}
+			}
+			value.push_back(c);
+		}
+		if (_position >= _text.size()) {
+			fail("unterminated string");
+		}
+		++_position;
+		return value;
+	}
+
+	json_value parse_value() {
+		skip_space();
+		if (_position >= _text.size()) {
+			fail("unexpected end");
+		}
+		const char c = _text[_position];
+		if (c == '{') {
+			json_value value = json_value::make_object();
+			++_position;
+			if (consume('}')) {
+				return value;
+			}
+			do {
+				skip_space();
+				const std::string name = parse_string();
+				expect(':');
+				value.object[name] = parse_value();
+			} while (consume(','));
+			expect('}');
+			return value;
+		} else if (c == '[') {
+			json_value value = json_value::make_array();
+			++_position;
+			if (consume(']')) {
+				return value;
+			}
+			do {
+				value.array.push_back(parse_value());
+			} while (consume(','));
+			expect(']');
+			return value;
+		} else if (c == '"') {
+			return json_value::make_string(parse_string());
+		} else if (consume_word("true")) {
+			return json_value::make_boolean(true);
+		} else if (consume_word("false")) {
+			return json_value::make_boolean(false);
+		} else if (consume_word("null")) {
+			return json_value();
+		}
+		const char* begin = _text.c_str() + _position;
+		char* end = nullptr;
+		const double number = std::strtod(begin, &end);
+		if (end == begin) {
+			fail("unexpected character");
+		}
+		_position += static_cast<size_t>(end - begin);
+		return json_value::make_number(number);
+	}
+
+	const std::string& _text;
+	size_t _position;
+};
+
+inline void write_json_string(std::ostream& out, const std::string& value) {
+	out << '"';
+	for (char c : value) {
+		if (c == '"' || c == '\\') {
+			out << '\\' << c;
+		} else if (c == '\n') {
+			out << "\\n";
+		} else {
+			out << c;
+		}
+	}
+	out << '"';
+}
+
+inline void write_json_value(std::ostream& out, const json_value& value, size_t indent = 0) {
+	const std::string padding(indent + 2, ' ');
+	switch (value.type) {
+	case json_value::kind::null: out << "null"; break;
+	case json_value::kind::boolean: out << (value.boolean ? "true" : "false"); break;
+	case json_value::kind::number: out << value.number; break;
+	case json_value::kind::string: write_json_string(out, value.string); break;
+	case json_value::kind::array:
+		out << "[";
+		for (size_t i = 0; i < value.array.size(); ++i) {
+			out << (i == 0 ? "" : ", ");
+			write_json_value(out, value.array[i], indent + 2);
+		}
+		out << "]";
+		break;
+	case json_value::kind::object: {
+		out << "{";
+		bool first = true;
+		for (const auto& member : value.object) {
+			out << (first ? "\n" : ",\n") << padding;
+			write_json_string(out, member.first);
+			out << ": ";
+			write_json_value(out, member.second, indent + 2);
+			first = false;
+		}
+		out << "\n" << std::string(indent, ' ') << "}";
+		break;
+	}
+	}
+}
+
+} // namespace dkm_bench
+
+#endif /* DKM_BENCH_JSON_H */
@@ -6,25 +6,206 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <new>
 #include <random>
+#include <thread>
 #include <tuple>
 #include <type_traits>
 #include <vector>
+#if __cplusplus >= 202002L
+#include <stop_token>
+#endif
 
 /*
 DKM - A k-means implementation that is generic across variable data dimensions.
 */
 namespace dkm {
 
+/*
+The phases of a clustering run (and of prediction) which work is attributed to.
+*/
+enum class clustering_phase {
+	seeding,
+	assignment,
+	update,
+	convergence,
+	prediction
+};
+
+const size_t clustering_phase_count = 5;
+
+/*
+Whether a phase observer is being told about the start or the end of a phase.
+*/
+enum class phase_event {
+	begin,
+	end
+};
+
+/*
+Work done within one phase, as tallied by the hot-path counters:
+* distance_evaluations: point-to-mean distance (or, when predicting, dot product) computations.
+* points_processed: points assigned to a mean.
+* bytes_streamed: bytes of point data read, plus labels written.
+* allocations: buffers allocated or grown by dkm itself.
+*/
+struct phase_counters {
+	uint64_t distance_evaluations;
+	uint64_t points_processed;
+	uint64_t bytes_streamed;
+	uint64_t allocations;
+};
+
+/*
+Hot-path counters for every phase, indexed by `clustering_phase`.
+
+Counting is compiled in only when `DKM_ENABLE_COUNTERS` is defined before including dkm; otherwise
+the counting code disappears entirely and `get_counters` always returns zeros. When enabled, the
+counters are process-wide and updated with relaxed atomic additions once per chunk of points
+rather than once per point, so they stay cheap even with several threads clustering at once.
+*/
+struct counters {
+	std::array<phase_counters, clustering_phase_count> phases;
+
+	const phase_counters& operator[](clustering_phase phase) const { return phases[static_cast<size_t>(phase)]; }
+};
+
+#ifdef DKM_ENABLE_COUNTERS
+const bool counters_enabled = true;
+#else
+const bool counters_enabled = false;
+#endif
+
+/*
+These functions are all private implementation details and shouldn't be referenced outside of this
+file.
+*/
+namespace details {
+
+struct atomic_phase_counters {
+	std::atomic<uint64_t> distance_evaluations;
+	std::atomic<uint64_t> points_processed;
+	std::atomic<uint64_t> bytes_streamed;
+	std::atomic<uint64_t> allocations;
+};
+
+inline std::array<atomic_phase_counters, clustering_phase_count>& global_counters() {
+	static std::array<atomic_phase_counters, clustering_phase_count> totals = {};
+	return totals;
+}
+
+} // namespace details
+
+#ifdef DKM_ENABLE_COUNTERS
+#define DKM_COUNT(phase, counter, amount) \
+	dkm::details::global_counters()[static_cast<size_t>(dkm::clustering_phase::phase)].counter.fetch_add( \
+		static_cast<uint64_t>(amount), std::memory_order_relaxed)
+#else
+#define DKM_COUNT(phase, counter, amount) ((void)0)
+#endif
+
+/*
+A snapshot of the hot-path counters (all zero unless `DKM_ENABLE_COUNTERS` is defined).
+*/
+inline counters get_counters() {
+	counters snapshot;
+	for (size_t i = 0; i < clustering_phase_count; ++i) {
+		const auto& totals = details::global_counters()[i];
+		snapshot.phases[i].distance_evaluations = totals.distance_evaluations.load(std::memory_order_relaxed);
+		snapshot.phases[i].points_processed = totals.points_processed.load(std::memory_order_relaxed);
+		snapshot.phases[i].bytes_streamed = totals.bytes_streamed.load(std::memory_order_relaxed);
+		snapshot.phases[i].allocations = totals.allocations.load(std::memory_order_relaxed);
+	}
+	return snapshot;
+}
+
+inline void reset_counters() {
+	for (auto& totals : details::global_counters()) {
+		totals.distance_evaluations.store(0, std::memory_order_relaxed);
+		totals.points_processed.store(0, std::memory_order_relaxed);
+		totals.bytes_streamed.store(0, std::memory_order_relaxed);
+		totals.allocations.store(0, std::memory_order_relaxed);
+	}
+}
+
+/*
+Receives timed spans of work from a clustering run, e.g. to build a timeline (see dkm_trace.hpp).
+`span` is called by whichever thread did the work, possibly by several at once, so implementations
+must be thread-safe. `name`, `category` and `argument_name` are string literals, and `argument` is a
+number describing the span such as the iteration or the first point of a chunk.
+*/
+class trace_sink {
+public:
+	virtual ~trace_sink() {}
+
+	virtual void span(const char* name, const char* category, std::chrono::steady_clock::time_point begin,
+		std::chrono::steady_clock::time_point end, const char* argument_name, uint64_t argument) = 0;
+};
+
 /*
 These functions are all private implementation details and shouldn't be referenced outside of this
 file.
 */
 namespace details {
 
+/*
+Reports the time from its construction to its destruction to a trace sink as one span. Without a
+sink it does nothing, not even reading the clock.
+*/
+class trace_scope {
+public:
+	trace_scope(trace_sink* sink, const char* name, const char* category, const char* argument_name, uint64_t argument) :
+	_sink(sink), _name(name), _category(category), _argument_name(argument_name), _argument(argument),
+	_begin(sink != nullptr ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point())
+	{}
+
+	~trace_scope() {
+		if (_sink != nullptr) {
+			_sink->span(_name, _category, _begin, std::chrono::steady_clock::now(), _argument_name, _argument);
+		}
+	}
+
+	trace_scope(const trace_scope&) = delete;
+	trace_scope& operator=(const trace_scope&) = delete;
+
+private:
+	trace_sink* _sink;
+	const char* _name;
+	const char* _category;
+	const char* _argument_name;
+	uint64_t _argument;
+	std::chrono::steady_clock::time_point _begin;
+};
+
+/*
+Converts a value computed in double precision to a coordinate of type T, rounding to the nearest
+integer for integral types rather than truncating towards zero.
+*/
+template <typename T>
+T to_coordinate(double value, std::true_type /* integral */) {
+	return static_cast<T>(std::llround(value));
+}
+
+template <typename T>
+T to_coordinate(double value, std::false_type /* integral */) {
+	return static_cast<T>(value);
+}
+
+template <typename T>
+T to_coordinate(double value) {
+	return to_coordinate<T>(value, std::is_integral<T>());
+}
+
 /*
 Calculate the square of the distance between two points.
 */
@@ -48,10 +229,14 @@ Calculate the smallest distance between each of the data points and any of the i
 */
 template <typename T, size_t N>
 std::vector<T> closest_distance(
-	const std::vector<std::array<T, N>>& means, const std::vector<std::array<T, N>>& data) {
+	const std::vector<std::array<T, N>>& means, const std::array<T, N>* data, size_t count) {
 	std::vector<T> distances;
-	distances.reserve(data.size());
-	for (auto& d : data) {
+	distances.reserve(count);
+	DKM_COUNT(seeding, allocations, 1);
+	DKM_COUNT(seeding, distance_evaluations, count * means.size());
+	DKM_COUNT(seeding, bytes_streamed, count * sizeof(std::array<T, N>));
+	for (size_t i = 0; i < count; ++i) {
+		auto& d = data[i];
 		T closest = distance_squared(d, means[0]);
 		for (auto& m : means) {
 			T distance = distance_squared(d, m);
@@ -63,14 +248,32 @@ std::vector<T> closest_distance(
 	return distances;
 }
 
+template <typename T, size_t N>
+std::vector<T> closest_distance(
+	const std::vector<std::array<T, N>>& means, const std::vector<std::array<T, N>>& data) {
+	return closest_distance(means, data.data(), data.size());
+}
+
+/*
+Stop predicate for code which can't be interrupted.
+*/
+struct never_stop {
+	bool operator()() const { return false; }
+};
+
 /*
 This is an alternate initialization method based on the [kmeans++](https://en.wikipedia.org/wiki/K-means%2B%2B)
 initialization algorithm.
+
+`should_stop` is checked before each round; once it returns true the remaining means are picked
+uniformly at random instead, which needs no further passes over the data. Each round is reported
+to `trace`, if given.
 */
-template <typename T, size_t N>
-std::vector<std::array<T, N>> random_plusplus(const std::vector<std::array<T, N>>& data, uint32_t k, uint64_t seed) {
+template <typename T, size_t N, typename Stop>
+std::vector<std::array<T, N>> random_plusplus(const std::array<T, N>* data, size_t data_size, uint32_t k, uint64_t seed,
+	const Stop& should_stop, trace_sink* trace = nullptr) {
 	assert(k > 0);
-	assert(data.size() > 0);
+	assert(data_size > 0);
 	using input_size_t = typename std::array<T, N>::size_type;
 	std::vector<std::array<T, N>> means;
 	// Using a very simple PRBS generator, parameters selected according to
@@ -79,13 +282,21 @@ std::vector<std::array<T, N>> random_plusplus(const std::vector<std::array<T, N>
 
 	// Select first mean at random from the set
 	{
-		std::uniform_int_distribution<input_size_t> uniform_generator(0, data.size() - 1);
+		std::uniform_int_distribution<input_size_t> uniform_generator(0, data_size - 1);
 		means.push_back(data[uniform_generator(rand_engine)]);
 	}
 
 	for (uint32_t count = 1; count < k; ++count) {
+		if (should_stop()) {
+			std::uniform_int_distribution<input_size_t> uniform_generator(0, data_size - 1);
+			for (; count < k; ++count) {
+				means.push_back(data[uniform_generator(rand_engine)]);
+			}
+			break;
+		}
+		trace_scope round(trace, "seeding round", "seeding", "round", count);
 		// Calculate the distance to the closest mean for each data point
-		auto distances = details::closest_distance(means, data);
+		auto distances = details::closest_distance(means, data, data_size);
 		// Pick a random point weighted by the distance from existing means
 		// TODO: This might convert floating point weights to ints, distorting the distribution for small weights
 #if !defined(_MSC_VER) || _MSC_VER >= 1900
@@ -99,13 +310,24 @@ std::vector<std::array<T, N>> random_plusplus(const std::vector<std::array<T, N>
 	return means;
 }
 
+template <typename T, size_t N>
+std::vector<std::array<T, N>> random_plusplus(const std::array<T, N>* data, size_t data_size, uint32_t k, uint64_t seed) {
+	return random_plusplus(data, data_size, k, seed, never_stop());
+}
+
+template <typename T, size_t N>
+std::vector<std::array<T, N>> random_plusplus(const std::vector<std::array<T, N>>& data, uint32_t k, uint64_t seed) {
+	return random_plusplus(data.data(), data.size(), k, seed, never_stop());
+}
+
 /*
-Calculate the index of the mean a particular data point is closest to (euclidean distance)
+Calculate the index of the mean a particular data point is closest to (euclidean distance), also
+returning the squared distance to it.
 */
 template <typename T, size_t N>
-uint32_t closest_mean(const std::array<T, N>& point, const std::vector<std::array<T, N>>& means) {
+uint32_t closest_mean(const std::array<T, N>& point, const std::vector<std::array<T, N>>& means, T& smallest_distance) {
 	assert(!means.empty());
-	T smallest_distance = distance_squared(point, means[0]);
+	smallest_distance = distance_squared(point, means[0]);
 	typename std::array<T, N>::size_type index = 0;
 	T distance;
 	for (size_t i = 1; i < means.size(); ++i) {
@@ -118,6 +340,15 @@ uint32_t closest_mean(const std::array<T, N>& point, const std::vector<std::arra
 	return index;
 }
 
+/*
+Calculate the index of the mean a particular data point is closest to (euclidean distance)
+*/
+template <typename T, size_t N>
+uint32_t closest_mean(const std::array<T, N>& point, const std::vector<std::array<T, N>>& means) {
+	T smallest_distance;
+	return closest_mean(point, means, smallest_distance);
+}
+
 /*
 Calculate the index of the mean each data point is closest to (euclidean distance).
 */
@@ -183,8 +414,368 @@ bool deltas_below_limit(const std::vector<T>& deltas, T min_delta) {
 	return true;
 }
 
+/*
+Running per-cluster sums and sizes gathered while assigning points, plus the per-cluster sum of the
+squared distances from each point to the mean it was assigned to (the inertia) and the number of
+points whose label changed. Accumulators over different parts of the data can be merged.
+*/
+template <typename T, size_t N>
+struct accumulator {
+	std::vector<std::array<T, N>> sums;
+	std::vector<uint64_t> counts;
+	std::vector<double> inertia;
+	uint64_t changed;
+
+	accumulator() : changed(0) {}
+
+	void reset(size_t k) {
+		if (sums.capacity() < k) {
+			DKM_COUNT(assignment, allocations, 3);
+		}
+		sums.assign(k, std::array<T, N>());
+		counts.assign(k, 0);
+		inertia.assign(k, 0);
+		changed = 0;
+	}
+
+	double total_inertia() const {
+		double total = 0;
+		for (double i : inertia) {
+			total += i;
+		}
+		return total;
+	}
+
+	void merge(const accumulator& other) {
+		assert(other.sums.size() == sums.size());
+		for (size_t i = 0; i < sums.size(); ++i) {
+			for (size_t j = 0; j < N; ++j) {
+				sums[i][j] += other.sums[i][j];
+			}
+			counts[i] += other.counts[i];
+			inertia[i] += other.inertia[i];
+		}
+		changed += other.changed;
+	}
+};
+
+inline bool delta_exceeds(double d_squared, double min_delta, std::true_type) {
+	return d_squared > min_delta * min_delta;
+}
+
+/*
+For integral types `deltas` truncates each distance, so it exceeds the limit only once the squared
+distance reaches (min_delta + 1)^2.
+*/
+inline bool delta_exceeds(double d_squared, double min_delta, std::false_type) {
+	return d_squared >= (min_delta + 1) * (min_delta + 1);
+}
+
+/*
+Equivalent to `!deltas_below_limit(deltas(old_means, means), min_delta)` without taking a square
+root per mean or allocating the deltas.
+*/
+template <typename T, size_t N>
+bool any_delta_above(const std::vector<std::array<T, N>>& old_means,
+	const std::vector<std::array<T, N>>& means, T min_delta) {
+	assert(old_means.size() == means.size());
+	if (min_delta < 0) {
+		return true;
+	}
+	DKM_COUNT(convergence, distance_evaluations, means.size());
+	for (size_t i = 0; i < means.size(); ++i) {
+		if (delta_exceeds(static_cast<double>(distance_squared(means[i], old_means[i])),
+			static_cast<double>(min_delta), std::is_floating_point<T>())) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+The largest distance between corresponding old and new means.
+*/
+template <typename T, size_t N>
+double max_shift(const std::vector<std::array<T, N>>& old_means, const std::vector<std::array<T, N>>& means) {
+	double largest = 0;
+	DKM_COUNT(convergence, distance_evaluations, means.size());
+	for (size_t i = 0; i < means.size(); ++i) {
+		largest = std::max(largest, static_cast<double>(distance_squared(means[i], old_means[i])));
+	}
+	return std::sqrt(largest);
+}
+
+/*
+64 bit FNV-1a hash of the means, used to recognise means seen two iterations ago without keeping a
+copy of them.
+*/
+template <typename T, size_t N>
+uint64_t means_fingerprint(const std::vector<std::array<T, N>>& means) {
+	uint64_t hash = 14695981039346656037ull;
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(means.data());
+	for (size_t i = 0; i < means.size() * sizeof(std::array<T, N>); ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+Assign each of `count` points to its closest mean and add it to that mean's running sum in the same
+pass over the data. Labels are written to `labels` unless it is null, counting the points whose
+label differs from the one already stored there. Points are summed in the same
+order as `calculate_means` does, so `finish_means` produces bit-identical means to the separate
+`calculate_clusters` and `calculate_means` passes.
+*/
+template <typename T, size_t N, typename L>
+void assign_and_accumulate(const std::array<T, N>* data, size_t count,
+	const std::vector<std::array<T, N>>& means, L* labels, accumulator<T, N>& totals) {
+	DKM_COUNT(assignment, distance_evaluations, count * means.size());
+	DKM_COUNT(assignment, points_processed, count);
+	DKM_COUNT(assignment, bytes_streamed, count * (sizeof(std::array<T, N>) + (labels != nullptr ? sizeof(L) : 0)));
+	for (size_t i = 0; i < count; ++i) {
+		T distance;
+		uint32_t cluster = closest_mean(data[i], means, distance);
+		if (labels != nullptr) {
+			totals.changed += labels[i] != static_cast<L>(cluster);
+			labels[i] = static_cast<L>(cluster);
+		}
+		auto& sum = totals.sums[cluster];
+		totals.counts[cluster] += 1;
+		totals.inertia[cluster] += static_cast<double>(distance);
+		for (size_t j = 0; j < N; ++j) {
+			sum[j] += data[i][j];
+		}
+	}
+}
+
+/*
+Turn the sums and counts gathered by `assign_and_accumulate` into means, written to `means` whose
+storage is reused across iterations. Clusters which didn't receive any points keep their old mean.
+*/
+template <typename T, size_t N>
+void finish_means(const accumulator<T, N>& totals, const std::vector<std::array<T, N>>& old_means,
+	std::vector<std::array<T, N>>& means) {
+	if (means.capacity() < totals.sums.size()) {
+		DKM_COUNT(update, allocations, 1);
+	}
+	means = totals.sums;
+	for (size_t i = 0; i < means.size(); ++i) {
+		if (totals.counts[i] == 0) {
+			means[i] = old_means[i];
+		} else {
+			for (size_t j = 0; j < N; ++j) {
+				means[i][j] /= static_cast<T>(totals.counts[i]);
+			}
+		}
+	}
+}
+
+/*
+The smallest unsigned type able to hold the labels 0 to K-1.
+*/
+template <uint64_t K>
+struct label_type_for {
+	using type = typename std::conditional<K <= (uint64_t(1) << 8), uint8_t,
+		typename std::conditional<K <= (uint64_t(1) << 16), uint16_t, uint32_t>::type>::type;
+};
+
+/*
+Whether every label from 0 to k-1 can be represented by L.
+*/
+template <typename L>
+bool labels_fit(uint32_t k) {
+	static_assert(std::is_integral<L>::value && std::is_unsigned<L>::value,
+		"labels must be stored in an unsigned integral type (e.g. uint8_t, uint16_t, uint32_t)");
+	return k == 0 || uint64_t(k - 1) <= uint64_t(std::numeric_limits<L>::max());
+}
+
+/*
+Number of elements each mean occupies in a prediction-optimized layout. Dimensions smaller than a
+16 byte vector register are rounded up to the next power of two, larger ones to a whole number of
+registers. The padding elements are always zero so they don't affect any dot products.
+*/
+template <typename T, size_t N>
+struct padded_dimension {
+	static constexpr size_t lanes = sizeof(T) < 16 ? 16 / sizeof(T) : 1;
+	static constexpr size_t value = N >= lanes ? (N + lanes - 1) / lanes * lanes
+		: N <= 1 ? 1 : N <= 2 ? 2 : N <= 4 ? 4 : N <= 8 ? 8 : lanes;
+};
+
+/*
+Allocate a zeroed block of memory with the requested alignment. The returned pointer owns the
+allocation, which is released once the last copy of it is destroyed.
+*/
+inline std::shared_ptr<void> allocate_aligned(size_t bytes, size_t alignment) {
+	void* raw = std::calloc(bytes + alignment, 1);
+	if (raw == nullptr) {
+		throw std::bad_alloc();
+	}
+	auto address = reinterpret_cast<std::uintptr_t>(raw);
+	void* aligned = reinterpret_cast<void*>((address + alignment - 1) / alignment * alignment);
+	return std::shared_ptr<void>(aligned, [raw](void*) { std::free(raw); });
+}
+
+/*
+Dot product over a padded row. Both rows must contain S elements (the padded dimension).
+*/
+template <typename T, size_t S>
+T padded_dot(const T* a, const T* b) {
+	T sum = T();
+	for (size_t i = 0; i < S; ++i) {
+		sum += a[i] * b[i];
+	}
+	return sum;
+}
+
+/*
+Copy a point into a zero padded row so it can be used with `padded_dot`.
+*/
+template <typename T, size_t N, size_t S>
+void pad_point(const std::array<T, N>& point, std::array<T, S>& padded) {
+	for (size_t i = 0; i < N; ++i) {
+		padded[i] = point[i];
+	}
+	for (size_t i = N; i < S; ++i) {
+		padded[i] = T();
+	}
+}
+
+/*
+Assignment kernel used for prediction. Rather than computing the full squared distance to each
+mean it relies on `|x - m|^2 = |x|^2 - 2 x.m + |m|^2`; `|x|^2` is the same for every mean so the
+closest mean is the one with the smallest `|m|^2 - 2 x.m`. `means` is a k * S row-major array of
+padded means and `norms` holds the squared norm of each of them.
+
+Points are processed in small tiles so each mean row is loaded once per tile instead of once per
+point, which keeps large models in cache while batch predicting.
+*/
+template <typename T, size_t N, size_t S, typename L>
+void closest_means_padded(const std::array<T, N>* points, size_t count,
+	const T* means, const T* norms, uint32_t k, L* labels) {
+	assert(k > 0);
+	DKM_COUNT(prediction, distance_evaluations, count * k);
+	DKM_COUNT(prediction, points_processed, count);
+	DKM_COUNT(prediction, bytes_streamed, count * (sizeof(std::array<T, N>) + sizeof(L)));
+	const size_t tile = 4;
+	std::array<std::array<T, S>, tile> padded;
+	std::array<T, tile> best_score;
+	std::array<uint32_t, tile> best_index;
+	for (size_t begin = 0; begin < count; begin += tile) {
+		const size_t size = std::min(tile, count - begin);
+		for (size_t p = 0; p < size; ++p) {
+			pad_point(points[begin + p], padded[p]);
+			best_score[p] = norms[0] - T(2) * padded_dot<T, S>(padded[p].data(), means);
+			best_index[p] = 0;
+		}
+		for (uint32_t m = 1; m < k; ++m) {
+			const T* mean = means + m * S;
+			for (size_t p = 0; p < size; ++p) {
+				T score = norms[m] - T(2) * padded_dot<T, S>(padded[p].data(), mean);
+				if (score < best_score[p]) {
+					best_score[p] = score;
+					best_index[p] = m;
+				}
+			}
+		}
+		for (size_t p = 0; p < size; ++p) {
+			labels[begin + p] = static_cast<L>(best_index[p]);
+		}
+	}
+}
+
+/*
+Find the `m` closest means to each point using the same scoring as `closest_means_padded`. The
+candidates are kept in a small sorted array of at most `Capacity` entries which is updated by
+insertion, so no distances are stored and nothing is sorted beyond the `m` best. Results are
+written row-major, `m` per point, ordered from closest to furthest with ties going to the lower
+index. Distances are the squared euclidean distances (clamped at zero to hide rounding).
+*/
+template <typename T, size_t N, size_t S, size_t Capacity>
+void nearest_means_padded(const std::array<T, N>* points, size_t count,
+	const T* means, const T* norms, uint32_t k, size_t m, uint32_t* labels, T* distances) {
+	assert(m > 0 && m <= Capacity && m <= k);
+	DKM_COUNT(prediction, distance_evaluations, count * k);
+	DKM_COUNT(prediction, points_processed, count);
+	DKM_COUNT(prediction, bytes_streamed, count * (sizeof(std::array<T, N>) + m * (sizeof(uint32_t) + sizeof(T))));
+	std::array<T, S> padded;
+	std::array<T, Capacity> best_score;
+	std::array<uint32_t, Capacity> best_index;
+	for (size_t p = 0; p < count; ++p) {
+		pad_point(points[p], padded);
+		size_t found = 0;
+		for (uint32_t i = 0; i < k; ++i) {
+			T score = norms[i] - T(2) * padded_dot<T, S>(padded.data(), means + i * S);
+			if (found == m && !(score < best_score[m - 1])) {
+				continue;
+			}
+			size_t slot = found < m ? found++ : m - 1;
+			while (slot > 0 && score < best_score[slot - 1]) {
+				best_score[slot] = best_score[slot - 1];
+				best_index[slot] = best_index[slot - 1];
+				--slot;
+			}
+			best_score[slot] = score;
+			best_index[slot] = i;
+		}
+		const T point_norm = padded_dot<T, S>(padded.data(), padded.data());
+		for (size_t j = 0; j < m; ++j) {
+			labels[p * m + j] = best_index[j];
+			distances[p * m + j] = std::max(T(), point_norm + best_score[j]);
+		}
+	}
+}
+
 } // namespace details
 
+/*
+label_type_for<K> is the smallest label type able to tell K clusters apart: uint8_t up to 256
+clusters, uint16_t up to 65536 and uint32_t beyond that. Passing it as the label type of
+`kmeans_cluster` or `kmeans_lloyd` when k has a known upper bound shrinks the label buffer, which is
+written on every iteration, to a half or a quarter of its default size.
+*/
+template <uint64_t K>
+using label_type_for = typename details::label_type_for<K>::type;
+
+/*
+cancellation_token lets another thread ask a running clustering job to stop early. Copies share the
+same state, so keep one copy and hand another to `clustering_parameters::set_cancellation_token`.
+*/
+class cancellation_token {
+public:
+	cancellation_token() : _stop(std::make_shared<std::atomic<bool>>(false)) {}
+
+	void request_stop() { _stop->store(true, std::memory_order_relaxed); }
+	bool stop_requested() const { return _stop->load(std::memory_order_relaxed); }
+
+private:
+	std::shared_ptr<std::atomic<bool>> _stop;
+};
+
+/*
+Information passed to an iteration observer after every completed Lloyd iteration:
+* iteration: the number of iterations completed so far, starting at 1.
+* assignment_time: time spent assigning points to means and accumulating them, i.e. the pass over
+  the data.
+* update_time: time spent turning the accumulated sums into the new means.
+* convergence_time: time spent checking whether to stop.
+* changed_labels: how many points changed cluster in this iteration; every point counts as changed
+  in the first one. Always 0 when labels aren't tracked (labels not kept, chunked data sources).
+* inertia: the sum of squared distances from each point to the mean it was assigned to.
+* max_shift: the largest distance any mean moved in this iteration.
+
+The timings and the shift are only measured while an observer is set.
+*/
+struct iteration_stats {
+	uint64_t iteration;
+	std::chrono::steady_clock::duration assignment_time;
+	std::chrono::steady_clock::duration update_time;
+	std::chrono::steady_clock::duration convergence_time;
+	uint64_t changed_labels;
+	double inertia;
+	double max_shift;
+};
+
 /*
 clustering_parameters is the configuration used for running the kmeans_lloyd algorithm.
 
@@ -195,8 +786,31 @@ of optional parameters, including:
   calculated in the last iteration before termination.
 * Minimum delta; the algorithm will terminate if the change in position of all means is
   smaller than the specified distance.
+* Maximum changed labels, as a count or as a fraction of the data points; the algorithm will
+  terminate once an iteration changes the label of no more points than this. The changes are
+  counted while assigning points, so this is free, but it needs labels to be kept.
+* Minimum inertia improvement; the algorithm will terminate once an iteration reduces the inertia
+  by less than this fraction of its previous value.
+* Deadline and cancellation; the algorithm will stop once the deadline passes or a stop is
+  requested through a `cancellation_token` (or a `std::stop_token` in C++20). Both are checked
+  between chunks of each assignment pass, so the reaction time doesn't grow with the data size.
+  The means of the last completed iteration are returned.
 * Random seed; if present, this will be used in place of `std::random_device` for kmeans++
   initialization. This can be used to ensure reproducible/deterministic behavior.
+* Keep labels; enabled by default. When disabled no per-point cluster labels are stored at all,
+  which saves 4 bytes per data point when only the means are needed.
+* Threads; the number of threads each assignment pass over in-memory data is split across, 1 by
+  default. The points are split into one contiguous range per thread and the ranges' sums are
+  merged in order, so results are reproducible for a given thread count but can differ in the last
+  bits between thread counts.
+* Iteration observer; called with an `iteration_stats` after each iteration on the thread running
+  the clustering, e.g. to report progress or to record where the time goes.
+* Phase observer; called on the thread running the clustering as each phase (seeding, and the
+  assignment, update and convergence steps of every iteration) begins and ends, e.g. to sample
+  profiling counters around them. Phases never nest, and every begin is matched by an end even when
+  the run is stopped or throws.
+* Trace sink; receives spans for the phases, the kmeans++ rounds, each iteration and each chunk of
+  points assigned, e.g. to write a timeline with `chrome_trace` (see dkm_trace.hpp).
 */
 template <typename T>
 class clustering_parameters {
@@ -205,7 +819,14 @@ public:
 	_k(k),
 	_has_max_iter(false), _max_iter(),
 	_has_min_delta(false), _min_delta(),
-	_has_rand_seed(false), _rand_seed()
+	_has_rand_seed(false), _rand_seed(),
+	_keep_labels(true),
+	_has_max_changed(false), _max_changed(),
+	_has_max_changed_fraction(false), _max_changed_fraction(),
+	_has_min_improvement(false), _min_improvement(),
+	_has_deadline(false), _deadline(),
+	_has_cancellation_token(false), _cancellation_token(),
+	_threads(1)
 	{}
 
 	void set_max_iteration(uint64_t max_iter)
@@ -226,14 +847,94 @@ public:
 		_has_rand_seed = true;
 	}
 
+	void set_keep_labels(bool keep_labels)
+	{
+		_keep_labels = keep_labels;
+	}
+
+	void set_max_changed_labels(uint64_t max_changed)
+	{
+		_max_changed = max_changed;
+		_has_max_changed = true;
+	}
+
+	void set_max_changed_fraction(double max_changed_fraction)
+	{
+		_max_changed_fraction = max_changed_fraction;
+		_has_max_changed_fraction = true;
+	}
+
+	void set_min_inertia_improvement(double min_improvement)
+	{
+		_min_improvement = min_improvement;
+		_has_min_improvement = true;
+	}
+
+	void set_deadline(std::chrono::steady_clock::time_point deadline)
+	{
+		_deadline = deadline;
+		_has_deadline = true;
+	}
+
+	void set_cancellation_token(cancellation_token token)
+	{
+		_cancellation_token = std::move(token);
+		_has_cancellation_token = true;
+	}
+
+	void set_threads(uint32_t threads)
+	{
+		assert(threads > 0);
+		_threads = threads;
+	}
+
+	void set_iteration_observer(std::function<void(const iteration_stats&)> observer)
+	{
+		_observer = std::move(observer);
+	}
+
+	void set_phase_observer(std::function<void(clustering_phase, phase_event)> observer)
+	{
+		_phase_observer = std::move(observer);
+	}
+
+	void set_trace_sink(std::shared_ptr<trace_sink> sink)
+	{
+		_trace_sink = std::move(sink);
+	}
+
+#if __cplusplus >= 202002L
+	void set_stop_token(std::stop_token token)
+	{
+		_stop_token = std::move(token);
+	}
+
+	const std::stop_token& get_stop_token() const { return _stop_token; }
+#endif
+
 	bool has_max_iteration() const { return _has_max_iter; }
 	bool has_min_delta() const { return _has_min_delta; }
 	bool has_random_seed() const { return _has_rand_seed; }
+	bool has_max_changed_labels() const { return _has_max_changed; }
+	bool has_max_changed_fraction() const { return _has_max_changed_fraction; }
+	bool has_min_inertia_improvement() const { return _has_min_improvement; }
+	bool has_deadline() const { return _has_deadline; }
+	bool has_cancellation_token() const { return _has_cancellation_token; }
 
 	uint32_t get_k() const { return _k; };
 	uint64_t get_max_iteration() const { return _max_iter; }
 	T get_min_delta() const { return _min_delta; }
 	uint64_t get_random_seed() const { return _rand_seed; }
+	bool get_keep_labels() const { return _keep_labels; }
+	uint64_t get_max_changed_labels() const { return _max_changed; }
+	double get_max_changed_fraction() const { return _max_changed_fraction; }
+	double get_min_inertia_improvement() const { return _min_improvement; }
+	std::chrono::steady_clock::time_point get_deadline() const { return _deadline; }
+	const cancellation_token& get_cancellation_token() const { return _cancellation_token; }
+	uint32_t get_threads() const { return _threads; }
+	const std::function<void(const iteration_stats&)>& get_iteration_observer() const { return _observer; }
+	const std::function<void(clustering_phase, phase_event)>& get_phase_observer() const { return _phase_observer; }
+	trace_sink* get_trace_sink() const { return _trace_sink.get(); }
 
 private:
 	uint32_t _k;
@@ -243,8 +944,352 @@ private:
 	T _min_delta;
 	bool _has_rand_seed;
 	uint64_t _rand_seed;
+	bool _keep_labels;
+	bool _has_max_changed;
+	uint64_t _max_changed;
+	bool _has_max_changed_fraction;
+	double _max_changed_fraction;
+	bool _has_min_improvement;
+	double _min_improvement;
+	bool _has_deadline;
+	std::chrono::steady_clock::time_point _deadline;
+	bool _has_cancellation_token;
+	cancellation_token _cancellation_token;
+	uint32_t _threads;
+	std::function<void(const iteration_stats&)> _observer;
+	std::function<void(clustering_phase, phase_event)> _phase_observer;
+	std::shared_ptr<trace_sink> _trace_sink;
+#if __cplusplus >= 202002L
+	std::stop_token _stop_token;
+#endif
 };
 
+/*
+Why a clustering run stopped iterating:
+* converged: an iteration left every mean exactly where it was.
+* oscillating: the means returned to where they were two iterations earlier.
+* max_iterations: the maximum iteration count was reached.
+* min_delta: no mean moved further than the minimum delta.
+* labels_stable: no more labels changed than the maximum changed count or fraction.
+* inertia_stalled: the inertia improved by less than the minimum relative improvement.
+* deadline: the deadline passed before any other condition was met.
+* cancelled: a stop was requested before any other condition was met.
+*/
+enum class convergence_reason {
+	converged,
+	oscillating,
+	max_iterations,
+	min_delta,
+	labels_stable,
+	inertia_stalled,
+	deadline,
+	cancelled
+};
+
+/*
+The outcome of a clustering run:
+* means: the mean of each cluster from 0 to k-1.
+* labels: the cluster (0 to k-1) each data point was assigned to in the final iteration, or empty
+  if labels weren't kept (see `clustering_parameters::set_keep_labels`). Labels are stored as L,
+  which must be able to represent k-1 (see `label_type_for`).
+* counts: the number of data points assigned to each cluster in the final iteration.
+* inertia: the sum of squared distances from each data point to the mean it was assigned to in the
+  final iteration, i.e. measured against the means before the last update. Once converged these
+  are the same as `means`.
+* cluster_inertia: the same sum split by cluster.
+* iterations: the number of Lloyd iterations run.
+* reason: why the iterations stopped.
+
+When a run is stopped by its deadline or a cancellation, the iteration in progress is abandoned:
+means, counts and inertia are those of the last completed iteration and the labels of the points
+the abandoned pass didn't reach keep their previous assignment. If no iteration completed, means are
+the seeds, counts and cluster_inertia hold k zeros and inertia is 0.
+
+Everything is gathered during the final assignment pass, so none of it needs another pass over the
+data. The result is meant to be moved out of rather than copied.
+*/
+template <typename T, size_t N, typename L = uint32_t>
+struct clustering_result {
+	std::vector<std::array<T, N>> means;
+	std::vector<L> labels;
+	std::vector<uint64_t> counts;
+	double inertia;
+	std::vector<double> cluster_inertia;
+	uint64_t iterations;
+	convergence_reason reason;
+
+	clustering_result() : inertia(0), iterations(0), reason(convergence_reason::converged) {}
+};
+
+namespace details {
+
+/*
+Checks the deadline and cancellation requests configured in a `clustering_parameters`. Checking is
+cheap (an atomic load and a clock read) but still meant to be done per chunk rather than per point.
+It may be checked from several threads at once.
+*/
+template <typename T>
+class stop_condition {
+public:
+	explicit stop_condition(const clustering_parameters<T>& parameters) :
+	_parameters(parameters), _reason(convergence_reason::converged)
+	{}
+
+	bool operator()() const {
+		if (_parameters.has_cancellation_token() && _parameters.get_cancellation_token().stop_requested()) {
+			_reason.store(convergence_reason::cancelled, std::memory_order_relaxed);
+			return true;
+		}
+#if __cplusplus >= 202002L
+		if (_parameters.get_stop_token().stop_requested()) {
+			_reason.store(convergence_reason::cancelled, std::memory_order_relaxed);
+			return true;
+		}
+#endif
+		if (_parameters.has_deadline() && std::chrono::steady_clock::now() >= _parameters.get_deadline()) {
+			_reason.store(convergence_reason::deadline, std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+
+	// Why the last check returned true
+	convergence_reason reason() const { return _reason.load(std::memory_order_relaxed); }
+
+private:
+	const clustering_parameters<T>& _parameters;
+	mutable std::atomic<convergence_reason> _reason;
+};
+
+inline const char* phase_name(clustering_phase phase) {
+	static const char* const names[clustering_phase_count] = {"seeding", "assignment", "update", "convergence", "prediction"};
+	return names[static_cast<size_t>(phase)];
+}
+
+/*
+Reports the beginning of a phase to the phase observer, if there is one, on construction and its end
+on destruction, and the phase as a whole to the trace sink.
+*/
+class phase_scope {
+public:
+	template <typename T>
+	phase_scope(const clustering_parameters<T>& parameters, clustering_phase phase, uint64_t iteration = 0) :
+	_observer(parameters.get_phase_observer()), _phase(phase),
+	_trace(parameters.get_trace_sink(), phase_name(phase), "phase", "iteration", iteration)
+	{
+		if (_observer) {
+			_observer(_phase, phase_event::begin);
+		}
+	}
+
+	~phase_scope() {
+		if (_observer) {
+			_observer(_phase, phase_event::end);
+		}
+	}
+
+	phase_scope(const phase_scope&) = delete;
+	phase_scope& operator=(const phase_scope&) = delete;
+
+private:
+	const std::function<void(clustering_phase, phase_event)>& _observer;
+	clustering_phase _phase;
+	trace_scope _trace;
+};
+
+/*
+Number of points assigned between checks of the stop condition.
+*/
+const size_t stop_check_interval = size_t(1) << 14;
+
+/*
+Assign and accumulate `count` points split over `threads` threads, one contiguous range each. The
+calling thread takes the first range into `totals`; the others use `partials`, which keeps its
+buffers between calls, and are merged into `totals` in order. Returns false if `should_stop` asked
+for the pass to be abandoned.
+*/
+template <typename T, size_t N, typename L>
+bool parallel_assign_and_accumulate(const std::array<T, N>* data, size_t count,
+	const std::vector<std::array<T, N>>& means, L* labels, accumulator<T, N>& totals,
+	std::vector<accumulator<T, N>>& partials, uint32_t threads, const stop_condition<T>& should_stop,
+	trace_sink* trace) {
+	assert(threads > 0);
+	partials.resize(threads - 1);
+	std::atomic<bool> aborted(false);
+	auto work = [&](size_t part, accumulator<T, N>& target) {
+		const size_t end = count * (part + 1) / threads;
+		for (size_t begin = count * part / threads; begin < end; begin += stop_check_interval) {
+			if (aborted.load(std::memory_order_relaxed)) {
+				return;
+			}
+			if (should_stop()) {
+				aborted.store(true, std::memory_order_relaxed);
+				return;
+			}
+			trace_scope chunk(trace, "chunk", "assignment", "first point", begin);
+			assign_and_accumulate(data + begin, std::min(stop_check_interval, end - begin), means,
+				labels ? labels + begin : nullptr, target);
+		}
+	};
+	std::vector<std::thread> workers;
+	try {
+		for (uint32_t part = 1; part < threads; ++part) {
+			partials[part - 1].reset(means.size());
+			workers.push_back(std::thread(work, part, std::ref(partials[part - 1])));
+		}
+		work(0, totals);
+	} catch (...) {
+		aborted.store(true, std::memory_order_relaxed);
+		for (auto& worker : workers) {
+			worker.join();
+		}
+		throw;
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	if (aborted.load(std::memory_order_relaxed)) {
+		return false;
+	}
+	trace_scope reduction(trace, "reduction", "assignment", "threads", threads);
+	for (const auto& partial : partials) {
+		totals.merge(partial);
+	}
+	return true;
+}
+
+/*
+One assignment pass over `count` points held in memory, in chunks of `stop_check_interval` checking
+`should_stop` between them, split over `threads` threads when there is more than one (see
+`parallel_assign_and_accumulate`). Returns false if the pass was abandoned.
+*/
+template <typename T, size_t N, typename L>
+bool assign_in_memory(const std::array<T, N>* data, size_t count, const std::vector<std::array<T, N>>& means,
+	L* labels, accumulator<T, N>& totals, std::vector<accumulator<T, N>>& partials, uint32_t threads,
+	const stop_condition<T>& should_stop, trace_sink* trace) {
+	if (threads > 1) {
+		return parallel_assign_and_accumulate(data, count, means, labels, totals, partials, threads, should_stop, trace);
+	}
+	for (size_t begin = 0; begin < count; begin += stop_check_interval) {
+		if (begin > 0 && should_stop()) {
+			return false;
+		}
+		trace_scope chunk(trace, "chunk", "assignment", "first point", begin);
+		assign_and_accumulate(data + begin, std::min(stop_check_interval, count - begin), means,
+			labels ? labels + begin : nullptr, totals);
+	}
+	return true;
+}
+
+/*
+Run Lloyd iterations starting from `result.means` until convergence is reached or the maximum
+iteration count is hit. The data is only ever touched through `pass`, which is called once per
+iteration with the current means and a reset accumulator, and must assign every point to its
+closest mean while accumulating it (see `assign_and_accumulate`). This lets the same loop drive
+in-memory, memory mapped and streamed datasets. `tracks_labels` tells whether the pass writes labels
+and therefore counts changed ones. On return `result` holds the final means, the counts and inertia
+of the final pass, the iteration count and why the iterations stopped.
+
+The pass should check `should_stop` between chunks of points and return false if it gave up part
+way, in which case that iteration is discarded and the reason is taken from `should_stop`, which is
+usually a `stop_condition` but may be anything with the same `operator()` and `reason()`.
+
+Only the current and previous means are kept; means from two iterations ago are recognised by their
+fingerprint.
+*/
+template <typename T, size_t N, typename L, typename StopCondition, typename Pass>
+void lloyd_iterations(clustering_result<T, N, L>& result, const clustering_parameters<T>& parameters,
+	const StopCondition& should_stop, bool tracks_labels, Pass pass) {
+	const uint32_t k = parameters.get_k();
+	std::vector<std::array<T, N>>& means = result.means;
+	std::vector<std::array<T, N>> old_means;
+	uint64_t old_old_fingerprint = 0;
+	uint64_t old_fingerprint = 0;
+	double previous_inertia = 0;
+	accumulator<T, N> totals;
+	accumulator<T, N> completed;
+	const auto& observer = parameters.get_iteration_observer();
+	typedef std::chrono::steady_clock clock;
+	// Calculate new means until convergence is reached or we hit the maximum iteration count
+	uint64_t count = 0;
+	while (true) {
+		trace_scope iteration(parameters.get_trace_sink(), "iteration", "iteration", "iteration", count + 1);
+		const clock::time_point started = observer ? clock::now() : clock::time_point();
+		{
+			phase_scope scope(parameters, clustering_phase::assignment, count + 1);
+			totals.reset(k);
+			if (should_stop() || !pass(static_cast<const std::vector<std::array<T, N>>&>(means), totals)) {
+				result.reason = should_stop.reason();
+				break;
+			}
+		}
+		const clock::time_point assigned = observer ? clock::now() : clock::time_point();
+		{
+			phase_scope scope(parameters, clustering_phase::update, count + 1);
+			old_old_fingerprint = old_fingerprint;
+			old_fingerprint = means_fingerprint(means);
+			std::swap(old_means, means);
+			finish_means(totals, old_means, means);
+		}
+		++count;
+		const clock::time_point updated = observer ? clock::now() : clock::time_point();
+		uint64_t points = 0;
+		for (uint64_t c : totals.counts) {
+			points += c;
+		}
+		// On the first pass every label is new
+		const uint64_t changed = !tracks_labels ? 0 : count == 1 ? points : totals.changed;
+		const double inertia = totals.total_inertia();
+		bool finished = true;
+		{
+			phase_scope scope(parameters, clustering_phase::convergence, count);
+			if (means == old_means) {
+				result.reason = convergence_reason::converged;
+			} else if (count > 1 && means_fingerprint(means) == old_old_fingerprint) {
+				result.reason = convergence_reason::oscillating;
+			} else if (parameters.has_max_iteration() && count == parameters.get_max_iteration()) {
+				result.reason = convergence_reason::max_iterations;
+			} else if (parameters.has_min_delta() && !any_delta_above(old_means, means, parameters.get_min_delta())) {
+				result.reason = convergence_reason::min_delta;
+			} else if (tracks_labels && ((parameters.has_max_changed_labels() && changed <= parameters.get_max_changed_labels())
+				|| (parameters.has_max_changed_fraction() && changed <= parameters.get_max_changed_fraction() * points))) {
+				result.reason = convergence_reason::labels_stable;
+			} else if (parameters.has_min_inertia_improvement() && count > 1
+				&& previous_inertia - inertia < parameters.get_min_inertia_improvement() * previous_inertia) {
+				result.reason = convergence_reason::inertia_stalled;
+			} else {
+				finished = false;
+			}
+		}
+		if (observer) {
+			iteration_stats stats;
+			stats.iteration = count;
+			stats.assignment_time = assigned - started;
+			stats.update_time = updated - assigned;
+			stats.convergence_time = clock::now() - updated;
+			stats.changed_labels = changed;
+			stats.inertia = inertia;
+			stats.max_shift = max_shift(old_means, means);
+			observer(stats);
+		}
+		std::swap(completed, totals);
+		if (finished) {
+			break;
+		}
+		previous_inertia = inertia;
+	}
+	if (count == 0) {
+		// Nothing completed, so every cluster reports zero points rather than being left out
+		completed.reset(k);
+	}
+	result.counts = std::move(completed.counts);
+	result.inertia = completed.total_inertia();
+	result.cluster_inertia = std::move(completed.inertia);
+	result.iterations = count;
+}
+
+} // namespace details
+
 /*
 Implementation of k-means generic across the data type and the dimension of each data item. Expects
 the data to be a vector of fixed-size arrays. Generic parameters are the type of the base data (T)
@@ -256,10 +1301,10 @@ Takes a `clustering_parameters` struct for algorithm configuration. See the comm
 `clustering_parameters` struct for more information about the configuration values and how they
 affect the algorithm.
 
-Returns a std::tuple containing:
-  0: A vector holding the means for each cluster from 0 to k-1.
-  1: A vector containing the cluster number (0 to k-1) for each corresponding element of the input
-	 data vector.
+Returns a movable `clustering_result` holding the means, the cluster assignment of each data point
+(unless disabled with `clustering_parameters::set_keep_labels`), the size and inertia of each
+cluster, the total inertia, the number of iterations run and why they stopped. All of these are
+gathered while assigning the points, so no extra pass over the data is made.
 
 Implementation details:
 This implementation of k-means uses [Lloyd's Algorithm](https://en.wikipedia.org/wiki/Lloyd%27s_algorithm)
@@ -267,33 +1312,57 @@ with the [kmeans++](https://en.wikipedia.org/wiki/K-means%2B%2B)
 used for initializing the means.
 
 */
-template <typename T, size_t N>
-std::tuple<std::vector<std::array<T, N>>, std::vector<uint32_t>> kmeans_lloyd(
+template <typename T, size_t N, typename L = uint32_t>
+clustering_result<T, N, L> kmeans_cluster(
 	const std::vector<std::array<T, N>>& data, const clustering_parameters<T>& parameters) {
 	static_assert(std::is_arithmetic<T>::value && std::is_signed<T>::value,
 		"kmeans_lloyd requires the template parameter T to be a signed arithmetic type (e.g. float, double, int)");
 	assert(parameters.get_k() > 0); // k must be greater than zero
 	assert(data.size() >= parameters.get_k()); // there must be at least k data points
+	assert(details::labels_fit<L>(parameters.get_k())); // the label type must be able to hold k labels
 	std::random_device rand_device;
 	uint64_t seed = parameters.has_random_seed() ? parameters.get_random_seed() : rand_device();
-	std::vector<std::array<T, N>> means = details::random_plusplus(data, parameters.get_k(), seed);
+	details::stop_condition<T> should_stop(parameters);
+	clustering_result<T, N, L> result;
+	{
+		details::phase_scope scope(parameters, clustering_phase::seeding);
+		result.means = details::random_plusplus(data.data(), data.size(), parameters.get_k(), seed, should_stop,
+			parameters.get_trace_sink());
+	}
 
-	std::vector<std::array<T, N>> old_means;
-	std::vector<std::array<T, N>> old_old_means;
-	std::vector<uint32_t> clusters;
-	// Calculate new means until convergence is reached or we hit the maximum iteration count
-	uint64_t count = 0;
-	do {
-		clusters = details::calculate_clusters(data, means);
-		old_old_means = old_means;
-		old_means = means;
-		means = details::calculate_means(data, clusters, old_means, parameters.get_k());
-		++count;
-	} while (means != old_means && means != old_old_means
-		&& !(parameters.has_max_iteration() && count == parameters.get_max_iteration())
-		&& !(parameters.has_min_delta() && details::deltas_below_limit(details::deltas(old_means, means), parameters.get_min_delta())));
+	if (parameters.get_keep_labels()) {
+		result.labels.resize(data.size());
+		DKM_COUNT(assignment, allocations, 1);
+	}
+	L* labels = result.labels.empty() ? nullptr : result.labels.data();
+	trace_sink* trace = parameters.get_trace_sink();
+	const uint32_t threads = static_cast<uint32_t>(std::min<size_t>(parameters.get_threads(),
+		std::max<size_t>(1, data.size() / details::stop_check_interval)));
+	std::vector<details::accumulator<T, N>> partials;
+	details::lloyd_iterations(result, parameters, should_stop, labels != nullptr,
+		[&data, labels, &should_stop, trace, threads, &partials](const std::vector<std::array<T, N>>& means,
+			details::accumulator<T, N>& totals) {
+			return details::assign_in_memory(data.data(), data.size(), means, labels, totals, partials, threads,
+				should_stop, trace);
+		});
+	return result;
+}
 
-	return std::tuple<std::vector<std::array<T, N>>, std::vector<uint32_t>>(means, clusters);
+/*
+Runs `kmeans_cluster` and returns a std::tuple containing:
+  0: A vector holding the means for each cluster from 0 to k-1.
+  1: A vector containing the cluster number (0 to k-1) for each corresponding element of the input
+	 data vector, or an empty vector if labels weren't kept.
+
+The means and labels are moved out of the `clustering_result`, so this costs no copies; new code
+should call `kmeans_cluster` directly to get the rest of the result as well.
+*/
+template <typename T, size_t N, typename L = uint32_t>
+std::tuple<std::vector<std::array<T, N>>, std::vector<L>> kmeans_lloyd(
+	const std::vector<std::array<T, N>>& data, const clustering_parameters<T>& parameters) {
+	auto result = kmeans_cluster<T, N, L>(data, parameters);
+	return std::tuple<std::vector<std::array<T, N>>, std::vector<L>>(
+		std::move(result.means), std::move(result.labels));
 }
 
 /*
@@ -315,6 +1384,159 @@ std::tuple<std::vector<std::array<T, N>>, std::vector<uint32_t>> kmeans_lloyd(
 	return kmeans_lloyd(data, parameters);
 }
 
+/*
+kmeans_model holds a set of trained means in a layout optimized for assigning new points to them.
+
+Each mean is stored as a zero padded row of `stride()` elements in a 64 byte aligned block along
+with its precomputed squared norm, which lets `predict` find the closest mean using a single dot
+product per mean. The storage is immutable and shared between copies, so models are cheap to copy
+and can be used concurrently from any number of threads.
+
+Because the kernel compares `|m|^2 - 2 x.m` instead of the full squared distance, floating point
+points lying exactly halfway between two means may be assigned differently than the training
+loop would assign them.
+*/
+template <typename T, size_t N>
+class kmeans_model {
+public:
+	kmeans_model() : _k(0), _means(nullptr), _norms(nullptr) {}
+
+	explicit kmeans_model(const std::vector<std::array<T, N>>& means) :
+	_k(static_cast<uint32_t>(means.size())), _means(nullptr), _norms(nullptr)
+	{
+		const size_t means_bytes = (means.size() * stride() * sizeof(T) + alignment - 1) / alignment * alignment;
+		auto storage = details::allocate_aligned(means_bytes + means.size() * sizeof(T), alignment);
+		T* rows = static_cast<T*>(storage.get());
+		T* norms = reinterpret_cast<T*>(static_cast<char*>(storage.get()) + means_bytes);
+		for (size_t i = 0; i < means.size(); ++i) {
+			std::copy(means[i].begin(), means[i].end(), rows + i * stride());
+			norms[i] = details::padded_dot<T, stride()>(rows + i * stride(), rows + i * stride());
+		}
+		_storage = std::move(storage);
+		_means = rows;
+		_norms = norms;
+	}
+
+	/*
+	Use means and norms which live in externally owned memory (such as a memory mapped file)
+	without copying them. `means` must point to k rows of `stride()` elements whose padding is
+	zero and `norms` to the k corresponding squared norms. `storage` keeps that memory alive for
+	as long as the model or any of its copies exist.
+	*/
+	kmeans_model(std::shared_ptr<const void> storage, const T* means, const T* norms, uint32_t k) :
+	_storage(std::move(storage)), _k(k), _means(means), _norms(norms)
+	{}
+
+	static constexpr size_t alignment = 64;
+	static constexpr size_t stride() { return details::padded_dimension<T, N>::value; }
+
+	uint32_t k() const { return _k; }
+	bool empty() const { return _k == 0; }
+	const T* data() const { return _means; }
+	const T* norms() const { return _norms; }
+
+	std::array<T, N> mean(uint32_t index) const {
+		assert(index < _k);
+		std::array<T, N> result;
+		std::copy(_means + index * stride(), _means + index * stride() + N, result.begin());
+		return result;
+	}
+
+	std::vector<std::array<T, N>> means() const {
+		std::vector<std::array<T, N>> result;
+		result.reserve(_k);
+		for (uint32_t i = 0; i < _k; ++i) {
+			result.push_back(mean(i));
+		}
+		return result;
+	}
+
+	/*
+	Calculate the index of the mean closest to a single point.
+	*/
+	uint32_t predict(const std::array<T, N>& point) const {
+		uint32_t label;
+		details::closest_means_padded<T, N, stride()>(&point, 1, _means, _norms, _k, &label);
+		return label;
+	}
+
+	/*
+	Calculate the index of the closest mean for `count` points, writing them to `labels_out` which
+	must have room for `count` labels. Any unsigned label type able to hold k-1 may be used.
+	*/
+	template <typename L>
+	void predict_batch(const std::array<T, N>* points, size_t count, L* labels_out) const {
+		assert(details::labels_fit<L>(_k));
+		details::closest_means_padded<T, N, stride()>(points, count, _means, _norms, _k, labels_out);
+	}
+
+	std::vector<uint32_t> predict_batch(const std::vector<std::array<T, N>>& points) const {
+		std::vector<uint32_t> labels(points.size());
+		predict_batch(points.data(), points.size(), labels.data());
+		return labels;
+	}
+
+	/*
+	Find the M closest means to a point along with their squared distances, ordered from closest
+	to furthest. M must not exceed k.
+	*/
+	template <size_t M>
+	void predict_nearest(const std::array<T, N>& point,
+		std::array<uint32_t, M>& labels, std::array<T, M>& distances) const {
+		static_assert(M > 0, "predict_nearest requires M to be greater than zero");
+		details::nearest_means_padded<T, N, stride(), M>(
+			&point, 1, _means, _norms, _k, M, labels.data(), distances.data());
+	}
+
+	/*
+	Find the m closest means for each of `count` points. `labels_out` and `distances_out` must each
+	have room for `count * m` values and are filled row-major, m per point, closest first. m is
+	expected to be small (it must not exceed 256 or k); the compile-time overload avoids the
+	dispatch on m.
+	*/
+	void predict_nearest_batch(const std::array<T, N>* points, size_t count, size_t m,
+		uint32_t* labels_out, T* distances_out) const {
+		assert(m <= 256);
+		if (m <= 4) {
+			details::nearest_means_padded<T, N, stride(), 4>(points, count, _means, _norms, _k, m, labels_out, distances_out);
+		} else if (m <= 16) {
+			details::nearest_means_padded<T, N, stride(), 16>(points, count, _means, _norms, _k, m, labels_out, distances_out);
+		} else {
+			details::nearest_means_padded<T, N, stride(), 256>(points, count, _means, _norms, _k, m, labels_out, distances_out);
+		}
+	}
+
+	template <size_t M>
+	void predict_nearest_batch(const std::array<T, N>* points, size_t count,
+		std::array<uint32_t, M>* labels_out, std::array<T, M>* distances_out) const {
+		static_assert(M > 0, "predict_nearest_batch requires M to be greater than zero");
+		static_assert(sizeof(std::array<uint32_t, M>) == M * sizeof(uint32_t) && sizeof(std::array<T, M>) == M * sizeof(T),
+			"std::array must not be padded");
+		details::nearest_means_padded<T, N, stride(), M>(points, count, _means, _norms, _k, M,
+			labels_out->data(), distances_out->data());
+	}
+
+private:
+	std::shared_ptr<const void> _storage;
+	uint32_t _k;
+	const T* _means;
+	const T* _norms;
+};
+
+template <typename T, size_t N>
+constexpr size_t kmeans_model<T, N>::alignment;
+
+/*
+Run `kmeans_cluster` and return the resulting means as a `kmeans_model` ready for prediction. No
+labels are stored while training since the model doesn't need them.
+*/
+template <typename T, size_t N>
+kmeans_model<T, N> kmeans_fit(const std::vector<std::array<T, N>>& data, const clustering_parameters<T>& parameters) {
+	clustering_parameters<T> means_only(parameters);
+	means_only.set_keep_labels(false);
+	return kmeans_model<T, N>(kmeans_cluster(data, means_only).means);
+}
+
 } // namespace dkm
 
 #endif /* DKM_KMEANS_H */
@@ -0,0 +1,162 @@
+#pragma once
+
+#ifndef DKM_ASYNC_H
+#define DKM_ASYNC_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <utility>
+#include <vector>
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#include <optional>
+#define DKM_HAS_COROUTINES 1
+#endif
+
+#include "dkm.hpp"
+
+/*
+Asynchronous entry points for `kmeans_cluster`, for callers such as event loops which must not
+block while clustering runs.
+
+None of these create threads. The clustering runs on an executor supplied by the caller, which is
+any callable accepting a `std::function<void()>` and arranging for it to be run exactly once, for
+example by queueing it on an existing thread pool. The data is referenced, not copied, and must
+stay alive until the clustering completes.
+
+Progress can be followed by setting an iteration observer on the parameters; wrapping it with
+`make_posting_observer` delivers each update through another executor, such as the caller's event
+loop, instead of on the clustering thread. Runs can be stopped early with a `cancellation_token`.
+*/
+namespace dkm {
+
+/*
+Wrap `observer` so each `iteration_stats` is handed to `executor` (as a copy) rather than being
+processed on the thread running the clustering.
+*/
+template <typename Executor>
+std::function<void(const iteration_stats&)> make_posting_observer(Executor executor,
+	std::function<void(const iteration_stats&)> observer) {
+	return [executor, observer](const iteration_stats& stats) mutable {
+		executor(std::function<void()>([observer, stats]() { observer(stats); }));
+	};
+}
+
+/*
+Run `kmeans_cluster` on `executor` and return a future for its result. Exceptions thrown by the
+clustering are stored in the future.
+*/
+template <typename T, size_t N, typename L = uint32_t, typename Executor>
+std::future<clustering_result<T, N, L>> kmeans_cluster_async(const std::vector<std::array<T, N>>& data,
+	const clustering_parameters<T>& parameters, Executor&& executor) {
+	auto promise = std::make_shared<std::promise<clustering_result<T, N, L>>>();
+	auto future = promise->get_future();
+	const std::vector<std::array<T, N>>* points = &data;
+	executor(std::function<void()>([promise, points, parameters]() {
+		try {
+			promise->set_value(kmeans_cluster<T, N, L>(*points, parameters));
+		} catch (...) {
+			promise->set_exception(std::current_exception());
+		}
+	}));
+	return future;
+}
+
+/*
+Run `kmeans_cluster` on `executor` and call `on_complete(result, error)` on the executor once it
+finishes. `error` is null on success; otherwise it holds the exception the clustering threw and
+`result` is empty. To continue on another thread, `on_complete` can post itself there.
+*/
+template <typename T, size_t N, typename L = uint32_t, typename Executor, typename Callback>
+void kmeans_cluster_async(const std::vector<std::array<T, N>>& data,
+	const clustering_parameters<T>& parameters, Executor&& executor, Callback on_complete) {
+	const std::vector<std::array<T, N>>* points = &data;
+	executor(std::function<void()>([points, parameters, on_complete]() mutable {
+		clustering_result<T, N, L> result;
+		std::exception_ptr error;
+		try {
+			result = kmeans_cluster<T, N, L>(*points, parameters);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		on_complete(std::move(result), error);
+	}));
+}
+
+#ifdef DKM_HAS_COROUTINES
+
+/*
+Awaitable returned by `kmeans_cluster_awaitable`. Awaiting it suspends the coroutine, runs
+`kmeans_cluster` on the executor and resumes the coroutine through the resume executor (or directly
+on the executor's thread if there is none) with the result, rethrowing any exception.
+*/
+template <typename T, size_t N, typename L, typename Executor>
+class clustering_awaitable {
+public:
+	clustering_awaitable(const std::vector<std::array<T, N>>& data, clustering_parameters<T> parameters,
+		Executor executor, std::function<void(std::function<void()>)> resume_executor) :
+	_data(&data), _parameters(std::move(parameters)), _executor(std::move(executor)),
+	_resume_executor(std::move(resume_executor))
+	{}
+
+	bool await_ready() const noexcept { return false; }
+
+	/*
+	Resuming the coroutine may destroy this awaitable, possibly while an executor is still running,
+	so each executor is moved out before it's called and no member is touched once the resumption
+	is posted.
+	*/
+	void await_suspend(std::coroutine_handle<> caller) {
+		Executor executor = std::move(_executor);
+		executor(std::function<void()>([this, caller]() {
+			try {
+				_result.emplace(kmeans_cluster<T, N, L>(*_data, _parameters));
+			} catch (...) {
+				_error = std::current_exception();
+			}
+			std::function<void(std::function<void()>)> resume_executor = std::move(_resume_executor);
+			if (resume_executor) {
+				resume_executor(std::function<void()>([caller]() { caller.resume(); }));
+			} else {
+				caller.resume();
+			}
+		}));
+	}
+
+	clustering_result<T, N, L> await_resume() {
+		if (_error) {
+			std::rethrow_exception(_error);
+		}
+		return std::move(*_result);
+	}
+
+private:
+	const std::vector<std::array<T, N>>* _data;
+	clustering_parameters<T> _parameters;
+	Executor _executor;
+	std::function<void(std::function<void()>)> _resume_executor;
+	std::optional<clustering_result<T, N, L>> _result;
+	std::exception_ptr _error;
+};
+
+/*
+C++20 coroutine interface: `auto result = co_await kmeans_cluster_awaitable(data, parameters,
+pool, loop);` runs the clustering on `pool` and resumes the coroutine on `loop`.
+*/
+template <typename T, size_t N, typename L = uint32_t, typename Executor>
+clustering_awaitable<T, N, L, Executor> kmeans_cluster_awaitable(const std::vector<std::array<T, N>>& data,
+	const clustering_parameters<T>& parameters, Executor executor,
+	std::function<void(std::function<void()>)> resume_executor = nullptr) {
+	return clustering_awaitable<T, N, L, Executor>(data, parameters, std::move(executor), std::move(resume_executor));
+}
+
+#endif
+
+} // namespace dkm
+
+#endif /* DKM_ASYNC_H */
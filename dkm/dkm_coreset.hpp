@@ -0,0 +1,442 @@
+#pragma once
+
+#ifndef DKM_CORESET_H
+#define DKM_CORESET_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "dkm.hpp"
+#include "dkm_stream.hpp"
+
+/*
+One-pass clustering of streams far larger than memory with StreamKM++ (Ackermann et al., "StreamKM++:
+A Clustering Algorithm for Data Streams", 2012): the stream is summarised by a small weighted
+coreset, maintained by merge and reduce over a logarithmic number of buckets, and the coreset is
+then clustered with weighted k-means.
+*/
+namespace dkm {
+
+/*
+Points standing in for others: each point represents `weights[i]` points of the original data.
+*/
+template <typename T, size_t N>
+struct weighted_points {
+	std::vector<std::array<T, N>> points;
+	std::vector<uint64_t> weights;
+
+	size_t size() const { return points.size(); }
+	bool empty() const { return points.empty(); }
+	void clear() {
+		points.clear();
+		weights.clear();
+	}
+	void append(const weighted_points& other) {
+		points.insert(points.end(), other.points.begin(), other.points.end());
+		weights.insert(weights.end(), other.weights.begin(), other.weights.end());
+	}
+};
+
+namespace details {
+
+typedef std::linear_congruential_engine<uint64_t, 6364136223846793005, 1442695040888963407, UINT64_MAX> coreset_engine;
+
+/*
+Pick an index with probability proportional to `weight(i)` for i in [0, count), given their total.
+Falls back to the last index with a positive weight if rounding leaves the draw past the end.
+*/
+template <typename Weight>
+size_t weighted_choice(size_t count, double total, Weight weight, coreset_engine& rand_engine) {
+	double target = std::uniform_real_distribution<double>(0, total)(rand_engine);
+	size_t last_positive = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const double w = weight(i);
+		if (w > 0) {
+			if (target < w) {
+				return i;
+			}
+			target -= w;
+			last_positive = i;
+		}
+	}
+	return last_positive;
+}
+
+/*
+Reduce a weighted point set to at most `size` representatives with the coreset tree of StreamKM++.
+The tree starts as one leaf holding every point with a random representative. Each step walks down
+from the root choosing children in proportion to their cost (the weighted squared distance of their
+points to their representative), picks a new representative within the leaf reached in proportion
+to each point's share of that cost, and splits the leaf between its old and new representative.
+Each representative is weighted by the points of its leaf. This is kmeans++ seeding restricted to
+one leaf per step, so a step costs the size of a leaf rather than of the whole set.
+*/
+template <typename T, size_t N>
+weighted_points<T, N> coreset_tree_reduce(const weighted_points<T, N>& input, size_t size, coreset_engine& rand_engine) {
+	assert(size > 0);
+	if (input.size() <= size) {
+		return input;
+	}
+	struct node {
+		size_t parent;
+		size_t children[2];
+		size_t representative;
+		std::vector<size_t> members;
+		double cost;
+	};
+	const size_t none = SIZE_MAX;
+	// Weighted squared distance of each point to the representative of its leaf
+	std::vector<double> costs(input.size());
+	std::vector<node> tree;
+	tree.reserve(2 * size);
+	{
+		node root;
+		root.parent = none;
+		root.children[0] = root.children[1] = none;
+		double total_weight = 0;
+		for (uint64_t w : input.weights) {
+			total_weight += static_cast<double>(w);
+		}
+		root.representative = weighted_choice(input.size(), total_weight,
+			[&input](size_t i) { return static_cast<double>(input.weights[i]); }, rand_engine);
+		root.members.resize(input.size());
+		root.cost = 0;
+		for (size_t i = 0; i < input.size(); ++i) {
+			root.members[i] = i;
+			costs[i] = static_cast<double>(input.weights[i])
+				* static_cast<double>(distance_squared(input.points[i], input.points[root.representative]));
+			root.cost += costs[i];
+		}
+		DKM_COUNT(seeding, distance_evaluations, input.size());
+		tree.push_back(std::move(root));
+	}
+
+	for (size_t leaves = 1; leaves < size; ++leaves) {
+		if (!(tree[0].cost > 0)) {
+			// Every remaining point sits on its representative
+			break;
+		}
+		size_t current = 0;
+		while (tree[current].children[0] != none) {
+			const node& parent = tree[current];
+			const double left = tree[parent.children[0]].cost;
+			const double right = tree[parent.children[1]].cost;
+			current = parent.children[std::uniform_real_distribution<double>(0, left + right)(rand_engine) < left ? 0 : 1];
+		}
+		std::vector<size_t> members;
+		members.swap(tree[current].members);
+		const size_t old_representative = tree[current].representative;
+		const size_t new_representative = members[weighted_choice(members.size(), tree[current].cost,
+			[&costs, &members](size_t i) { return costs[members[i]]; }, rand_engine)];
+
+		node halves[2];
+		halves[0].representative = old_representative;
+		halves[1].representative = new_representative;
+		DKM_COUNT(seeding, distance_evaluations, members.size());
+		for (int h = 0; h < 2; ++h) {
+			halves[h].parent = current;
+			halves[h].children[0] = halves[h].children[1] = none;
+			halves[h].cost = 0;
+		}
+		for (size_t i : members) {
+			const double to_new = static_cast<double>(input.weights[i])
+				* static_cast<double>(distance_squared(input.points[i], input.points[new_representative]));
+			const int side = (to_new < costs[i] || i == new_representative) ? 1 : 0;
+			if (side == 1) {
+				costs[i] = to_new;
+			}
+			halves[side].members.push_back(i);
+			halves[side].cost += costs[i];
+		}
+		for (int h = 0; h < 2; ++h) {
+			tree[current].children[h] = tree.size();
+			tree.push_back(std::move(halves[h]));
+		}
+		// Recompute rather than subtract the costs on the way up so rounding can't drive them negative
+		for (size_t ancestor = current; ancestor != none; ancestor = tree[ancestor].parent) {
+			tree[ancestor].cost = tree[tree[ancestor].children[0]].cost + tree[tree[ancestor].children[1]].cost;
+		}
+	}
+
+	weighted_points<T, N> output;
+	for (const node& leaf : tree) {
+		if (leaf.children[0] != none) {
+			continue;
+		}
+		uint64_t weight = 0;
+		for (size_t i : leaf.members) {
+			weight += input.weights[i];
+		}
+		output.points.push_back(input.points[leaf.representative]);
+		output.weights.push_back(weight);
+	}
+	return output;
+}
+
+/*
+kmeans++ over weighted points: each point is chosen with probability proportional to its weight
+times its squared distance to the closest mean chosen so far.
+*/
+template <typename T, size_t N>
+std::vector<std::array<T, N>> weighted_plusplus(const std::array<T, N>* data, const uint64_t* weights, size_t count,
+	uint32_t k, uint64_t seed, trace_sink* trace = nullptr) {
+	assert(count > 0 && k > 0);
+	coreset_engine rand_engine(seed);
+	std::vector<std::array<T, N>> means;
+	means.reserve(k);
+	double total = 0;
+	for (size_t i = 0; i < count; ++i) {
+		total += static_cast<double>(weights[i]);
+	}
+	means.push_back(data[weighted_choice(count, total,
+		[weights](size_t i) { return static_cast<double>(weights[i]); }, rand_engine)]);
+	std::vector<double> costs(count);
+	for (uint32_t round = 1; round < k; ++round) {
+		trace_scope span(trace, "seeding round", "seeding", "round", round);
+		DKM_COUNT(seeding, distance_evaluations, count);
+		total = 0;
+		for (size_t i = 0; i < count; ++i) {
+			const double cost = static_cast<double>(weights[i]) * static_cast<double>(distance_squared(data[i], means.back()));
+			costs[i] = round == 1 ? cost : std::min(costs[i], cost);
+			total += costs[i];
+		}
+		if (!(total > 0)) {
+			// Fewer distinct points than k; repeat the first mean like kmeans++ would
+			means.push_back(means.front());
+			continue;
+		}
+		means.push_back(data[weighted_choice(count, total, [&costs](size_t i) { return costs[i]; }, rand_engine)]);
+	}
+	return means;
+}
+
+/*
+`assign_and_accumulate` for weighted points: a point of weight w adds w times itself to its
+cluster's sum, w to its count and w times its squared distance to its inertia.
+*/
+template <typename T, size_t N, typename L>
+void weighted_assign_and_accumulate(const std::array<T, N>* data, const uint64_t* weights, size_t count,
+	const std::vector<std::array<T, N>>& means, L* labels, accumulator<T, N>& totals) {
+	DKM_COUNT(assignment, distance_evaluations, count * means.size());
+	DKM_COUNT(assignment, points_processed, count);
+	for (size_t i = 0; i < count; ++i) {
+		T distance;
+		const uint32_t cluster = closest_mean(data[i], means, distance);
+		if (labels != nullptr) {
+			totals.changed += labels[i] != static_cast<L>(cluster);
+			labels[i] = static_cast<L>(cluster);
+		}
+		const T weight = static_cast<T>(weights[i]);
+		auto& sum = totals.sums[cluster];
+		totals.counts[cluster] += weights[i];
+		totals.inertia[cluster] += static_cast<double>(weights[i]) * static_cast<double>(distance);
+		for (size_t j = 0; j < N; ++j) {
+			sum[j] += data[i][j] * weight;
+		}
+	}
+}
+
+} // namespace details
+
+/*
+The StreamKM++ coreset of a stream, built as points are added. Points are collected into a bucket
+of `coreset_size` points; once it is full it is merged into a chain of buckets where bucket i
+summarises 2^(i-1) full buckets: an empty slot takes the incoming summary as is, an occupied one is
+merged with it and reduced back to `coreset_size` representatives with the coreset tree (see
+`details::coreset_tree_reduce`), and the result carries on to the next slot. Memory is therefore
+O(coreset_size * log(points / coreset_size)) points, and each point is reduced at most that many
+times.
+
+The authors recommend a coreset size of about 200 * k; larger ones trade memory and time for
+accuracy. Results are deterministic for a given seed and order of points.
+*/
+template <typename T, size_t N>
+class streamkm_coreset {
+public:
+	explicit streamkm_coreset(size_t coreset_size, uint64_t seed = 0) :
+	_coreset_size(coreset_size), _seed(seed), _rand_engine(seed), _points(0)
+	{
+		assert(coreset_size > 0);
+		_buckets.resize(1);
+		_buckets[0].points.reserve(coreset_size);
+		_buckets[0].weights.reserve(coreset_size);
+	}
+
+	void add(const std::array<T, N>& point) {
+		weighted_points<T, N>& first = _buckets[0];
+		first.points.push_back(point);
+		first.weights.push_back(1);
+		++_points;
+		if (first.size() == _coreset_size) {
+			carry();
+		}
+	}
+
+	void add(const std::array<T, N>* points, size_t count) {
+		for (size_t i = 0; i < count; ++i) {
+			add(points[i]);
+		}
+	}
+
+	// The number of points added so far
+	uint64_t points() const { return _points; }
+
+	size_t coreset_size() const { return _coreset_size; }
+
+	/*
+	A coreset of everything added so far: the union of the buckets, reduced to `coreset_size`
+	points if it is larger. Its weights add up to `points()`. Doesn't change the builder, so points
+	can be added afterwards and the coreset taken again.
+	*/
+	weighted_points<T, N> coreset() const {
+		weighted_points<T, N> all;
+		for (const auto& bucket : _buckets) {
+			all.append(bucket);
+		}
+		// Seeded from the point count so asking twice at the same point gives the same coreset
+		details::coreset_engine rand_engine(_seed ^ (_points * 0x9e3779b97f4a7c15ull));
+		return details::coreset_tree_reduce(all, _coreset_size, rand_engine);
+	}
+
+private:
+	void carry() {
+		weighted_points<T, N> summary;
+		summary.points.swap(_buckets[0].points);
+		summary.weights.swap(_buckets[0].weights);
+		_buckets[0].points.reserve(_coreset_size);
+		_buckets[0].weights.reserve(_coreset_size);
+		for (size_t i = 1;; ++i) {
+			if (i == _buckets.size()) {
+				_buckets.push_back(std::move(summary));
+				return;
+			}
+			if (_buckets[i].empty()) {
+				_buckets[i] = std::move(summary);
+				return;
+			}
+			summary.append(_buckets[i]);
+			_buckets[i].clear();
+			summary = details::coreset_tree_reduce(summary, _coreset_size, _rand_engine);
+		}
+	}
+
+	size_t _coreset_size;
+	uint64_t _seed;
+	details::coreset_engine _rand_engine;
+	uint64_t _points;
+	// Bucket 0 collects incoming points; bucket i > 0 is empty or summarises 2^(i-1) full buckets
+	std::vector<weighted_points<T, N>> _buckets;
+};
+
+/*
+Weighted k-means: kmeans++ seeding and Lloyd iterations where each point counts `weights[i]` times,
+e.g. to cluster a coreset. Takes the same parameters and converges under the same rules as
+`kmeans_cluster`, except that it runs on one thread. The counts and inertia of the result are
+weighted, so for a coreset they estimate those of the data it summarises, and the labels (if kept)
+are those of the weighted points. Fewer distinct points than k leave some means repeated.
+*/
+template <typename T, size_t N, typename L = uint32_t>
+clustering_result<T, N, L> kmeans_weighted(const std::vector<std::array<T, N>>& points,
+	const std::vector<uint64_t>& weights, const clustering_parameters<T>& parameters) {
+	static_assert(std::is_arithmetic<T>::value && std::is_signed<T>::value,
+		"kmeans_weighted requires the template parameter T to be a signed arithmetic type (e.g. float, double, int)");
+	assert(parameters.get_k() > 0); // k must be greater than zero
+	assert(!points.empty()); // there must be points; a coreset of duplicates may have fewer than k
+	assert(points.size() == weights.size()); // every point needs a weight
+	assert(details::labels_fit<L>(parameters.get_k())); // the label type must be able to hold k labels
+	std::random_device rand_device;
+	uint64_t seed = parameters.has_random_seed() ? parameters.get_random_seed() : rand_device();
+	details::stop_condition<T> should_stop(parameters);
+	trace_sink* trace = parameters.get_trace_sink();
+	clustering_result<T, N, L> result;
+	{
+		details::phase_scope scope(parameters, clustering_phase::seeding);
+		result.means = details::weighted_plusplus(points.data(), weights.data(), points.size(), parameters.get_k(),
+			seed, trace);
+	}
+
+	if (parameters.get_keep_labels()) {
+		result.labels.resize(points.size());
+	}
+	L* labels = result.labels.empty() ? nullptr : result.labels.data();
+	details::lloyd_iterations(result, parameters, should_stop, labels != nullptr,
+		[&points, &weights, labels, &should_stop, trace](const std::vector<std::array<T, N>>& means,
+			details::accumulator<T, N>& totals) {
+			for (size_t begin = 0; begin < points.size(); begin += details::stop_check_interval) {
+				if (begin > 0 && should_stop()) {
+					return false;
+				}
+				details::trace_scope chunk(trace, "chunk", "assignment", "first point", begin);
+				details::weighted_assign_and_accumulate(points.data() + begin, weights.data() + begin,
+					std::min(details::stop_check_interval, points.size() - begin), means,
+					labels ? labels + begin : nullptr, totals);
+			}
+			return true;
+		});
+	return result;
+}
+
+template <typename T, size_t N, typename L = uint32_t>
+clustering_result<T, N, L> kmeans_weighted(const weighted_points<T, N>& coreset, const clustering_parameters<T>& parameters) {
+	return kmeans_weighted<T, N, L>(coreset.points, coreset.weights, parameters);
+}
+
+/*
+StreamKM++ over a data source (see `data_chunk`): one pass builds a coreset of `coreset_size`
+points, which is then clustered with `kmeans_weighted`. Unlike `kmeans_cluster_chunked` the source
+is read exactly once, so it may be a stream that can't be rewound. The counts of the result add up
+to the number of points read but are split between clusters by the coreset, and the inertia is that
+of the coreset, which underestimates the data's since each representative stands for points spread
+around it. Labels aren't kept; use a `kmeans_model` built from the means to assign points
+afterwards.
+
+The deadline and cancellation are checked after every chunk. Once they fire the coreset built so far
+is seeded with kmeans++ and returned without Lloyd iterations, with the reason set accordingly.
+Throws `std::runtime_error` if the source holds no points.
+*/
+template <typename Source, typename T>
+clustering_result<T, std::tuple_size<typename Source::point_type>::value> kmeans_streamkm(Source& source,
+	const clustering_parameters<T>& parameters, size_t coreset_size) {
+	using traits = details::source_traits<Source>;
+	static_assert(std::is_same<typename traits::value_type, T>::value,
+		"kmeans_streamkm requires the source and the parameters to use the same type T");
+	const size_t N = traits::dimensions;
+	assert(coreset_size >= parameters.get_k());
+	std::random_device rand_device;
+	const uint64_t seed = parameters.has_random_seed() ? parameters.get_random_seed() : rand_device();
+	details::stop_condition<T> should_stop(parameters);
+	streamkm_coreset<T, N> builder(coreset_size, seed);
+	{
+		details::phase_scope scope(parameters, clustering_phase::seeding);
+		details::trace_scope span(parameters.get_trace_sink(), "coreset", "seeding", "coreset size", coreset_size);
+		data_chunk<T, N> chunk;
+		source.rewind();
+		while (source.next_chunk(chunk)) {
+			DKM_COUNT(seeding, bytes_streamed, chunk.size * sizeof(std::array<T, N>));
+			builder.add(chunk.data, chunk.size);
+			if (should_stop()) {
+				break;
+			}
+		}
+	}
+	if (builder.points() == 0) {
+		throw std::runtime_error("dkm: the source holds no points");
+	}
+	clustering_parameters<T> coreset_parameters(parameters);
+	coreset_parameters.set_keep_labels(false);
+	coreset_parameters.set_random_seed(seed);
+	return kmeans_weighted<T, N>(builder.coreset(), coreset_parameters);
+}
+
+} // namespace dkm
+
+#endif /* DKM_CORESET_H */
@@ -0,0 +1,395 @@
+#pragma once
+
+#ifndef DKM_DATASETS_H
+#define DKM_DATASETS_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include "dkm.hpp"
+#include "dkm_stream.hpp"
+
+/*
+Deterministic synthetic datasets for benchmarks and tests, with known cluster structure.
+
+Every point is derived from the seed and its own index alone, using a generator defined here rather
+than the implementation-defined standard distributions, so a dataset is the same on every host and
+whichever parts of it are generated, in whatever order and on however many threads. (Gaussian
+coordinates go through std::log, std::sqrt and std::cos, so hosts with a different math library may
+differ in the last bit.)
+
+Generators provide:
+
+	using point_type = std::array<T, N>;
+	size_t size() const;
+	// Write points [begin, begin + count) to `points` and, if given, their true clusters to `labels`
+	void generate(size_t begin, size_t count, std::array<T, N>* points, uint32_t* labels) const;
+
+and can be materialised with `generate_dataset`, streamed with `make_dataset_source` or written to
+the flat binary format read by `mapped_dataset` and `file_reader` with `write_dataset`.
+*/
+namespace dkm {
+
+namespace details {
+
+inline uint64_t splitmix64(uint64_t& state) {
+	uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+A small counter-based random stream: `random_stream(seed, stream)` always yields the same values,
+so each point (or each cluster) can have its own stream keyed by its index.
+*/
+class random_stream {
+public:
+	random_stream(uint64_t seed, uint64_t stream) : _state(seed) {
+		uint64_t mixer = stream ^ 0x6a09e667f3bcc909ULL;
+		_state ^= splitmix64(mixer);
+	}
+
+	uint64_t next() { return splitmix64(_state); }
+
+	// Uniform in [0, 1)
+	double uniform() { return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0); }
+
+	double uniform(double low, double high) { return low + (high - low) * uniform(); }
+
+	// Standard normal, by Box-Muller
+	double normal() {
+		const double radius = std::sqrt(-2.0 * std::log(1.0 - uniform()));
+		return radius * std::cos(6.283185307179586 * uniform());
+	}
+
+private:
+	uint64_t _state;
+};
+
+} // namespace details
+
+/*
+Settings for `gaussian_blobs`:
+* clusters: the number of blobs.
+* separation: roughly how many standard deviations apart neighbouring blob centers are. The centers
+  are spread uniformly over a cube sized so the average spacing between them is this much.
+* anisotropy: roughly the ratio of a blob's widest axis to its narrowest; 1 gives round blobs. Each
+  blob gets its own random orientation and axis scales drawn log-uniformly within a factor of
+  sqrt(anisotropy) of `scale`, so the actual ratio is at most this and nears it as N grows.
+* imbalance: the ratio of the largest blob's expected size to the smallest's; 1 gives equally sized
+  blobs. Sizes fall off geometrically between the two.
+* outlier_fraction: the fraction of points drawn uniformly from a box twice the size of the one
+  holding the centers instead of from a blob. Their label is `clusters`.
+* scale: the standard deviation of a round blob, in data units.
+*/
+struct blob_settings {
+	uint32_t clusters;
+	double separation;
+	double anisotropy;
+	double imbalance;
+	double outlier_fraction;
+	double scale;
+
+	explicit blob_settings(uint32_t clusters) :
+	clusters(clusters), separation(8), anisotropy(1), imbalance(1), outlier_fraction(0), scale(1)
+	{}
+};
+
+/*
+Points drawn from a mixture of Gaussian blobs (see `blob_settings`). The label of each point is the
+blob it was drawn from, or `clusters` for outliers.
+*/
+template <typename T, size_t N>
+class gaussian_blobs {
+public:
+	using point_type = std::array<T, N>;
+
+	gaussian_blobs(size_t size, const blob_settings& settings, uint64_t seed) :
+	_size(size), _settings(settings), _seed(seed),
+	_centers(settings.clusters), _axes(settings.clusters), _reflections(settings.clusters),
+	_cumulative_weights(settings.clusters)
+	{
+		assert(settings.clusters > 0);
+		assert(settings.anisotropy >= 1 && settings.imbalance >= 1);
+		assert(settings.outlier_fraction >= 0 && settings.outlier_fraction <= 1);
+		// The cube holding the centers has room for `clusters` cells `separation` wide
+		_extent = settings.separation * settings.scale * std::pow(static_cast<double>(settings.clusters), 1.0 / N) / 2;
+		double total = 0;
+		for (uint32_t c = 0; c < settings.clusters; ++c) {
+			details::random_stream random(seed, ~uint64_t(c));
+			double norm = 0;
+			for (size_t j = 0; j < N; ++j) {
+				_centers[c][j] = random.uniform(-_extent, _extent);
+				_axes[c][j] = settings.scale * std::pow(settings.anisotropy, random.uniform() - 0.5);
+				_reflections[c][j] = random.normal();
+				norm += _reflections[c][j] * _reflections[c][j];
+			}
+			norm = std::sqrt(norm);
+			for (size_t j = 0; j < N; ++j) {
+				_reflections[c][j] = norm > 0 ? _reflections[c][j] / norm : 0;
+			}
+			const double exponent = settings.clusters > 1 ? double(c) / (settings.clusters - 1) : 0;
+			total += std::pow(1 / settings.imbalance, exponent);
+			_cumulative_weights[c] = total;
+		}
+		for (double& weight : _cumulative_weights) {
+			weight /= total;
+		}
+	}
+
+	size_t size() const { return _size; }
+
+	// The true center of each blob
+	std::vector<std::array<T, N>> centers() const {
+		std::vector<std::array<T, N>> centers(_settings.clusters);
+		for (size_t c = 0; c < centers.size(); ++c) {
+			for (size_t j = 0; j < N; ++j) {
+				centers[c][j] = details::to_coordinate<T>(_centers[c][j]);
+			}
+		}
+		return centers;
+	}
+
+	void generate(size_t begin, size_t count, std::array<T, N>* points, uint32_t* labels = nullptr) const {
+		assert(begin + count <= _size);
+		for (size_t i = 0; i < count; ++i) {
+			details::random_stream random(_seed, begin + i);
+			std::array<double, N> value;
+			uint32_t label;
+			if (random.uniform() < _settings.outlier_fraction) {
+				label = _settings.clusters;
+				for (size_t j = 0; j < N; ++j) {
+					value[j] = random.uniform(-2 * _extent, 2 * _extent);
+				}
+			} else {
+				const double pick = random.uniform();
+				label = static_cast<uint32_t>(std::upper_bound(_cumulative_weights.begin(),
+					_cumulative_weights.end() - 1, pick) - _cumulative_weights.begin());
+				// Scale along the axes, then orient the blob with a Householder reflection
+				double projection = 0;
+				for (size_t j = 0; j < N; ++j) {
+					value[j] = random.normal() * _axes[label][j];
+					projection += value[j] * _reflections[label][j];
+				}
+				for (size_t j = 0; j < N; ++j) {
+					value[j] = _centers[label][j] + value[j] - 2 * projection * _reflections[label][j];
+				}
+			}
+			for (size_t j = 0; j < N; ++j) {
+				points[i][j] = details::to_coordinate<T>(value[j]);
+			}
+			if (labels != nullptr) {
+				labels[i] = label;
+			}
+		}
+	}
+
+private:
+	size_t _size;
+	blob_settings _settings;
+	uint64_t _seed;
+	double _extent;
+	std::vector<std::array<double, N>> _centers;
+	std::vector<std::array<double, N>> _axes;
+	std::vector<std::array<double, N>> _reflections;
+	std::vector<double> _cumulative_weights;
+};
+
+/*
+Points drawn uniformly from [low, high) in every dimension, i.e. with no cluster structure at all.
+Every label is 0.
+*/
+template <typename T, size_t N>
+class uniform_noise {
+public:
+	using point_type = std::array<T, N>;
+
+	uniform_noise(size_t size, double low, double high, uint64_t seed) :
+	_size(size), _low(low), _high(high), _seed(seed)
+	{}
+
+	size_t size() const { return _size; }
+
+	void generate(size_t begin, size_t count, std::array<T, N>* points, uint32_t* labels = nullptr) const {
+		assert(begin + count <= _size);
+		for (size_t i = 0; i < count; ++i) {
+			details::random_stream random(_seed, begin + i);
+			for (size_t j = 0; j < N; ++j) {
+				points[i][j] = details::to_coordinate<T>(random.uniform(_low, _high));
+			}
+			if (labels != nullptr) {
+				labels[i] = 0;
+			}
+		}
+	}
+
+private:
+	size_t _size;
+	double _low;
+	double _high;
+	uint64_t _seed;
+};
+
+/*
+Points which are all copies of `distinct` base points drawn uniformly from [low, high), as is
+typical of quantized or integer data. How often each base point is repeated is skewed by `skew`:
+with 1 every base point is equally common, and larger values make low numbered base points
+increasingly dominant (base point `floor(distinct * u^skew)` is picked for a uniform u). The label of
+each point is the base point it copies.
+*/
+template <typename T, size_t N>
+class duplicated_points {
+public:
+	using point_type = std::array<T, N>;
+
+	duplicated_points(size_t size, uint32_t distinct, double skew, double low, double high, uint64_t seed) :
+	_size(size), _skew(skew), _seed(seed), _bases(distinct)
+	{
+		assert(distinct > 0 && skew >= 1);
+		for (uint32_t b = 0; b < distinct; ++b) {
+			details::random_stream random(seed, ~uint64_t(b));
+			for (size_t j = 0; j < N; ++j) {
+				_bases[b][j] = details::to_coordinate<T>(random.uniform(low, high));
+			}
+		}
+	}
+
+	size_t size() const { return _size; }
+
+	const std::vector<std::array<T, N>>& bases() const { return _bases; }
+
+	void generate(size_t begin, size_t count, std::array<T, N>* points, uint32_t* labels = nullptr) const {
+		assert(begin + count <= _size);
+		const uint32_t distinct = static_cast<uint32_t>(_bases.size());
+		for (size_t i = 0; i < count; ++i) {
+			details::random_stream random(_seed, begin + i);
+			const uint32_t base = std::min(distinct - 1,
+				static_cast<uint32_t>(distinct * std::pow(random.uniform(), _skew)));
+			points[i] = _bases[base];
+			if (labels != nullptr) {
+				labels[i] = base;
+			}
+		}
+	}
+
+private:
+	size_t _size;
+	double _skew;
+	uint64_t _seed;
+	std::vector<std::array<T, N>> _bases;
+};
+
+namespace details {
+
+/*
+Generate points [begin, begin + count) of a dataset split over `threads` threads. The result doesn't
+depend on the number of threads.
+*/
+template <typename Generator, typename Point>
+void generate_parallel(const Generator& generator, size_t begin, size_t count, Point* points, uint32_t* labels,
+	unsigned threads) {
+	const size_t minimum_share = 4096;
+	threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, count / minimum_share)));
+	if (threads <= 1) {
+		generator.generate(begin, count, points, labels);
+		return;
+	}
+	std::vector<std::thread> workers;
+	const size_t share = (count + threads - 1) / threads;
+	for (size_t first = 0; first < count; first += share) {
+		const size_t part = std::min(share, count - first);
+		workers.push_back(std::thread([&generator, begin, first, part, points, labels]() {
+			generator.generate(begin + first, part, points + first, labels ? labels + first : nullptr);
+		}));
+	}
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+inline unsigned default_threads() {
+	return std::max(1u, std::thread::hardware_concurrency());
+}
+
+} // namespace details
+
+/*
+Generate a whole dataset in memory, on `threads` threads (all hardware threads by default). If
+`labels` is given it receives the true label of every point.
+*/
+template <typename Generator>
+std::vector<typename Generator::point_type> generate_dataset(const Generator& generator,
+	std::vector<uint32_t>* labels = nullptr, unsigned threads = 0) {
+	std::vector<typename Generator::point_type> points(generator.size());
+	if (labels != nullptr) {
+		labels->resize(generator.size());
+	}
+	details::generate_parallel(generator, 0, points.size(), points.data(),
+		labels != nullptr ? labels->data() : nullptr, threads > 0 ? threads : details::default_threads());
+	return points;
+}
+
+/*
+Write a dataset to `path` in the flat binary format read by `mapped_dataset` and `file_reader`,
+generating it `chunk_size` points at a time on `threads` threads so memory use stays bounded.
+Throws `std::runtime_error` if the file can't be written.
+*/
+template <typename Generator>
+void write_dataset(const Generator& generator, const std::string& path,
+	size_t chunk_size = size_t(1) << 16, unsigned threads = 0) {
+	assert(chunk_size > 0);
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		throw std::runtime_error("dkm: unable to create " + path);
+	}
+	std::vector<typename Generator::point_type> chunk(std::min(chunk_size, generator.size()));
+	for (size_t begin = 0; begin < generator.size(); begin += chunk_size) {
+		const size_t count = std::min(chunk_size, generator.size() - begin);
+		details::generate_parallel(generator, begin, count, chunk.data(), static_cast<uint32_t*>(nullptr),
+			threads > 0 ? threads : details::default_threads());
+		file.write(reinterpret_cast<const char*>(chunk.data()),
+			static_cast<std::streamsize>(count * sizeof(typename Generator::point_type)));
+		if (!file) {
+			throw std::runtime_error("dkm: unable to write " + path);
+		}
+	}
+}
+
+/*
+A data source (see dkm_stream.hpp) producing a dataset `chunk_size` points at a time, so datasets
+larger than memory can be clustered without being stored anywhere. The generator is copied.
+*/
+template <typename Generator>
+reader_source<typename Generator::point_type::value_type, std::tuple_size<typename Generator::point_type>::value>
+make_dataset_source(const Generator& generator, size_t chunk_size = 4096) {
+	using point_type = typename Generator::point_type;
+	auto shared = std::make_shared<Generator>(generator);
+	auto position = std::make_shared<size_t>(0);
+	return reader_source<typename point_type::value_type, std::tuple_size<point_type>::value>(
+		[shared, position](point_type* buffer, size_t capacity) {
+			const size_t count = std::min(capacity, shared->size() - *position);
+			shared->generate(*position, count, buffer, nullptr);
+			*position += count;
+			return count;
+		},
+		[position]() { *position = 0; },
+		chunk_size);
+}
+
+} // namespace dkm
+
+#endif /* DKM_DATASETS_H */
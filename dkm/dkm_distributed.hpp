@@ -0,0 +1,756 @@
+#pragma once
+
+#ifndef DKM_DISTRIBUTED_H
+#define DKM_DISTRIBUTED_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dkm.hpp"
+
+/*
+Clustering of data sharded across processes, none of which ever holds more than its own shard.
+Every process runs `kmeans_distributed` over its shard with the same parameters; each iteration they
+assign and accumulate their points locally and then exchange only the per-cluster sums, counts and
+inertia through a `communicator`, so the traffic per iteration is O(k * N) per process whatever the
+size of the shards.
+*/
+namespace dkm {
+
+/*
+Connects the processes of one distributed run, each identified by a rank from 0 to size() - 1.
+`all_gather` is collective: every rank calls it with its own message, of any length, and gets back
+every rank's message in rank order. Since each rank then reduces the same messages in the same
+order, all of them reach bit-identical results without a rank having to broadcast its own.
+
+Communicators are used from one thread at a time, and a rank which stops calling them leaves the
+others waiting.
+*/
+class communicator {
+public:
+	virtual ~communicator() {}
+	virtual uint32_t rank() const = 0;
+	virtual uint32_t size() const = 0;
+	virtual std::vector<std::vector<char>> all_gather(const std::vector<char>& message) = 0;
+
+	/*
+	The longest message any rank will send until the limit is set again, which every rank sets alike.
+	Communicators which read message lengths off the network reject longer ones rather than
+	allocating them; others may ignore it.
+	*/
+	virtual void set_message_limit(uint64_t /* bytes */) {}
+};
+
+/*
+A communicator for processes on the same host, exchanging messages through a POSIX shared memory
+segment guarded by a process-shared barrier. Rank 0 creates the segment under `name` (which must
+start with a '/' and be unique to the run, e.g. contain a job id) and the other ranks wait up to
+`timeout` for it to appear. The name is unlinked as soon as every rank has joined, so nothing is
+left behind in /dev/shm even if the processes are killed later on.
+
+Each rank has a slot of `slot_bytes`; longer messages are exchanged in several rounds.
+
+Throws `std::runtime_error` if the segment can't be created or joined in time.
+*/
+class shared_memory_communicator : public communicator {
+public:
+	shared_memory_communicator(const std::string& name, uint32_t rank, uint32_t size,
+		size_t slot_bytes = size_t(1) << 20, std::chrono::milliseconds timeout = std::chrono::seconds(30)) :
+	_rank(rank), _size(size), _slot_bytes(slot_bytes), _bytes(0), _control(nullptr)
+	{
+		assert(size > 0 && rank < size && slot_bytes > 0);
+		_bytes = sizeof(control) + size * sizeof(uint64_t) + size * slot_bytes;
+		int fd = -1;
+		if (rank == 0) {
+			fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+			if (fd < 0 || ::ftruncate(fd, static_cast<off_t>(_bytes)) != 0) {
+				if (fd >= 0) {
+					::close(fd);
+					::shm_unlink(name.c_str());
+				}
+				throw std::runtime_error("dkm: unable to create the shared memory segment " + name);
+			}
+		} else {
+			const auto give_up = std::chrono::steady_clock::now() + timeout;
+			struct stat info;
+			while ((fd = ::shm_open(name.c_str(), O_RDWR, 0600)) < 0 || ::fstat(fd, &info) != 0
+				|| static_cast<size_t>(info.st_size) < _bytes) {
+				if (fd >= 0) {
+					::close(fd);
+				}
+				if (std::chrono::steady_clock::now() >= give_up) {
+					throw std::runtime_error("dkm: timed out joining the shared memory segment " + name);
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		void* address = ::mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (address == MAP_FAILED) {
+			if (rank == 0) {
+				::shm_unlink(name.c_str());
+			}
+			throw std::runtime_error("dkm: unable to map the shared memory segment " + name);
+		}
+		_control = static_cast<control*>(address);
+		if (rank == 0) {
+			pthread_barrierattr_t attributes;
+			pthread_barrierattr_init(&attributes);
+			pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+			pthread_barrier_init(&_control->barrier, &attributes, size);
+			pthread_barrierattr_destroy(&attributes);
+			_control->ready.store(1, std::memory_order_release);
+		} else {
+			const auto give_up = std::chrono::steady_clock::now() + timeout;
+			while (_control->ready.load(std::memory_order_acquire) == 0) {
+				if (std::chrono::steady_clock::now() >= give_up) {
+					::munmap(address, _bytes);
+					throw std::runtime_error("dkm: timed out waiting for rank 0 to set up " + name);
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		wait();
+		if (rank == 0) {
+			::shm_unlink(name.c_str());
+		}
+	}
+
+	~shared_memory_communicator() {
+		::munmap(_control, _bytes);
+	}
+
+	shared_memory_communicator(const shared_memory_communicator&) = delete;
+	shared_memory_communicator& operator=(const shared_memory_communicator&) = delete;
+
+	uint32_t rank() const override { return _rank; }
+	uint32_t size() const override { return _size; }
+
+	std::vector<std::vector<char>> all_gather(const std::vector<char>& message) override {
+		uint64_t* sizes = reinterpret_cast<uint64_t*>(_control + 1);
+		char* slots = reinterpret_cast<char*>(sizes + _size);
+		sizes[_rank] = message.size();
+		wait();
+		std::vector<std::vector<char>> messages(_size);
+		uint64_t longest = 0;
+		for (uint32_t r = 0; r < _size; ++r) {
+			messages[r].resize(static_cast<size_t>(sizes[r]));
+			longest = std::max(longest, sizes[r]);
+		}
+		// Nobody may write the sizes of the next exchange before everyone has read these
+		wait();
+		for (uint64_t offset = 0; offset < longest; offset += _slot_bytes) {
+			if (offset < message.size()) {
+				std::memcpy(slots + _rank * _slot_bytes, message.data() + offset,
+					std::min<size_t>(_slot_bytes, message.size() - offset));
+			}
+			wait();
+			for (uint32_t r = 0; r < _size; ++r) {
+				if (offset < messages[r].size()) {
+					std::memcpy(&messages[r][offset], slots + r * _slot_bytes,
+						std::min<size_t>(_slot_bytes, messages[r].size() - offset));
+				}
+			}
+			wait();
+		}
+		return messages;
+	}
+
+private:
+	struct control {
+		std::atomic<uint32_t> ready;
+		pthread_barrier_t barrier;
+	};
+
+	void wait() {
+		pthread_barrier_wait(&_control->barrier);
+	}
+
+	uint32_t _rank;
+	uint32_t _size;
+	size_t _slot_bytes;
+	size_t _bytes;
+	control* _control;
+};
+
+/*
+A communicator over TCP for processes on any hosts. Rank 0 acts as the coordinator: it listens on
+`host`:`port`, the other ranks connect there (retrying until `timeout` while the coordinator starts
+up), and each exchange sends every message to the coordinator, which sends the full set back to
+every rank. The coordinator waits at most `timeout` for all of them to join, and binds to `host`
+only, so "127.0.0.1" keeps a run on one machine and the address of a private interface keeps it on
+that network; it listens on every interface only when given "0.0.0.0" or "::".
+
+Connections are neither authenticated nor encrypted, so the port must only be reachable from trusted
+hosts. Ranks introduce themselves with a handshake carrying the size of the run and the coordinator
+turns away connections whose handshake doesn't match, while waiting on silent ones alongside the
+others until `timeout`; messages longer than the limit set with `set_message_limit` are refused
+before anything is allocated for them.
+
+Throws `std::runtime_error` naming the missing ranks if they don't all join in time, if connecting
+fails or if a peer disconnects.
+*/
+class socket_communicator : public communicator {
+public:
+	socket_communicator(uint32_t rank, uint32_t size, const std::string& host, uint16_t port,
+		std::chrono::milliseconds timeout = std::chrono::seconds(30)) :
+	_rank(rank), _size(size), _message_limit(UINT64_MAX)
+	{
+		assert(size > 0 && rank < size);
+		if (rank == 0) {
+			accept_peers(host, port, timeout);
+		} else {
+			connect_to_coordinator(host, port, timeout);
+		}
+	}
+
+	~socket_communicator() {
+		for (int fd : _peers) {
+			if (fd >= 0) {
+				::close(fd);
+			}
+		}
+	}
+
+	socket_communicator(const socket_communicator&) = delete;
+	socket_communicator& operator=(const socket_communicator&) = delete;
+
+	uint32_t rank() const override { return _rank; }
+	uint32_t size() const override { return _size; }
+
+	std::vector<std::vector<char>> all_gather(const std::vector<char>& message) override {
+		std::vector<std::vector<char>> messages(_size);
+		if (_rank == 0) {
+			messages[0] = message;
+			for (uint32_t r = 1; r < _size; ++r) {
+				receive_message(_peers[r], messages[r]);
+			}
+			for (uint32_t r = 1; r < _size; ++r) {
+				for (const auto& gathered : messages) {
+					send_message(_peers[r], gathered);
+				}
+			}
+		} else {
+			send_message(_peers[0], message);
+			for (auto& gathered : messages) {
+				receive_message(_peers[0], gathered);
+			}
+		}
+		return messages;
+	}
+
+	void set_message_limit(uint64_t bytes) override { _message_limit = bytes; }
+
+private:
+	static const uint32_t handshake_magic = 0x434d4b44; // "DKMC"
+	static const size_t max_pending_handshakes = 64;
+
+	static void send_all(int fd, const void* data, size_t size) {
+		const char* position = static_cast<const char*>(data);
+		while (size > 0) {
+			const ssize_t sent = ::send(fd, position, size, MSG_NOSIGNAL);
+			if (sent < 0 && errno == EINTR) {
+				continue;
+			}
+			if (sent <= 0) {
+				throw std::runtime_error("dkm: lost the connection to a peer");
+			}
+			position += sent;
+			size -= static_cast<size_t>(sent);
+		}
+	}
+
+	static void receive_all(int fd, void* data, size_t size) {
+		char* position = static_cast<char*>(data);
+		while (size > 0) {
+			const ssize_t got = ::recv(fd, position, size, 0);
+			if (got < 0 && errno == EINTR) {
+				continue;
+			}
+			if (got <= 0) {
+				throw std::runtime_error("dkm: lost the connection to a peer");
+			}
+			position += got;
+			size -= static_cast<size_t>(got);
+		}
+	}
+
+	static void send_message(int fd, const std::vector<char>& message) {
+		const uint64_t size = message.size();
+		send_all(fd, &size, sizeof(size));
+		send_all(fd, message.data(), message.size());
+	}
+
+	void receive_message(int fd, std::vector<char>& message) const {
+		uint64_t size;
+		receive_all(fd, &size, sizeof(size));
+		if (size > _message_limit) {
+			throw std::runtime_error("dkm: a peer sent a message longer than expected");
+		}
+		message.resize(static_cast<size_t>(size));
+		receive_all(fd, message.data(), message.size());
+	}
+
+	static void no_delay(int fd) {
+		const int enable = 1;
+		::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+	}
+
+	static int listen_on(const std::string& host, uint16_t port, uint32_t backlog) {
+		addrinfo hints;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		addrinfo* addresses = nullptr;
+		if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+			throw std::runtime_error("dkm: unable to resolve " + host);
+		}
+		std::unique_ptr<addrinfo, void (*)(addrinfo*)> owned(addresses, ::freeaddrinfo);
+		for (addrinfo* candidate = addresses; candidate != nullptr; candidate = candidate->ai_next) {
+			const int listener = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+			if (listener < 0) {
+				continue;
+			}
+			const int enable = 1;
+			const int disable = 0;
+			::setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+			if (candidate->ai_family == AF_INET6) {
+				// Given "::", accept IPv4 peers on the same socket
+				::setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable));
+			}
+			if (::bind(listener, candidate->ai_addr, candidate->ai_addrlen) == 0
+				&& ::listen(listener, static_cast<int>(backlog)) == 0) {
+				return listener;
+			}
+			::close(listener);
+		}
+		throw std::runtime_error("dkm: unable to listen on " + host + ":" + std::to_string(port));
+	}
+
+	// A connection accepted by the coordinator whose handshake hasn't fully arrived yet
+	struct pending_peer {
+		int fd;
+		size_t received;
+		uint32_t handshake[3];
+	};
+
+	/*
+	Accept connections until every rank has joined or `timeout` has passed. Handshakes are read from
+	all pending connections at once, so one which stays silent doesn't hold up the ranks behind it;
+	at most `max_pending_handshakes` are pending at a time.
+	*/
+	void accept_peers(const std::string& host, uint16_t port, std::chrono::milliseconds timeout) {
+		_peers.assign(_size, -1);
+		const int listener = listen_on(host, port, _size);
+		const auto give_up = std::chrono::steady_clock::now() + timeout;
+		std::vector<pending_peer> pending;
+		std::vector<pollfd> waiting;
+		try {
+			for (uint32_t joined = 1; joined < _size;) {
+				const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+					give_up - std::chrono::steady_clock::now());
+				if (remaining.count() <= 0) {
+					throw std::runtime_error("dkm: timed out waiting for " + missing_ranks() + " to connect");
+				}
+				waiting.clear();
+				for (const pending_peer& peer : pending) {
+					waiting.push_back(pollfd{peer.fd, POLLIN, 0});
+				}
+				if (pending.size() < max_pending_handshakes) {
+					waiting.push_back(pollfd{listener, POLLIN, 0});
+				}
+				const int ready = ::poll(waiting.data(), waiting.size(),
+					static_cast<int>(std::min<int64_t>(remaining.count(), INT32_MAX)));
+				if (ready < 0 && errno != EINTR) {
+					throw std::runtime_error("dkm: unable to wait for peers");
+				}
+				if (ready <= 0) {
+					continue;
+				}
+				// Read what has arrived of each handshake; a connection which isn't a rank of this run is closed
+				size_t kept = 0;
+				for (size_t i = 0; i < pending.size(); ++i) {
+					pending_peer& peer = pending[i];
+					bool open = true;
+					if (waiting[i].revents != 0) {
+						const ssize_t received = ::recv(peer.fd, reinterpret_cast<char*>(peer.handshake) + peer.received,
+							sizeof(peer.handshake) - peer.received, MSG_DONTWAIT);
+						if (received > 0) {
+							peer.received += static_cast<size_t>(received);
+						} else if (received == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+							open = false;
+						}
+					}
+					if (open && peer.received == sizeof(peer.handshake)) {
+						const uint32_t peer_rank = peer.handshake[1];
+						open = false;
+						if (peer.handshake[0] == handshake_magic && peer.handshake[2] == _size && peer_rank > 0
+							&& peer_rank < _size && _peers[peer_rank] < 0) {
+							no_delay(peer.fd);
+							_peers[peer_rank] = peer.fd;
+							++joined;
+							continue;
+						}
+					}
+					if (open) {
+						pending[kept++] = peer;
+					} else {
+						::close(peer.fd);
+					}
+				}
+				const bool listening = waiting.size() > pending.size();
+				pending.resize(kept);
+				if (listening && waiting.back().revents != 0) {
+					const int fd = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+					if (fd >= 0) {
+						pending.push_back(pending_peer{fd, 0, {0, 0, 0}});
+					} else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK) {
+						throw std::runtime_error("dkm: unable to accept a peer");
+					}
+				}
+			}
+		} catch (...) {
+			::close(listener);
+			// The destructor won't run for a communicator that failed to construct
+			for (const pending_peer& peer : pending) {
+				::close(peer.fd);
+			}
+			for (int& fd : _peers) {
+				if (fd >= 0) {
+					::close(fd);
+					fd = -1;
+				}
+			}
+			throw;
+		}
+		for (const pending_peer& peer : pending) {
+			::close(peer.fd);
+		}
+		::close(listener);
+	}
+
+	// The ranks which haven't joined yet, e.g. "ranks 2, 5"
+	std::string missing_ranks() const {
+		std::string missing;
+		size_t count = 0;
+		for (uint32_t rank = 1; rank < _size; ++rank) {
+			if (_peers[rank] < 0) {
+				missing += (count++ == 0 ? "" : ", ") + std::to_string(rank);
+			}
+		}
+		return (count == 1 ? "rank " : "ranks ") + missing;
+	}
+
+	void connect_to_coordinator(const std::string& host, uint16_t port, std::chrono::milliseconds timeout) {
+		addrinfo hints;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* addresses = nullptr;
+		if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+			throw std::runtime_error("dkm: unable to resolve " + host);
+		}
+		std::unique_ptr<addrinfo, void (*)(addrinfo*)> owned(addresses, ::freeaddrinfo);
+		const auto give_up = std::chrono::steady_clock::now() + timeout;
+		while (true) {
+			for (addrinfo* candidate = addresses; candidate != nullptr; candidate = candidate->ai_next) {
+				const int fd = ::socket(candidate->ai_family, candidate->ai_socktype | SOCK_CLOEXEC, candidate->ai_protocol);
+				if (fd < 0) {
+					continue;
+				}
+				if (::connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0) {
+					no_delay(fd);
+					_peers.assign(1, fd);
+					const uint32_t handshake[3] = {handshake_magic, _rank, _size};
+					send_all(fd, handshake, sizeof(handshake));
+					return;
+				}
+				::close(fd);
+			}
+			if (std::chrono::steady_clock::now() >= give_up) {
+				throw std::runtime_error("dkm: timed out connecting to " + host + ":" + std::to_string(port));
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+
+	uint32_t _rank;
+	uint32_t _size;
+	uint64_t _message_limit;
+	// The coordinator's connection to each rank by rank, or the other ranks' one connection to it
+	std::vector<int> _peers;
+};
+
+namespace details {
+
+/*
+Append a trivially copyable value, or read one back from `position`, advancing it.
+*/
+template <typename V>
+void put_value(std::vector<char>& message, const V& value) {
+	const char* bytes = reinterpret_cast<const char*>(&value);
+	message.insert(message.end(), bytes, bytes + sizeof(V));
+}
+
+template <typename V>
+V get_value(const std::vector<char>& message, size_t& position) {
+	if (message.size() - position < sizeof(V)) {
+		throw std::runtime_error("dkm: truncated message from a peer");
+	}
+	V value;
+	std::memcpy(&value, message.data() + position, sizeof(V));
+	position += sizeof(V);
+	return value;
+}
+
+/*
+The agreed outcome of the last collective step: the reason any rank gave for stopping, so that all
+ranks stop together and report the same reason. Never asks to stop on its own account.
+*/
+struct collective_stop {
+	bool stopped;
+	convergence_reason agreed;
+
+	collective_stop() : stopped(false), agreed(convergence_reason::converged) {}
+	bool operator()() const { return false; }
+	convergence_reason reason() const { return agreed; }
+};
+
+// The length of an `encode_accumulator` message for k clusters
+template <typename T, size_t N>
+uint64_t accumulator_message_size(size_t k) {
+	return sizeof(uint32_t) * 2 + k * (sizeof(std::array<T, N>) + sizeof(uint64_t) + sizeof(double)) + sizeof(uint64_t);
+}
+
+/*
+Every rank's accumulator (and whether it abandoned its pass) as one message.
+*/
+template <typename T, size_t N>
+std::vector<char> encode_accumulator(const accumulator<T, N>& totals, bool abandoned, convergence_reason reason) {
+	std::vector<char> message;
+	message.reserve(static_cast<size_t>(accumulator_message_size<T, N>(totals.sums.size())));
+	put_value(message, static_cast<uint32_t>(abandoned));
+	put_value(message, static_cast<uint32_t>(reason));
+	for (size_t i = 0; i < totals.sums.size(); ++i) {
+		put_value(message, totals.sums[i]);
+		put_value(message, totals.counts[i]);
+		put_value(message, totals.inertia[i]);
+	}
+	put_value(message, totals.changed);
+	return message;
+}
+
+/*
+Merge the accumulators of all ranks, in rank order, into `totals`. Returns false and sets the agreed
+reason in `stop` if any rank abandoned its pass; the lowest such rank's reason wins.
+*/
+template <typename T, size_t N>
+bool reduce_accumulators(const std::vector<std::vector<char>>& messages, accumulator<T, N>& totals,
+	collective_stop& stop) {
+	const size_t k = totals.sums.size();
+	totals.reset(k);
+	accumulator<T, N> other;
+	other.reset(k);
+	for (const auto& message : messages) {
+		size_t position = 0;
+		const bool abandoned = get_value<uint32_t>(message, position) != 0;
+		const convergence_reason reason = static_cast<convergence_reason>(get_value<uint32_t>(message, position));
+		if (abandoned && !stop.stopped) {
+			stop.stopped = true;
+			stop.agreed = reason;
+		}
+		for (size_t i = 0; i < k; ++i) {
+			other.sums[i] = get_value<std::array<T, N>>(message, position);
+			other.counts[i] = get_value<uint64_t>(message, position);
+			other.inertia[i] = get_value<double>(message, position);
+		}
+		other.changed = get_value<uint64_t>(message, position);
+		totals.merge(other);
+	}
+	return !stop.stopped;
+}
+
+/*
+Seed the means with kmeans++ on a sample drawn across all ranks. The sample size is split between
+the ranks in proportion to their shard sizes and each rank draws its share uniformly without
+replacement, keeping the order of its points; the shares are then gathered in rank order and every
+rank runs the same kmeans++ on the same sample. When all shards together hold no more than
+`sample_size` points the sample is simply every point, so the seeds match those `kmeans_cluster`
+would pick for the shards concatenated in rank order.
+
+Each rank checks `should_stop` while drawing its share; a rank which stops fills the rest of its
+share with points spread evenly over the rest of its shard. The ranks send whether they stopped with
+their shares, and if any did every rank picks the means at random from the sample instead of
+running kmeans++, so all of them still agree on the seeds.
+*/
+template <typename T, size_t N, typename Stop>
+std::vector<std::array<T, N>> distributed_plusplus(const std::array<T, N>* data, size_t count, uint32_t k,
+	uint64_t seed, size_t sample_size, const Stop& should_stop, communicator& peers, trace_sink* trace) {
+	std::vector<char> size_message;
+	put_value(size_message, static_cast<uint64_t>(count));
+	peers.set_message_limit(sizeof(uint64_t));
+	const auto sizes = peers.all_gather(size_message);
+	uint64_t before = 0;
+	uint64_t total = 0;
+	for (uint32_t r = 0; r < sizes.size(); ++r) {
+		size_t position = 0;
+		const uint64_t shard = get_value<uint64_t>(sizes[r], position);
+		if (r < peers.rank()) {
+			before += shard;
+		}
+		total += shard;
+	}
+	if (total < k) {
+		throw std::runtime_error("dkm: the shards hold fewer points than clusters");
+	}
+	const uint64_t sample = std::min<uint64_t>(sample_size, total);
+	// Rounding the running split at both ends makes the shares add up to exactly `sample`
+	const uint64_t first = static_cast<uint64_t>(static_cast<long double>(sample) * before / total);
+	const uint64_t last = static_cast<uint64_t>(static_cast<long double>(sample) * (before + count) / total);
+	uint64_t wanted = last - first;
+
+	std::vector<char> sample_message;
+	bool stopped = false;
+	{
+		trace_scope sampling(trace, "sampling", "seeding", "sample size", wanted);
+		sample_message.reserve(sizeof(uint32_t) + static_cast<size_t>(wanted) * sizeof(std::array<T, N>));
+		put_value(sample_message, uint32_t(0));
+		std::linear_congruential_engine<uint64_t, 6364136223846793005, 1442695040888963407, UINT64_MAX> rand_engine(
+			seed ^ (0x9e3779b97f4a7c15ull * (peers.rank() + 1)));
+		// Selection sampling: take each point with probability wanted / remaining
+		for (size_t i = 0; i < count && wanted > 0; ++i) {
+			if (i % stop_check_interval == 0 && i > 0 && should_stop()) {
+				for (uint64_t j = 0; j < wanted; ++j) {
+					put_value(sample_message, data[i + static_cast<size_t>(j * (count - i) / wanted)]);
+				}
+				stopped = true;
+				break;
+			}
+			if (wanted == count - i || std::uniform_int_distribution<uint64_t>(0, count - i - 1)(rand_engine) < wanted) {
+				put_value(sample_message, data[i]);
+				--wanted;
+			}
+		}
+		stopped = stopped || should_stop();
+		const uint32_t flag = stopped ? 1 : 0;
+		std::memcpy(sample_message.data(), &flag, sizeof(flag));
+	}
+	// No rank's share is larger than the whole sample
+	peers.set_message_limit(sizeof(uint32_t) + sample * sizeof(std::array<T, N>));
+	const auto shares = peers.all_gather(sample_message);
+	std::vector<std::array<T, N>> gathered;
+	gathered.reserve(static_cast<size_t>(sample));
+	bool any_stopped = false;
+	for (const auto& share : shares) {
+		size_t position = 0;
+		any_stopped = get_value<uint32_t>(share, position) != 0 || any_stopped;
+		while (position < share.size()) {
+			gathered.push_back(get_value<std::array<T, N>>(share, position));
+		}
+	}
+	// Every rank must make the same kmeans++ rounds, so only the agreed flag is consulted
+	return random_plusplus(gathered.data(), gathered.size(), k, seed, [any_stopped] { return any_stopped; }, trace);
+}
+
+} // namespace details
+
+/*
+Implementation of k-means over data sharded across processes. Every rank of `peers` calls this with
+its own shard and the same parameters (including the same random seed, if any); all of them return
+the same means, iteration count and reason, and the counts and inertia of the whole dataset. The
+labels, if kept, are those of the rank's own shard.
+
+Seeding uses kmeans++ on a sample of at most `seeding_sample_size` points drawn from all shards (see
+`details::distributed_plusplus`). Each iteration every rank assigns and accumulates its shard, using
+`get_threads()` threads, and the ranks then exchange their accumulators, which every rank merges in
+rank order. Results are therefore reproducible for a given sharding and thread count, and a single
+rank whose shard fits in the sample gives exactly the results of `kmeans_cluster`.
+
+A deadline or cancellation seen by any rank stops all of them after the current iteration's
+exchange, with the means of the last completed iteration. Throws if the communicator fails, e.g.
+because a peer went away.
+*/
+template <typename T, size_t N, typename L = uint32_t>
+clustering_result<T, N, L> kmeans_distributed(const std::array<T, N>* data, size_t count,
+	const clustering_parameters<T>& parameters, communicator& peers, size_t seeding_sample_size = size_t(1) << 16) {
+	static_assert(std::is_arithmetic<T>::value && std::is_signed<T>::value,
+		"kmeans_distributed requires the template parameter T to be a signed arithmetic type (e.g. float, double, int)");
+	assert(parameters.get_k() > 0); // k must be greater than zero
+	assert(details::labels_fit<L>(parameters.get_k())); // the label type must be able to hold k labels
+	// Every rank must seed from the same value, so a random one is agreed on through rank 0
+	uint64_t seed = parameters.get_random_seed();
+	if (!parameters.has_random_seed()) {
+		std::random_device rand_device;
+		std::vector<char> message;
+		details::put_value(message, static_cast<uint64_t>(rand_device()));
+		peers.set_message_limit(sizeof(uint64_t));
+		size_t position = 0;
+		seed = details::get_value<uint64_t>(peers.all_gather(message)[0], position);
+	}
+	details::stop_condition<T> local_stop(parameters);
+	trace_sink* trace = parameters.get_trace_sink();
+	clustering_result<T, N, L> result;
+	{
+		details::phase_scope scope(parameters, clustering_phase::seeding);
+		result.means = details::distributed_plusplus(data, count, parameters.get_k(), seed,
+			std::max<size_t>(seeding_sample_size, parameters.get_k()), local_stop, peers, trace);
+	}
+
+	if (parameters.get_keep_labels()) {
+		result.labels.resize(count);
+		DKM_COUNT(assignment, allocations, 1);
+	}
+	L* labels = result.labels.empty() ? nullptr : result.labels.data();
+	const uint32_t threads = static_cast<uint32_t>(std::min<size_t>(parameters.get_threads(),
+		std::max<size_t>(1, count / details::stop_check_interval)));
+	std::vector<details::accumulator<T, N>> partials;
+	details::collective_stop should_stop;
+	peers.set_message_limit(details::accumulator_message_size<T, N>(parameters.get_k()));
+	details::lloyd_iterations(result, parameters, should_stop, labels != nullptr,
+		[data, count, labels, &local_stop, &should_stop, trace, threads, &partials, &peers](
+			const std::vector<std::array<T, N>>& means, details::accumulator<T, N>& totals) {
+			// The collective condition never stops a pass by itself, so the local one is checked up front too
+			const bool completed = !local_stop() && details::assign_in_memory(data, count, means, labels, totals,
+				partials, threads, local_stop, trace);
+			details::trace_scope exchange(trace, "all-gather", "communication", "ranks", peers.size());
+			const auto messages = peers.all_gather(details::encode_accumulator(totals, !completed, local_stop.reason()));
+			return details::reduce_accumulators(messages, totals, should_stop);
+		});
+	return result;
+}
+
+template <typename T, size_t N, typename L = uint32_t>
+clustering_result<T, N, L> kmeans_distributed(const std::vector<std::array<T, N>>& data,
+	const clustering_parameters<T>& parameters, communicator& peers, size_t seeding_sample_size = size_t(1) << 16) {
+	return kmeans_distributed<T, N, L>(data.data(), data.size(), parameters, peers, seeding_sample_size);
+}
+
+} // namespace dkm
+
+#endif /* DKM_DISTRIBUTED_H */
@@ -0,0 +1,511 @@
+#pragma once
+
+#ifndef DKM_IO_H
+#define DKM_IO_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dkm.hpp"
+#include "dkm_stream.hpp"
+
+/*
+Binary storage for dkm models and datasets. This relies on POSIX memory mapping and is therefore
+not available on Windows.
+*/
+namespace dkm {
+
+namespace details {
+
+/*
+Layout of the fixed 64 byte header at the start of a binary model file. All fields are stored
+little-endian. The means follow at `means_offset` as `k` zero padded rows of `stride` elements and
+the squared norm of each mean follows at `norms_offset`, both aligned to 64 bytes so a mapped file
+can be used for prediction in place.
+*/
+struct model_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t type_tag;
+	uint64_t k;
+	uint64_t dimensions;
+	uint64_t stride;
+	uint64_t means_offset;
+	uint64_t norms_offset;
+	uint64_t checksum;
+};
+
+static_assert(sizeof(model_file_header) == 64, "model_file_header must be exactly 64 bytes");
+
+const char model_file_magic[8] = {'D', 'K', 'M', 'M', 'O', 'D', 'E', 'L'};
+const uint32_t model_file_version = 1;
+
+/*
+Identify the element type stored in a file: the low byte is the size in bytes and the next byte
+is 1 for floating point and 2 for integer types.
+*/
+template <typename T>
+uint32_t type_tag() {
+	return static_cast<uint32_t>(sizeof(T)) | (std::is_floating_point<T>::value ? 0x100u : 0x200u);
+}
+
+inline bool host_is_little_endian() {
+	const uint16_t probe = 1;
+	unsigned char first;
+	std::memcpy(&first, &probe, 1);
+	return first == 1;
+}
+
+/*
+64 bit FNV-1a hash, used as the integrity checksum of binary files.
+*/
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+/*
+The checksum covers every header field before it and the whole payload.
+*/
+inline uint64_t model_checksum(const model_file_header& header, const void* payload, size_t payload_size) {
+	return fnv1a(payload, payload_size, fnv1a(&header, offsetof(model_file_header, checksum)));
+}
+
+inline size_t align_up(size_t value, size_t alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+/*
+A read-only mapping of a whole file. The mapping is released when the last copy of the returned
+pointer is destroyed.
+*/
+inline std::shared_ptr<const void> map_file(const std::string& path, size_t& size) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("dkm: unable to open " + path);
+	}
+	struct stat info;
+	if (::fstat(fd, &info) != 0 || info.st_size <= 0) {
+		::close(fd);
+		throw std::runtime_error("dkm: unable to read the size of " + path);
+	}
+	size = static_cast<size_t>(info.st_size);
+	void* address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED) {
+		throw std::runtime_error("dkm: unable to map " + path);
+	}
+	const size_t mapped_size = size;
+	return std::shared_ptr<const void>(address, [mapped_size](const void* p) {
+		::munmap(const_cast<void*>(p), mapped_size);
+	});
+}
+
+/*
+A name next to `path` for writing its new contents before renaming them over it, unique to this
+process and call so concurrent writers of the same path don't share one.
+*/
+inline std::string temporary_path(const std::string& path) {
+	static std::atomic<uint64_t> counter(0);
+	return path + ".dkm-tmp." + std::to_string(::getpid()) + "." + std::to_string(counter++);
+}
+
+} // namespace details
+
+/*
+Write a model to `path` in the dkm binary model format (see `details::model_file_header`). The
+file can be loaded again with `load_model`, which maps it instead of parsing it.
+
+The model is written to a temporary file in the same directory which is then renamed over `path`,
+so models already loaded from `path` keep mapping the old file rather than seeing it truncated.
+
+Throws `std::runtime_error` if the file can't be written or the host isn't little-endian.
+*/
+template <typename T, size_t N>
+void save_model(const kmeans_model<T, N>& model, const std::string& path) {
+	if (!details::host_is_little_endian()) {
+		throw std::runtime_error("dkm: binary models can only be written on little-endian hosts");
+	}
+	const size_t stride = kmeans_model<T, N>::stride();
+	const size_t means_bytes = model.k() * stride * sizeof(T);
+	details::model_file_header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, details::model_file_magic, sizeof(header.magic));
+	header.version = details::model_file_version;
+	header.type_tag = details::type_tag<T>();
+	header.k = model.k();
+	header.dimensions = N;
+	header.stride = stride;
+	header.means_offset = sizeof(header);
+	header.norms_offset = details::align_up(header.means_offset + means_bytes, 64);
+
+	std::vector<char> payload(header.norms_offset - header.means_offset + model.k() * sizeof(T), 0);
+	if (model.k() > 0) {
+		std::memcpy(payload.data(), model.data(), means_bytes);
+		std::memcpy(payload.data() + (header.norms_offset - header.means_offset), model.norms(), model.k() * sizeof(T));
+	}
+	header.checksum = details::model_checksum(header, payload.data(), payload.size());
+
+	const std::string temporary = details::temporary_path(path);
+	std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+	file.flush();
+	file.close();
+	if (!file || std::rename(temporary.c_str(), path.c_str()) != 0) {
+		std::remove(temporary.c_str());
+		throw std::runtime_error("dkm: unable to write " + path);
+	}
+}
+
+/*
+Load a model written by `save_model`. The file is memory mapped and the model predicts directly
+from the mapping, so loading costs a handful of system calls regardless of the model size; the
+mapping stays alive for as long as the model or any copy of it exists.
+
+Verifying the checksum touches every page of the file, which can be skipped with
+`verify_checksum = false` when files are known to be intact.
+
+Throws `std::runtime_error` if the file can't be mapped, is corrupt or truncated, or holds a model
+of a different element type or dimension than T and N.
+*/
+template <typename T, size_t N>
+kmeans_model<T, N> load_model(const std::string& path, bool verify_checksum = true) {
+	if (!details::host_is_little_endian()) {
+		throw std::runtime_error("dkm: binary models can only be loaded on little-endian hosts");
+	}
+	size_t size = 0;
+	auto mapping = details::map_file(path, size);
+	const char* base = static_cast<const char*>(mapping.get());
+	details::model_file_header header;
+	if (size < sizeof(header)) {
+		throw std::runtime_error("dkm: " + path + " is too small to be a model");
+	}
+	std::memcpy(&header, base, sizeof(header));
+	if (std::memcmp(header.magic, details::model_file_magic, sizeof(header.magic)) != 0
+		|| header.version != details::model_file_version) {
+		throw std::runtime_error("dkm: " + path + " is not a supported model file");
+	}
+	if (header.type_tag != details::type_tag<T>() || header.dimensions != N
+		|| header.stride != kmeans_model<T, N>::stride()) {
+		throw std::runtime_error("dkm: " + path + " holds a model of a different type or dimension");
+	}
+	// Bound k before multiplying and compare differences rather than sums, so that no check can wrap
+	if (header.k > UINT32_MAX || header.k > size / (header.stride * sizeof(T))
+		|| header.means_offset % 64 != 0 || header.norms_offset % 64 != 0
+		|| header.means_offset < sizeof(header) || header.means_offset > size
+		|| header.norms_offset < header.means_offset || header.norms_offset > size
+		|| header.k * header.stride * sizeof(T) > header.norms_offset - header.means_offset
+		|| header.k * sizeof(T) > size - header.norms_offset) {
+		throw std::runtime_error("dkm: " + path + " is truncated or malformed");
+	}
+	if (verify_checksum) {
+		const size_t payload_size = header.norms_offset + header.k * sizeof(T) - header.means_offset;
+		if (details::model_checksum(header, base + header.means_offset, payload_size) != header.checksum) {
+			throw std::runtime_error("dkm: checksum mismatch in " + path);
+		}
+	}
+	return kmeans_model<T, N>(mapping,
+		reinterpret_cast<const T*>(base + header.means_offset),
+		reinterpret_cast<const T*>(base + header.norms_offset),
+		static_cast<uint32_t>(header.k));
+}
+
+/*
+mapped_dataset gives read-only access to a flat binary file of points without loading it into
+memory. The file must contain only the points, each stored as N native (little-endian) values of
+type T one after another, i.e. exactly the in-memory layout of `std::array<T, N>`.
+
+The mapping is hinted for sequential access since clustering streams it from start to end on every
+iteration; the kernel is then free to read ahead and evict already processed pages, so datasets
+much larger than RAM can be clustered.
+*/
+template <typename T, size_t N>
+class mapped_dataset {
+public:
+	static_assert(sizeof(std::array<T, N>) == N * sizeof(T), "std::array must not be padded");
+
+	explicit mapped_dataset(const std::string& path) : _bytes(0) {
+		_mapping = details::map_file(path, _bytes);
+		if (_bytes % sizeof(std::array<T, N>) != 0) {
+			throw std::runtime_error("dkm: the size of " + path + " isn't a multiple of the point size");
+		}
+		advise(0, size(), MADV_SEQUENTIAL);
+	}
+
+	const std::array<T, N>* data() const { return static_cast<const std::array<T, N>*>(_mapping.get()); }
+	size_t size() const { return _bytes / sizeof(std::array<T, N>); }
+	const std::array<T, N>& operator[](size_t index) const { return data()[index]; }
+
+	/*
+	Pass an `madvise` hint for the pages holding points [begin, begin + count). Hints are advisory
+	so failures are ignored.
+	*/
+	void advise(size_t begin, size_t count, int advice) const {
+		if (count == 0) {
+			return;
+		}
+		const uintptr_t page = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+		const uintptr_t first = reinterpret_cast<uintptr_t>(data() + begin) / page * page;
+		const uintptr_t last = reinterpret_cast<uintptr_t>(data() + begin + count);
+		::madvise(reinterpret_cast<void*>(first), last - first, advice);
+	}
+
+private:
+	std::shared_ptr<const void> _mapping;
+	size_t _bytes;
+};
+
+/*
+mapped_labels creates (or truncates) a file holding `count` native cluster labels of type L and maps
+it writable, so labels for datasets larger than memory can be produced without holding them in RAM.
+*/
+template <typename L = uint32_t>
+class mapped_labels {
+public:
+	mapped_labels(const std::string& path, size_t count) : _labels(nullptr), _count(count) {
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			throw std::runtime_error("dkm: unable to create " + path);
+		}
+		const size_t bytes = count * sizeof(L);
+		if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+			::close(fd);
+			throw std::runtime_error("dkm: unable to resize " + path);
+		}
+		if (bytes > 0) {
+			void* address = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (address == MAP_FAILED) {
+				::close(fd);
+				throw std::runtime_error("dkm: unable to map " + path);
+			}
+			_labels = static_cast<L*>(address);
+		}
+		::close(fd);
+	}
+
+	~mapped_labels() {
+		if (_labels != nullptr) {
+			::munmap(_labels, _count * sizeof(L));
+		}
+	}
+
+	mapped_labels(const mapped_labels&) = delete;
+	mapped_labels& operator=(const mapped_labels&) = delete;
+
+	L* data() { return _labels; }
+	const L* data() const { return _labels; }
+	size_t size() const { return _count; }
+
+private:
+	L* _labels;
+	size_t _count;
+};
+
+namespace details {
+
+/*
+kmeans++ on a uniform random sample of at most `sample_size` points. Small datasets are seeded from
+every point, giving the same means as seeding the in-memory copy of the data would. The kmeans++
+rounds are reported to `trace`, if given.
+
+`should_stop` is checked while gathering the sample, which may fault in pages from all over the
+file, and before each kmeans++ round. Once it returns true the means are picked at random from k
+points spread evenly over the sampled indices instead.
+*/
+template <typename T, size_t N, typename Stop>
+std::vector<std::array<T, N>> sampled_plusplus(const std::array<T, N>* data, size_t count,
+	uint32_t k, uint64_t seed, size_t sample_size, const Stop& should_stop, trace_sink* trace = nullptr) {
+	if (count <= sample_size) {
+		return random_plusplus(data, count, k, seed, should_stop, trace);
+	}
+	std::linear_congruential_engine<uint64_t, 6364136223846793005, 1442695040888963407, UINT64_MAX> rand_engine(seed);
+	std::uniform_int_distribution<size_t> uniform_generator(0, count - 1);
+	std::vector<size_t> indices(std::max<size_t>(sample_size, k));
+	for (auto& index : indices) {
+		index = uniform_generator(rand_engine);
+	}
+	// Read the sample in file order so it is gathered with forward seeks only
+	std::sort(indices.begin(), indices.end());
+	std::vector<std::array<T, N>> sample;
+	{
+		trace_scope sampling(trace, "sampling", "seeding", "points", indices.size());
+		sample.reserve(indices.size());
+		for (size_t i = 0; i < indices.size(); ++i) {
+			if (i % stop_check_interval == 0 && i > 0 && should_stop()) {
+				sample.clear();
+				for (uint32_t j = 0; j < k; ++j) {
+					sample.push_back(data[indices[j * indices.size() / k]]);
+				}
+				break;
+			}
+			sample.push_back(data[indices[i]]);
+		}
+	}
+	return random_plusplus(sample.data(), sample.size(), k, seed, should_stop, trace);
+}
+
+} // namespace details
+
+/*
+Run `kmeans_cluster` over a memory mapped dataset. Each iteration streams the mapping sequentially in
+windows of `window_bytes`, prefetching the next window with `MADV_WILLNEED` and releasing the
+previous one with `MADV_DONTNEED` so resident memory stays bounded by a few windows. Assignment and
+mean accumulation are fused into that single pass.
+
+The means are seeded with kmeans++ on a uniform sample of at most `seeding_sample_size` points.
+If `labels_path` isn't empty, the final cluster assignment of every point is written to that file as
+native values of type L (see `mapped_labels`).
+
+Returns a `clustering_result` with the means, cluster sizes and inertia; its labels are always
+empty since they are only ever written to `labels_path`.
+*/
+template <typename T, size_t N, typename L = uint32_t>
+clustering_result<T, N, L> kmeans_cluster(const mapped_dataset<T, N>& data,
+	const clustering_parameters<T>& parameters, const std::string& labels_path = std::string(),
+	size_t window_bytes = size_t(64) << 20, size_t seeding_sample_size = size_t(1) << 20) {
+	static_assert(std::is_arithmetic<T>::value && std::is_signed<T>::value,
+		"kmeans_cluster requires the template parameter T to be a signed arithmetic type (e.g. float, double, int)");
+	assert(parameters.get_k() > 0); // k must be greater than zero
+	assert(data.size() >= parameters.get_k()); // there must be at least k data points
+	assert(details::labels_fit<L>(parameters.get_k())); // the label type must be able to hold k labels
+	std::random_device rand_device;
+	uint64_t seed = parameters.has_random_seed() ? parameters.get_random_seed() : rand_device();
+	details::stop_condition<T> should_stop(parameters);
+	clustering_result<T, N, L> result;
+	{
+		details::phase_scope scope(parameters, clustering_phase::seeding);
+		result.means = details::sampled_plusplus(data.data(), data.size(), parameters.get_k(), seed, seeding_sample_size,
+			should_stop, parameters.get_trace_sink());
+	}
+
+	std::unique_ptr<mapped_labels<L>> labels;
+	if (!labels_path.empty()) {
+		labels.reset(new mapped_labels<L>(labels_path, data.size()));
+	}
+	const size_t window = std::max<size_t>(1, window_bytes / sizeof(std::array<T, N>));
+	trace_sink* trace = parameters.get_trace_sink();
+	details::lloyd_iterations(result, parameters, should_stop, labels != nullptr,
+		[&data, &labels, window, &should_stop, trace](const std::vector<std::array<T, N>>& means, details::accumulator<T, N>& totals) {
+			data.advise(0, std::min(window, data.size()), MADV_WILLNEED);
+			for (size_t begin = 0; begin < data.size(); begin += window) {
+				if (begin > 0 && should_stop()) {
+					return false;
+				}
+				details::trace_scope chunk(trace, "window", "assignment", "first point", begin);
+				const size_t count = std::min(window, data.size() - begin);
+				if (begin + count < data.size()) {
+					data.advise(begin + count, std::min(window, data.size() - begin - count), MADV_WILLNEED);
+				}
+				// Checked as often as for data in memory, however large the window
+				for (size_t part = 0; part < count; part += details::stop_check_interval) {
+					if (part > 0 && should_stop()) {
+						return false;
+					}
+					details::assign_and_accumulate(data.data() + begin + part, std::min(details::stop_check_interval, count - part),
+						means, labels ? labels->data() + begin + part : nullptr, totals);
+				}
+				data.advise(begin, count, MADV_DONTNEED);
+			}
+			return true;
+		});
+	return result;
+}
+
+/*
+file_reader reads a flat binary file of points (the same layout as `mapped_dataset`) front to back
+with plain `read` calls, for use as the reader of a `reader_source` or `prefetching_source`. Unlike
+a mapping this never faults pages in on the compute thread, so when paired with a
+`prefetching_source` all waiting on the disk happens on the I/O thread.
+*/
+template <typename T, size_t N>
+class file_reader {
+public:
+	explicit file_reader(const std::string& path) : _path(path) {
+		_fd = ::open(path.c_str(), O_RDONLY);
+		if (_fd < 0) {
+			throw std::runtime_error("dkm: unable to open " + path);
+		}
+#ifdef POSIX_FADV_SEQUENTIAL
+		::posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	}
+
+	~file_reader() { ::close(_fd); }
+
+	file_reader(const file_reader&) = delete;
+	file_reader& operator=(const file_reader&) = delete;
+
+	/*
+	Read up to `capacity` whole points into `buffer`, returning how many were read; 0 at the end.
+	*/
+	size_t read(std::array<T, N>* buffer, size_t capacity) {
+		char* bytes = reinterpret_cast<char*>(buffer);
+		const size_t wanted = capacity * sizeof(std::array<T, N>);
+		size_t got = 0;
+		while (got < wanted) {
+			ssize_t result = ::read(_fd, bytes + got, wanted - got);
+			if (result < 0) {
+				throw std::runtime_error("dkm: unable to read " + _path);
+			}
+			if (result == 0) {
+				break;
+			}
+			got += static_cast<size_t>(result);
+		}
+		if (got % sizeof(std::array<T, N>) != 0) {
+			throw std::runtime_error("dkm: " + _path + " ends with a partial point");
+		}
+		return got / sizeof(std::array<T, N>);
+	}
+
+	void restart() {
+		if (::lseek(_fd, 0, SEEK_SET) != 0) {
+			throw std::runtime_error("dkm: unable to rewind " + _path);
+		}
+	}
+
+private:
+	std::string _path;
+	int _fd;
+};
+
+/*
+Create a `prefetching_source` which reads a flat binary file of points on its own I/O thread, so
+the next `chunk_size` points are read while the current ones are being clustered. Reads are reported
+to `trace`, if given.
+*/
+template <typename T, size_t N>
+std::unique_ptr<prefetching_source<T, N>> make_file_source(const std::string& path,
+	size_t chunk_size = size_t(1) << 16, size_t buffer_count = 3, std::shared_ptr<trace_sink> trace = nullptr) {
+	auto reader = std::make_shared<file_reader<T, N>>(path);
+	return std::unique_ptr<prefetching_source<T, N>>(new prefetching_source<T, N>(
+		[reader](std::array<T, N>* buffer, size_t capacity) { return reader->read(buffer, capacity); },
+		[reader]() { reader->restart(); },
+		chunk_size, buffer_count, std::move(trace)));
+}
+
+} // namespace dkm
+
+#endif /* DKM_IO_H */
@@ -0,0 +1,353 @@
+#pragma once
+
+#ifndef DKM_ONLINE_H
+#define DKM_ONLINE_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "dkm.hpp"
+
+/*
+Online k-means for unbounded streams of points: the means are updated as each point arrives instead
+of by rerunning Lloyd iterations over a window, so the cost per point is one closest-mean search and
+the means are current at any moment.
+*/
+namespace dkm {
+
+/*
+online_parameters configures an `online_kmeans`. It requires a k value for initialization, and can
+subsequently be configured with:
+* Warmup size; the number of points buffered before the means exist, at least and by default k.
+  With exactly k the first k points become the means, as in MacQueen's algorithm; with more the
+  means are seeded from the buffer with kmeans++, which copes better with a stream whose first points
+  are alike. The buffered points then update the means like any other.
+* Random seed; used in place of `std::random_device` for kmeans++ seeding.
+* Half-life; exponential forgetting, where a point's weight halves every `half_life` units of time
+  (points, unless timestamps are given to `add`). Each mean then tracks recent points, moving by at
+  least about ln(2) / half_life of the way towards each point assigned to it, however many came
+  before.
+* Window; sliding-window forgetting, where the means are exactly the averages of the points among
+  the last `window` which were assigned to them. This costs one stored point per window slot.
+
+Without a half-life or a window every point counts equally and each mean is the average of all the
+points assigned to it so far, i.e. the learning rate of a cluster decays as 1 / (points assigned).
+A half-life and a window can't both be set: setting one when the other already is throws
+std::invalid_argument.
+*/
+class online_parameters {
+public:
+	explicit online_parameters(uint32_t k) :
+	_k(k), _warmup_size(k),
+	_has_rand_seed(false), _rand_seed(),
+	_has_half_life(false), _half_life(),
+	_has_window(false), _window()
+	{}
+
+	void set_warmup_size(size_t warmup_size)
+	{
+		assert(warmup_size >= _k);
+		_warmup_size = warmup_size;
+	}
+
+	void set_random_seed(uint64_t rand_seed)
+	{
+		_rand_seed = rand_seed;
+		_has_rand_seed = true;
+	}
+
+	void set_half_life(double half_life)
+	{
+		assert(half_life > 0);
+		if (_has_window) {
+			throw std::invalid_argument("dkm: a half-life can't be set along with a window");
+		}
+		_half_life = half_life;
+		_has_half_life = true;
+	}
+
+	void set_window(size_t window)
+	{
+		assert(window > 0);
+		if (_has_half_life) {
+			throw std::invalid_argument("dkm: a window can't be set along with a half-life");
+		}
+		_window = window;
+		_has_window = true;
+	}
+
+	bool has_random_seed() const { return _has_rand_seed; }
+	bool has_half_life() const { return _has_half_life; }
+	bool has_window() const { return _has_window; }
+
+	uint32_t get_k() const { return _k; }
+	size_t get_warmup_size() const { return _warmup_size; }
+	uint64_t get_random_seed() const { return _rand_seed; }
+	double get_half_life() const { return _half_life; }
+	size_t get_window() const { return _window; }
+
+private:
+	uint32_t _k;
+	size_t _warmup_size;
+	bool _has_rand_seed;
+	uint64_t _rand_seed;
+	bool _has_half_life;
+	double _half_life;
+	bool _has_window;
+	size_t _window;
+};
+
+/*
+The state of an `online_kmeans` at one moment:
+* means: the mean of each cluster from 0 to k-1; empty until the warmup is over.
+* weights: how much each cluster's mean is made of, in points. Without forgetting this is the number
+  of points assigned to it; with a half-life the decayed sum of their weights at `time`; with a
+  window the number of points in the window assigned to it.
+* points: the number of points seen, including the warmup.
+* time: the time of the latest point.
+*/
+template <typename T, size_t N>
+struct online_snapshot {
+	std::vector<std::array<T, N>> means;
+	std::vector<double> weights;
+	uint64_t points;
+	double time;
+};
+
+/*
+MacQueen-style online k-means. Each point added is assigned to its closest mean, which then moves
+towards the point by 1 / (the cluster's weight including the point); see `online_parameters` for
+how older points are forgotten. The means are kept in double precision, so integer types don't lose
+the small steps, and rounded to T for assigning points and for snapshots.
+
+Points are processed in the order they are added and each one sees the means left by the one
+before, so results are deterministic for a given stream and seed. All members may be called from
+several threads at once, e.g. one feeding points while another takes snapshots; each call takes a
+lock, so feed points in batches where throughput matters.
+*/
+template <typename T, size_t N>
+class online_kmeans {
+public:
+	explicit online_kmeans(const online_parameters& parameters) :
+	_parameters(parameters), _points(0), _time(0), _window_next(0), _window_evictions(0)
+	{
+		static_assert(std::is_arithmetic<T>::value && std::is_signed<T>::value,
+			"online_kmeans requires the template parameter T to be a signed arithmetic type (e.g. float, double, int)");
+		assert(parameters.get_k() > 0);
+		_warmup.reserve(parameters.get_warmup_size());
+	}
+
+	// Add a point at time `points()`, i.e. time counts points
+	void add(const std::array<T, N>& point) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		add_point(point, static_cast<double>(_points));
+	}
+
+	// Add a point at `time`, which must not be before the previous point's time
+	void add(const std::array<T, N>& point, double time) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		assert(time >= _time);
+		add_point(point, time);
+	}
+
+	// Add `count` points in order, each at the time of its position in the stream
+	void add(const std::array<T, N>* points, size_t count) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (size_t i = 0; i < count; ++i) {
+			add_point(points[i], static_cast<double>(_points));
+		}
+	}
+
+	// Whether the warmup is over and the means exist
+	bool ready() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return !_means.empty();
+	}
+
+	uint64_t points() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _points;
+	}
+
+	online_snapshot<T, N> snapshot() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		online_snapshot<T, N> result;
+		result.means = _means;
+		result.weights = _weights;
+		if (_parameters.has_half_life()) {
+			for (size_t i = 0; i < _weights.size(); ++i) {
+				result.weights[i] *= decay(_time - _updated[i]);
+			}
+		}
+		result.points = _points;
+		result.time = _time;
+		return result;
+	}
+
+	// A model of the current means for predicting; must only be called once `ready()`
+	kmeans_model<T, N> model() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		assert(!_means.empty());
+		return kmeans_model<T, N>(_means);
+	}
+
+private:
+	double decay(double elapsed) const {
+		return std::exp2(-elapsed / _parameters.get_half_life());
+	}
+
+	void add_point(const std::array<T, N>& point, double time) {
+		++_points;
+		_time = time;
+		if (_means.empty()) {
+			_warmup.push_back(point);
+			if (_warmup.size() == _parameters.get_warmup_size()) {
+				seed();
+			}
+			return;
+		}
+		update(point);
+	}
+
+	void seed() {
+		const uint32_t k = _parameters.get_k();
+		if (_warmup.size() == k) {
+			_means = _warmup;
+		} else {
+			std::random_device rand_device;
+			const uint64_t seed = _parameters.has_random_seed() ? _parameters.get_random_seed() : rand_device();
+			_means = details::random_plusplus(_warmup.data(), _warmup.size(), k, seed, details::never_stop());
+		}
+		_exact.resize(k);
+		for (uint32_t i = 0; i < k; ++i) {
+			std::copy(_means[i].begin(), _means[i].end(), _exact[i].begin());
+		}
+		_weights.assign(k, 0);
+		_updated.assign(k, _time);
+		if (_parameters.has_window()) {
+			_sums.assign(k, std::array<double, N>());
+			_window.reserve(std::min<size_t>(_parameters.get_window(), size_t(1) << 20));
+		}
+		// Every warmup point has the time of the last one; their order is kept
+		std::vector<std::array<T, N>> warmup;
+		warmup.swap(_warmup);
+		for (const auto& point : warmup) {
+			update(point);
+		}
+	}
+
+	void update(const std::array<T, N>& point) {
+		DKM_COUNT(assignment, distance_evaluations, _means.size());
+		DKM_COUNT(assignment, points_processed, 1);
+		const uint32_t cluster = details::closest_mean(point, _means);
+		if (_parameters.has_window()) {
+			slide_window(point, cluster);
+			return;
+		}
+		double& weight = _weights[cluster];
+		if (_parameters.has_half_life()) {
+			weight *= decay(_time - _updated[cluster]);
+			_updated[cluster] = _time;
+		}
+		weight += 1;
+		const double rate = 1 / weight;
+		for (size_t j = 0; j < N; ++j) {
+			_exact[cluster][j] += (static_cast<double>(point[j]) - _exact[cluster][j]) * rate;
+		}
+		refresh(cluster);
+	}
+
+	void slide_window(const std::array<T, N>& point, uint32_t cluster) {
+		const size_t capacity = _parameters.get_window();
+		if (_window.size() < capacity) {
+			_window.push_back(windowed{point, cluster});
+		} else {
+			windowed& oldest = _window[_window_next];
+			const uint32_t leaving = oldest.cluster;
+			for (size_t j = 0; j < N; ++j) {
+				_sums[leaving][j] -= static_cast<double>(oldest.point[j]);
+			}
+			_weights[leaving] -= 1;
+			oldest = windowed{point, cluster};
+			_window_next = (_window_next + 1) % capacity;
+			if (++_window_evictions == capacity) {
+				// Adding and removing points leaves rounding errors in the sums, so rebuild them once per
+				// window; the ring already holds the new point, so the rebuilt sums include it
+				_window_evictions = 0;
+				rebuild_sums();
+				return;
+			} else if (leaving != cluster) {
+				average(leaving);
+			}
+		}
+		for (size_t j = 0; j < N; ++j) {
+			_sums[cluster][j] += static_cast<double>(point[j]);
+		}
+		_weights[cluster] += 1;
+		average(cluster);
+	}
+
+	void rebuild_sums() {
+		std::fill(_sums.begin(), _sums.end(), std::array<double, N>());
+		std::fill(_weights.begin(), _weights.end(), 0);
+		for (const windowed& entry : _window) {
+			for (size_t j = 0; j < N; ++j) {
+				_sums[entry.cluster][j] += static_cast<double>(entry.point[j]);
+			}
+			_weights[entry.cluster] += 1;
+		}
+		for (uint32_t i = 0; i < _sums.size(); ++i) {
+			average(i);
+		}
+	}
+
+	// A cluster with no points in the window keeps its last mean
+	void average(uint32_t cluster) {
+		if (_weights[cluster] > 0) {
+			for (size_t j = 0; j < N; ++j) {
+				_exact[cluster][j] = _sums[cluster][j] / _weights[cluster];
+			}
+			refresh(cluster);
+		}
+	}
+
+	void refresh(uint32_t cluster) {
+		for (size_t j = 0; j < N; ++j) {
+			_means[cluster][j] = details::to_coordinate<T>(_exact[cluster][j]);
+		}
+	}
+
+	struct windowed {
+		std::array<T, N> point;
+		uint32_t cluster;
+	};
+
+	const online_parameters _parameters;
+	mutable std::mutex _mutex;
+	uint64_t _points;
+	double _time;
+	std::vector<std::array<T, N>> _warmup;
+	std::vector<std::array<T, N>> _means;
+	std::vector<std::array<double, N>> _exact;
+	std::vector<double> _weights;
+	// With a half-life, the time each cluster's weight was last decayed to
+	std::vector<double> _updated;
+	// With a window, the sums of the points in it by cluster and the points themselves as a ring
+	std::vector<std::array<double, N>> _sums;
+	std::vector<windowed> _window;
+	size_t _window_next;
+	size_t _window_evictions;
+};
+
+} // namespace dkm
+
+#endif /* DKM_ONLINE_H */
@@ -0,0 +1,258 @@
+#pragma once
+
+#ifndef DKM_PERF_H
+#define DKM_PERF_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "dkm.hpp"
+
+/*
+Hardware performance counters sampled around the phases of a clustering run through Linux's
+`perf_event_open`, so it can be seen on any host whether e.g. the assignment step is bound by memory
+(many cache misses, few instructions per cycle) or by computation, without attaching a profiler.
+This is Linux only.
+
+User space events are counted for the thread running the clustering and for every thread it starts
+once the counters are open, which covers the worker threads of multi-threaded assignment passes;
+threads which already existed, such as those of a caller's pool, aren't counted. Hosts which don't
+allow unprivileged counting (see /proc/sys/kernel/perf_event_paranoid) or don't expose some of the
+events, as is common in virtual machines, simply report zeros for what isn't available.
+*/
+namespace dkm {
+
+/*
+Counts of hardware events:
+* cycles: CPU cycles.
+* instructions: instructions retired.
+* cache_misses: last level cache misses.
+* branch_misses: mispredicted branches.
+
+When the kernel had to multiplex the counters, the counts are scaled up to the full time measured.
+*/
+struct hardware_counts {
+	uint64_t cycles;
+	uint64_t instructions;
+	uint64_t cache_misses;
+	uint64_t branch_misses;
+};
+
+/*
+Hardware event counts for every phase, indexed by `clustering_phase`.
+*/
+struct hardware_sample {
+	std::array<hardware_counts, clustering_phase_count> phases;
+
+	const hardware_counts& operator[](clustering_phase phase) const { return phases[static_cast<size_t>(phase)]; }
+};
+
+namespace details {
+
+/*
+A group of the four `hardware_counts` events counting for the thread which created it and, once they
+exit, for the threads it starts afterwards. Events the host can't count are left out of the group and
+read as zero.
+*/
+class perf_event_group {
+public:
+	perf_event_group() : _leader(-1), _descriptors(), _slots(), _opened(0) {
+		const uint64_t configs[event_count] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES
+		};
+		for (size_t i = 0; i < event_count; ++i) {
+			_descriptors[i] = -1;
+			perf_event_attr attributes;
+			std::memset(&attributes, 0, sizeof(attributes));
+			attributes.size = sizeof(attributes);
+			attributes.type = PERF_TYPE_HARDWARE;
+			attributes.config = configs[i];
+			attributes.disabled = _leader < 0 ? 1 : 0;
+			attributes.exclude_kernel = 1;
+			attributes.exclude_hv = 1;
+			// Threads started later count too; their counts join the group's when they exit
+			attributes.inherit = 1;
+			attributes.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			const long descriptor = syscall(__NR_perf_event_open, &attributes, 0, -1, _leader, 0);
+			if (descriptor < 0) {
+				continue;
+			}
+			_descriptors[i] = static_cast<int>(descriptor);
+			_slots[i] = _opened++;
+			if (_leader < 0) {
+				_leader = _descriptors[i];
+			}
+		}
+		if (_leader >= 0) {
+			ioctl(_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+			ioctl(_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		}
+	}
+
+	~perf_event_group() {
+		for (int descriptor : _descriptors) {
+			if (descriptor >= 0) {
+				close(descriptor);
+			}
+		}
+	}
+
+	perf_event_group(const perf_event_group&) = delete;
+	perf_event_group& operator=(const perf_event_group&) = delete;
+
+	bool available() const { return _leader >= 0; }
+
+	// The counts since the group was opened, or false if they couldn't be read
+	bool read_counts(hardware_counts& counts) const {
+		counts = hardware_counts();
+		if (_leader < 0) {
+			return false;
+		}
+		// nr, time_enabled, time_running, then one value per opened event
+		uint64_t buffer[3 + event_count];
+		const ssize_t size = read(_leader, buffer, sizeof(buffer));
+		if (size < static_cast<ssize_t>(3 * sizeof(uint64_t)) || buffer[0] != _opened) {
+			return false;
+		}
+		const double scale = buffer[2] > 0 && buffer[2] < buffer[1] ? double(buffer[1]) / double(buffer[2]) : 1.0;
+		uint64_t values[event_count] = {0, 0, 0, 0};
+		for (size_t i = 0; i < event_count; ++i) {
+			if (_descriptors[i] >= 0) {
+				values[i] = static_cast<uint64_t>(double(buffer[3 + _slots[i]]) * scale);
+			}
+		}
+		counts.cycles = values[0];
+		counts.instructions = values[1];
+		counts.cache_misses = values[2];
+		counts.branch_misses = values[3];
+		return true;
+	}
+
+private:
+	static const size_t event_count = 4;
+
+	int _leader;
+	int _descriptors[event_count];
+	size_t _slots[event_count];
+	size_t _opened;
+};
+
+// Scaling multiplexed counts can make them step back slightly, so differences are clamped at zero
+inline uint64_t count_difference(uint64_t end, uint64_t start) {
+	return end > start ? end - start : 0;
+}
+
+inline void add_counts(hardware_counts& total, const hardware_counts& end, const hardware_counts& start) {
+	total.cycles += count_difference(end.cycles, start.cycles);
+	total.instructions += count_difference(end.instructions, start.instructions);
+	total.cache_misses += count_difference(end.cache_misses, start.cache_misses);
+	total.branch_misses += count_difference(end.branch_misses, start.branch_misses);
+}
+
+} // namespace details
+
+/*
+Samples hardware counters at the start and end of every clustering phase and reports them per phase
+with each iteration. Attaching the profiler to a `clustering_parameters` installs its own phase and
+iteration observers there, which go on to call any observers set before:
+
+	dkm::hardware_profiler profiler;
+	profiler.attach(parameters, [](const dkm::iteration_stats& stats, const dkm::hardware_sample& sample) {
+		// e.g. instructions per cycle of the assignment step
+		const auto& assignment = sample[dkm::clustering_phase::assignment];
+	});
+	auto result = dkm::kmeans_cluster(data, parameters);
+
+Each sample holds the counts since the previous iteration was reported, so the first one also holds
+the seeding. The counters are opened on the thread running the clustering the first time a phase
+begins there. The profiler must outlive every run using the parameters it was attached to, and one
+profiler shouldn't be attached to runs on several threads at once.
+*/
+class hardware_profiler {
+public:
+	hardware_profiler() : _pending(), _totals(), _start(), _started(false), _available(false) {}
+
+	hardware_profiler(const hardware_profiler&) = delete;
+	hardware_profiler& operator=(const hardware_profiler&) = delete;
+
+	template <typename T>
+	void attach(clustering_parameters<T>& parameters,
+		std::function<void(const iteration_stats&, const hardware_sample&)> observer) {
+		const auto previous_phase = parameters.get_phase_observer();
+		parameters.set_phase_observer([this, previous_phase](clustering_phase phase, phase_event event) {
+			// Sample closest to the phase itself, so earlier observers' work isn't counted in it
+			if (event == phase_event::begin && previous_phase) {
+				previous_phase(phase, event);
+			}
+			sample(phase, event);
+			if (event == phase_event::end && previous_phase) {
+				previous_phase(phase, event);
+			}
+		});
+		const auto previous_iteration = parameters.get_iteration_observer();
+		parameters.set_iteration_observer([this, observer, previous_iteration](const iteration_stats& stats) {
+			if (previous_iteration) {
+				previous_iteration(stats);
+			}
+			if (observer) {
+				observer(stats, _pending);
+			}
+			_pending = hardware_sample();
+		});
+	}
+
+	// Whether the counters could be opened on the thread of the last run
+	bool available() const { return _available; }
+
+	// The counts of every run since construction or the last `reset`
+	const hardware_sample& totals() const { return _totals; }
+
+	void reset() {
+		_pending = hardware_sample();
+		_totals = hardware_sample();
+	}
+
+private:
+	void sample(clustering_phase phase, phase_event event) {
+		if (!_group || _owner != std::this_thread::get_id()) {
+			_group.reset(new details::perf_event_group());
+			_owner = std::this_thread::get_id();
+			_available = _group->available();
+		}
+		if (event == phase_event::begin) {
+			_started = _group->read_counts(_start);
+			return;
+		}
+		hardware_counts end;
+		if (_started && _group->read_counts(end)) {
+			const size_t index = static_cast<size_t>(phase);
+			details::add_counts(_pending.phases[index], end, _start);
+			details::add_counts(_totals.phases[index], end, _start);
+		}
+	}
+
+	std::unique_ptr<details::perf_event_group> _group;
+	std::thread::id _owner;
+	hardware_sample _pending;
+	hardware_sample _totals;
+	hardware_counts _start;
+	bool _started;
+	bool _available;
+};
+
+} // namespace dkm
+
+#endif /* DKM_PERF_H */
@@ -0,0 +1,412 @@
+#pragma once
+
+#ifndef DKM_STREAM_H
+#define DKM_STREAM_H
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "dkm.hpp"
+
+/*
+Clustering of data which is pulled in bounded chunks from a data source rather than held in a
+single `std::vector`, so only the means, their running sums and counts need to stay resident.
+*/
+namespace dkm {
+
+/*
+A contiguous run of points handed out by a data source. The points stay valid until the next call
+to the source's `next_chunk` or `rewind`.
+*/
+template <typename T, size_t N>
+struct data_chunk {
+	const std::array<T, N>* data;
+	size_t size;
+};
+
+/*
+Data sources are any type providing:
+
+	using point_type = std::array<T, N>;
+
+	// Make `chunk` refer to the next run of points. Returns false, leaving `chunk` unspecified,
+	// once every point has been handed out since construction or the last `rewind`.
+	bool next_chunk(data_chunk<T, N>& chunk);
+
+	// Start handing out the points again from the beginning, in the same order.
+	void rewind();
+
+Chunks may have any non-zero size and must always describe the same sequence of points between
+rewinds.
+*/
+
+/*
+A data source over points already held in memory, handed out `chunk_size` at a time.
+*/
+template <typename T, size_t N>
+class span_source {
+public:
+	using point_type = std::array<T, N>;
+
+	span_source(const std::array<T, N>* data, size_t size, size_t chunk_size = 4096) :
+	_data(data), _size(size), _chunk_size(chunk_size), _position(0)
+	{
+		assert(chunk_size > 0);
+	}
+
+	explicit span_source(const std::vector<std::array<T, N>>& data, size_t chunk_size = 4096) :
+	span_source(data.data(), data.size(), chunk_size)
+	{}
+
+	bool next_chunk(data_chunk<T, N>& chunk) {
+		if (_position >= _size) {
+			return false;
+		}
+		chunk.data = _data + _position;
+		chunk.size = std::min(_chunk_size, _size - _position);
+		_position += chunk.size;
+		return true;
+	}
+
+	void rewind() { _position = 0; }
+
+private:
+	const std::array<T, N>* _data;
+	size_t _size;
+	size_t _chunk_size;
+	size_t _position;
+};
+
+/*
+A data source which produces points by calling a reader, such as a file decoder or a generator,
+that fills a buffer of up to `chunk_size` points at a time. The reader is called as
+`size_t read(std::array<T, N>* buffer, size_t capacity)` and returns how many points it wrote,
+0 once it is exhausted; `restart()` must make it start over from the first point.
+*/
+template <typename T, size_t N>
+class reader_source {
+public:
+	using point_type = std::array<T, N>;
+	using read_function = std::function<size_t(std::array<T, N>*, size_t)>;
+	using restart_function = std::function<void()>;
+
+	reader_source(read_function read, restart_function restart, size_t chunk_size = 4096) :
+	_read(std::move(read)), _restart(std::move(restart)), _buffer(chunk_size)
+	{
+		assert(chunk_size > 0);
+	}
+
+	bool next_chunk(data_chunk<T, N>& chunk) {
+		const size_t size = _read(_buffer.data(), _buffer.size());
+		chunk.data = _buffer.data();
+		chunk.size = size;
+		return size > 0;
+	}
+
+	void rewind() { _restart(); }
+
+private:
+	read_function _read;
+	restart_function _restart;
+	std::vector<std::array<T, N>> _buffer;
+};
+
+/*
+A data source which overlaps reading with clustering. A dedicated I/O thread calls the reader
+(with the same contract as for `reader_source`) to fill a ring of `buffer_count` buffers of
+`chunk_size` points ahead of the consumer, so while one chunk is being assigned the next ones are
+already being read. With the default of three buffers the reader can stay a full chunk ahead even
+when reads and computation take similar amounts of time.
+
+Reading starts as soon as the source is constructed. The reader and restart functions are only
+ever called from the I/O thread; exceptions they throw are rethrown from `next_chunk`. If a trace
+sink is given, every read is reported to it as a span on the I/O thread.
+*/
+template <typename T, size_t N>
+class prefetching_source {
+public:
+	using point_type = std::array<T, N>;
+	using read_function = std::function<size_t(std::array<T, N>*, size_t)>;
+	using restart_function = std::function<void()>;
+
+	prefetching_source(read_function read, restart_function restart,
+		size_t chunk_size = size_t(1) << 16, size_t buffer_count = 3, std::shared_ptr<trace_sink> trace = nullptr) :
+	_read(std::move(read)), _restart(std::move(restart)), _trace(std::move(trace)),
+	_buffers(buffer_count, std::vector<std::array<T, N>>(chunk_size)), _sizes(buffer_count, 0),
+	_held(-1), _pass_requested(true), _running(false), _abort(false), _exhausted(false),
+	_consumed(false), _stop(false)
+	{
+		assert(chunk_size > 0 && buffer_count > 0);
+		for (size_t i = 0; i < buffer_count; ++i) {
+			_free.push_back(i);
+		}
+		_thread = std::thread(&prefetching_source::run, this);
+	}
+
+	~prefetching_source() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+		}
+		_changed.notify_all();
+		_thread.join();
+	}
+
+	prefetching_source(const prefetching_source&) = delete;
+	prefetching_source& operator=(const prefetching_source&) = delete;
+
+	bool next_chunk(data_chunk<T, N>& chunk) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		release_held();
+		_changed.wait(lock, [this] { return !_filled.empty() || _exhausted; });
+		if (_filled.empty()) {
+			if (_error) {
+				std::exception_ptr error = _error;
+				_error = nullptr;
+				std::rethrow_exception(error);
+			}
+			return false;
+		}
+		const size_t index = _filled.front();
+		_filled.pop_front();
+		_held = static_cast<long>(index);
+		_consumed = true;
+		chunk.data = _buffers[index].data();
+		chunk.size = _sizes[index];
+		return true;
+	}
+
+	void rewind() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		release_held();
+		if (!_consumed && !_exhausted) {
+			// Nothing has been handed out of the pass being prefetched, so it can be reused as is
+			return;
+		}
+		if (_running) {
+			_abort = true;
+			_changed.notify_all();
+			_changed.wait(lock, [this] { return !_running; });
+		}
+		while (!_filled.empty()) {
+			_free.push_back(_filled.front());
+			_filled.pop_front();
+		}
+		_exhausted = false;
+		_consumed = false;
+		_error = nullptr;
+		_pass_requested = true;
+		_changed.notify_all();
+	}
+
+private:
+	void release_held() {
+		if (_held >= 0) {
+			_free.push_back(static_cast<size_t>(_held));
+			_held = -1;
+			_changed.notify_all();
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		while (true) {
+			_changed.wait(lock, [this] { return _stop || _pass_requested; });
+			if (_stop) {
+				return;
+			}
+			_pass_requested = false;
+			_running = true;
+			try {
+				lock.unlock();
+				_restart();
+				lock.lock();
+				while (true) {
+					_changed.wait(lock, [this] { return _stop || _abort || !_free.empty(); });
+					if (_stop || _abort) {
+						break;
+					}
+					const size_t index = _free.front();
+					_free.pop_front();
+					lock.unlock();
+					size_t size = 0;
+					try {
+						details::trace_scope span(_trace.get(), "read", "io", "buffer", index);
+						size = _read(_buffers[index].data(), _buffers[index].size());
+					} catch (...) {
+						lock.lock();
+						_free.push_back(index);
+						throw;
+					}
+					lock.lock();
+					if (size == 0 || _abort) {
+						_free.push_back(index);
+						_exhausted = _exhausted || size == 0;
+						break;
+					}
+					_sizes[index] = size;
+					_filled.push_back(index);
+					_changed.notify_all();
+				}
+			} catch (...) {
+				if (!lock.owns_lock()) {
+					lock.lock();
+				}
+				_error = std::current_exception();
+				_exhausted = true;
+			}
+			_running = false;
+			_abort = false;
+			_changed.notify_all();
+		}
+	}
+
+	read_function _read;
+	restart_function _restart;
+	std::shared_ptr<trace_sink> _trace;
+	std::vector<std::vector<std::array<T, N>>> _buffers;
+	std::vector<size_t> _sizes;
+	std::deque<size_t> _free;
+	std::deque<size_t> _filled;
+	long _held;
+	bool _pass_requested;
+	bool _running;
+	bool _abort;
+	bool _exhausted;
+	bool _consumed;
+	bool _stop;
+	std::exception_ptr _error;
+	std::mutex _mutex;
+	std::condition_variable _changed;
+	std::thread _thread;
+};
+
+namespace details {
+
+template <typename Source>
+struct source_traits {
+	using point_type = typename Source::point_type;
+	using value_type = typename point_type::value_type;
+	static constexpr size_t dimensions = std::tuple_size<point_type>::value;
+};
+
+/*
+Draw a uniform random sample of up to `sample_size` points from a source in one pass using
+reservoir sampling, then seed the means from it with kmeans++. Sources with no more than
+`sample_size` points are seeded from every point, in order, giving the same means as seeding the
+in-memory copy of the data would. The sampling pass and the kmeans++ rounds are reported to `trace`,
+if given.
+
+`should_stop` is checked after each chunk and before each kmeans++ round. Once it returns true the
+pass ends as soon as the sample holds k points, and the means are picked at random from it.
+*/
+template <typename T, size_t N, typename Source, typename Stop>
+std::vector<std::array<T, N>> reservoir_plusplus(Source& source, uint32_t k, uint64_t seed, size_t sample_size,
+	const Stop& should_stop, trace_sink* trace = nullptr) {
+	assert(sample_size >= k);
+	std::linear_congruential_engine<uint64_t, 6364136223846793005, 1442695040888963407, UINT64_MAX> rand_engine(seed);
+	std::vector<std::array<T, N>> sample;
+	size_t seen = 0;
+	data_chunk<T, N> chunk;
+	trace_scope sampling(trace, "sampling", "seeding", "sample size", sample_size);
+	source.rewind();
+	while (source.next_chunk(chunk)) {
+		DKM_COUNT(seeding, bytes_streamed, chunk.size * sizeof(std::array<T, N>));
+		for (size_t i = 0; i < chunk.size; ++i, ++seen) {
+			if (sample.size() < sample_size) {
+				sample.push_back(chunk.data[i]);
+			} else {
+				std::uniform_int_distribution<size_t> uniform_generator(0, seen);
+				size_t slot = uniform_generator(rand_engine);
+				if (slot < sample_size) {
+					sample[slot] = chunk.data[i];
+				}
+			}
+		}
+		if (sample.size() >= k && should_stop()) {
+			break;
+		}
+	}
+	assert(sample.size() >= k); // there must be at least k data points
+	return random_plusplus(sample.data(), sample.size(), k, seed, should_stop, trace);
+}
+
+} // namespace details
+
+/*
+Implementation of k-means over a data source (see `data_chunk`) rather than an in-memory vector.
+Every iteration rewinds the source and pulls it chunk by chunk, assigning each point to its closest
+mean and accumulating it in the same pass, so memory use is O(k * N) on top of whatever the source
+itself buffers. The convergence rules are the same as for `kmeans_cluster`.
+
+The means are seeded with kmeans++ on a reservoir sample of at most `seeding_sample_size` points
+taken during one extra pass over the source; this is the only other memory used.
+
+Returns a `clustering_result` with the means, cluster sizes and inertia. Point labels aren't kept;
+use a `kmeans_model` built from the means to assign points afterwards.
+*/
+template <typename Source, typename T>
+clustering_result<T, std::tuple_size<typename Source::point_type>::value> kmeans_cluster_chunked(Source& source,
+	const clustering_parameters<T>& parameters, size_t seeding_sample_size = size_t(1) << 16) {
+	using traits = details::source_traits<Source>;
+	static_assert(std::is_same<typename traits::value_type, T>::value,
+		"kmeans_cluster_chunked requires the source and the parameters to use the same type T");
+	static_assert(std::is_arithmetic<T>::value && std::is_signed<T>::value,
+		"kmeans_cluster_chunked requires the template parameter T to be a signed arithmetic type (e.g. float, double, int)");
+	const size_t N = traits::dimensions;
+	assert(parameters.get_k() > 0); // k must be greater than zero
+	std::random_device rand_device;
+	uint64_t seed = parameters.has_random_seed() ? parameters.get_random_seed() : rand_device();
+	details::stop_condition<T> should_stop(parameters);
+	clustering_result<T, N> result;
+	{
+		details::phase_scope scope(parameters, clustering_phase::seeding);
+		result.means = details::reservoir_plusplus<T, N>(source, parameters.get_k(), seed,
+			std::max<size_t>(seeding_sample_size, parameters.get_k()), should_stop, parameters.get_trace_sink());
+	}
+
+	trace_sink* trace = parameters.get_trace_sink();
+	details::lloyd_iterations(result, parameters, should_stop, false,
+		[&source, &should_stop, trace](const std::vector<std::array<T, N>>& means, details::accumulator<T, N>& totals) {
+			data_chunk<T, N> chunk;
+			source.rewind();
+			size_t begin = 0;
+			while (true) {
+				{
+					// Time spent waiting on the source, i.e. stalls when it can't keep up
+					details::trace_scope wait(trace, "wait for chunk", "io", "first point", begin);
+					if (!source.next_chunk(chunk)) {
+						break;
+					}
+				}
+				details::trace_scope span(trace, "chunk", "assignment", "first point", begin);
+				details::assign_and_accumulate(chunk.data, chunk.size, means,
+					static_cast<uint32_t*>(nullptr), totals);
+				begin += chunk.size;
+				if (should_stop()) {
+					return false;
+				}
+			}
+			return true;
+		});
+	return result;
+}
+
+} // namespace dkm
+
+#endif /* DKM_STREAM_H */
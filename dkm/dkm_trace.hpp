@@ -0,0 +1,183 @@
+#pragma once
+
+#ifndef DKM_TRACE_H
+#define DKM_TRACE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <ios>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "dkm.hpp"
+
+/*
+Timelines of clustering runs in the Chrome trace event format, which can be opened in Perfetto
+(https://ui.perfetto.dev) or chrome://tracing to see where the time goes, how evenly work is spread
+over threads and where a run stalls waiting on I/O.
+*/
+namespace dkm {
+
+/*
+A `trace_sink` which keeps every span in memory and writes them out as Chrome trace event JSON.
+Share one between the parameters of a run and, for out-of-core runs, its data source:
+
+	auto trace = std::make_shared<dkm::chrome_trace>();
+	parameters.set_trace_sink(trace);
+	auto source = dkm::make_file_source<float, 3>(path, size_t(1) << 16, 3, trace);
+	auto result = dkm::kmeans_cluster_chunked(*source, parameters);
+	trace->save("clustering.json");
+
+Every thread reporting spans gets its own track, in the order the threads were first seen, and can
+be given a name with `name_thread`. Once `max_spans` spans have been recorded further ones are
+counted but dropped, so a forgotten trace can't use unbounded memory.
+*/
+class chrome_trace : public trace_sink {
+public:
+	explicit chrome_trace(size_t max_spans = size_t(1) << 20) :
+	_origin(std::chrono::steady_clock::now()), _max_spans(max_spans), _dropped(0)
+	{}
+
+	void span(const char* name, const char* category, std::chrono::steady_clock::time_point begin,
+		std::chrono::steady_clock::time_point end, const char* argument_name, uint64_t argument) override {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_spans.size() >= _max_spans) {
+			++_dropped;
+			return;
+		}
+		const trace_span recorded = {name, category, argument_name, argument, begin, end, thread_index()};
+		_spans.push_back(recorded);
+	}
+
+	// Name the calling thread's track, e.g. "main" or "worker 3"
+	void name_thread(const std::string& name) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		const size_t index = thread_index();
+		_threads[index].second = name;
+	}
+
+	size_t size() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _spans.size();
+	}
+
+	// The number of spans which didn't fit in `max_spans`
+	uint64_t dropped() const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _dropped;
+	}
+
+	void clear() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_spans.clear();
+		_dropped = 0;
+	}
+
+	/*
+	Write the spans recorded so far as a JSON object with a "traceEvents" array. Timestamps are in
+	microseconds since the trace was created.
+	*/
+	void write(std::ostream& out) const {
+		std::lock_guard<std::mutex> lock(_mutex);
+		// Fixed notation keeps nanosecond resolution however long after the origin a span is
+		const std::ios::fmtflags flags = out.flags();
+		const std::streamsize precision = out.precision();
+		out << std::fixed << std::setprecision(3);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"dkm\"}}";
+		for (size_t i = 0; i < _threads.size(); ++i) {
+			out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i + 1 << ",\"args\":{\"name\":";
+			write_string(out, _threads[i].second.empty() ? "thread " + std::to_string(i + 1) : _threads[i].second);
+			out << "}}";
+		}
+		for (const trace_span& span : _spans) {
+			out << ",\n{\"name\":";
+			write_string(out, span.name);
+			out << ",\"cat\":";
+			write_string(out, span.category);
+			out << ",\"ph\":\"X\",\"ts\":" << microseconds(span.begin - _origin)
+				<< ",\"dur\":" << microseconds(span.end - span.begin)
+				<< ",\"pid\":1,\"tid\":" << span.thread + 1 << ",\"args\":{";
+			write_string(out, span.argument_name);
+			out << ":" << span.argument << "}}";
+		}
+		out << "\n]}\n";
+		out.flags(flags);
+		out.precision(precision);
+	}
+
+	/*
+	Write the trace to a file. Throws `std::runtime_error` if the file can't be written.
+	*/
+	void save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		if (!file) {
+			throw std::runtime_error("dkm: unable to create " + path);
+		}
+		write(file);
+		file.flush();
+		if (!file) {
+			throw std::runtime_error("dkm: unable to write " + path);
+		}
+	}
+
+private:
+	struct trace_span {
+		const char* name;
+		const char* category;
+		const char* argument_name;
+		uint64_t argument;
+		std::chrono::steady_clock::time_point begin;
+		std::chrono::steady_clock::time_point end;
+		size_t thread;
+	};
+
+	// Must be called with the mutex held
+	size_t thread_index() {
+		const std::thread::id id = std::this_thread::get_id();
+		for (size_t i = 0; i < _threads.size(); ++i) {
+			if (_threads[i].first == id) {
+				return i;
+			}
+		}
+		_threads.push_back(std::make_pair(id, std::string()));
+		return _threads.size() - 1;
+	}
+
+	static double microseconds(std::chrono::steady_clock::duration duration) {
+		return std::chrono::duration<double, std::micro>(duration).count();
+	}
+
+	static void write_string(std::ostream& out, const std::string& value) {
+		out << '"';
+		for (char c : value) {
+			if (c == '"' || c == '\\') {
+				out << '\\' << c;
+			} else if (static_cast<unsigned char>(c) < 0x20) {
+				out << ' ';
+			} else {
+				out << c;
+			}
+		}
+		out << '"';
+	}
+
+	mutable std::mutex _mutex;
+	std::chrono::steady_clock::time_point _origin;
+	size_t _max_spans;
+	uint64_t _dropped;
+	std::vector<trace_span> _spans;
+	std::vector<std::pair<std::thread::id, std::string>> _threads;
+};
+
+} // namespace dkm
+
+#endif /* DKM_TRACE_H */
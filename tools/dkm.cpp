@@ -0,0 +1,526 @@
+/*
+dkm: cluster a CSV or binary matrix from the command line.
+
+Build from the repository root (C++17 is needed for std::from_chars; the library itself stays
+C++11), e.g.:
+
+	g++ -std=c++17 -O3 -march=native -pthread -o dkm tools/dkm.cpp
+
+Usage:
+
+	dkm -k K [options] INPUT
+
+Input:
+	INPUT is a CSV file (one point per line, values separated by commas, semicolons, tabs or
+	spaces; a non-numeric first line is taken as a header and skipped) or, with --dims, a flat
+	binary file of native values as read by dkm::mapped_dataset. The dimensionality of CSV input
+	is taken from its first row.
+	--type float|double|int   element type (default float)
+	--dims N                  dimensionality of binary input
+
+Clustering:
+	-k K                      number of clusters (required)
+	--algorithm NAME          lloyd (in memory, default), mapped (memory mapped binary input,
+	                          for data larger than RAM) or stream (binary input read through a
+	                          prefetching I/O thread; no labels)
+	--threads T               threads for reading and clustering with the lloyd algorithm (default:
+	                          all hardware threads); the mapped and stream algorithms assign points
+	                          on a single thread, so they don't accept it
+	--seed S                  kmeans++ seed (default: random)
+	--max-iter I              maximum number of iterations
+	--min-delta D             stop once no mean moves further than D
+
+Output:
+	--means FILE              the means as CSV (default: stdout)
+	--labels FILE             the cluster of each point, one per line, or as native uint32
+	                          values if FILE ends in .bin; the mapped algorithm writes text
+	                          labels through a temporary FILE.dkm-tmp of the binary ones
+	--model FILE              the means as a binary model for dkm::load_model
+
+A summary is printed to stderr.
+*/
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../dkm/dkm.hpp"
+#include "../dkm/dkm_io.hpp"
+#include "../dkm/dkm_stream.hpp"
+
+namespace {
+
+struct options {
+	std::string input;
+	std::string type = "float";
+	size_t dimensions = 0;
+	uint32_t k = 0;
+	std::string algorithm = "lloyd";
+	bool has_threads = false;
+	unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+	bool has_seed = false;
+	uint64_t seed = 0;
+	uint64_t max_iterations = 0;
+	bool has_min_delta = false;
+	double min_delta = 0;
+	std::string means_path;
+	std::string labels_path;
+	std::string model_path;
+};
+
+// Dimensionalities compiled in; N is a template parameter of dkm so others can't be clustered
+using supported_dimensions = std::index_sequence<1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 32, 64, 128>;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool ends_with(const std::string& value, const std::string& suffix) {
+	return value.size() >= suffix.size() && value.compare(value.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+std::string read_file(const std::string& path) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file) {
+		throw std::runtime_error("unable to open " + path);
+	}
+	std::string contents(static_cast<size_t>(file.tellg()), '\0');
+	file.seekg(0);
+	file.read(&contents[0], static_cast<std::streamsize>(contents.size()));
+	if (!file) {
+		throw std::runtime_error("unable to read " + path);
+	}
+	return contents;
+}
+
+bool is_separator(char c) {
+	return c == ',' || c == ';' || c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+Parse the values of one CSV line into `values`, returning how many there were, or -1 if something
+on the line isn't a number.
+*/
+template <typename T>
+long parse_line(const char* begin, const char* end, std::vector<T>& values) {
+	long count = 0;
+	const char* position = begin;
+	while (true) {
+		while (position < end && is_separator(*position)) {
+			++position;
+		}
+		if (position >= end) {
+			return count;
+		}
+		if (*position == '+') {
+			++position;
+		}
+		T value;
+		const auto parsed = std::from_chars(position, end, value);
+		if (parsed.ec != std::errc()) {
+			return -1;
+		}
+		values.push_back(value);
+		++count;
+		position = parsed.ptr;
+	}
+}
+
+/*
+Parse CSV text into points, splitting the text at line boundaries into one range per thread.
+*/
+template <typename T, size_t N>
+std::vector<std::array<T, N>> parse_csv(const std::string& text, size_t first_line, unsigned threads) {
+	const char* data = text.data();
+	const size_t size = text.size();
+	threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, size / (1 << 20) + 1)));
+	std::vector<size_t> bounds(threads + 1, size);
+	bounds[0] = first_line;
+	for (unsigned t = 1; t < threads; ++t) {
+		size_t position = std::max(bounds[t - 1], size * t / threads);
+		while (position < size && data[position - 1] != '\n') {
+			++position;
+		}
+		bounds[t] = position;
+	}
+	std::vector<std::vector<T>> parts(threads);
+	std::vector<std::string> errors(threads);
+	auto parse = [&](unsigned t) {
+		std::vector<T>& values = parts[t];
+		values.reserve((bounds[t + 1] - bounds[t]) / 4);
+		size_t line_start = bounds[t];
+		while (line_start < bounds[t + 1]) {
+			const char* line_end = static_cast<const char*>(std::memchr(data + line_start, '\n', bounds[t + 1] - line_start));
+			const size_t stop = line_end ? static_cast<size_t>(line_end - data) : bounds[t + 1];
+			const long count = parse_line(data + line_start, data + stop, values);
+			if (count != 0 && count != static_cast<long>(N)) {
+				errors[t] = "line at byte " + std::to_string(line_start) + (count < 0 ? " isn't numeric"
+					: " has " + std::to_string(count) + " values instead of " + std::to_string(N));
+				return;
+			}
+			line_start = stop + 1;
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned t = 1; t < threads; ++t) {
+		workers.emplace_back(parse, t);
+	}
+	parse(0);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	size_t total = 0;
+	for (unsigned t = 0; t < threads; ++t) {
+		if (!errors[t].empty()) {
+			throw std::runtime_error(errors[t]);
+		}
+		total += parts[t].size() / N;
+	}
+	std::vector<std::array<T, N>> points(total);
+	size_t offset = 0;
+	for (const auto& part : parts) {
+		std::memcpy(static_cast<void*>(points.data() + offset), part.data(), part.size() * sizeof(T));
+		offset += part.size() / N;
+	}
+	return points;
+}
+
+/*
+Read a flat binary file of points with one `pread` range per thread.
+*/
+template <typename T, size_t N>
+std::vector<std::array<T, N>> read_binary(const std::string& path, unsigned threads) {
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("unable to open " + path);
+	}
+	struct stat status;
+	if (::fstat(fd, &status) != 0 || status.st_size % sizeof(std::array<T, N>) != 0) {
+		::close(fd);
+		throw std::runtime_error("the size of " + path + " isn't a multiple of the point size");
+	}
+	std::vector<std::array<T, N>> points(static_cast<size_t>(status.st_size) / sizeof(std::array<T, N>));
+	char* buffer = reinterpret_cast<char*>(points.data());
+	const size_t bytes = static_cast<size_t>(status.st_size);
+	threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, bytes / (8 << 20) + 1)));
+	std::vector<bool> failed(threads, false);
+	auto read_range = [&](unsigned t) {
+		size_t position = bytes * t / threads;
+		const size_t end = bytes * (t + 1) / threads;
+		while (position < end) {
+			const ssize_t got = ::pread(fd, buffer + position, end - position, static_cast<off_t>(position));
+			if (got <= 0) {
+				failed[t] = true;
+				return;
+			}
+			position += static_cast<size_t>(got);
+		}
+	};
+	std::vector<std::thread> workers;
+	for (unsigned t = 1; t < threads; ++t) {
+		workers.emplace_back(read_range, t);
+	}
+	read_range(0);
+	for (auto& worker : workers) {
+		worker.join();
+	}
+	::close(fd);
+	if (std::find(failed.begin(), failed.end(), true) != failed.end()) {
+		throw std::runtime_error("unable to read " + path);
+	}
+	return points;
+}
+
+// The number of values on the first data line of a CSV file, and where that line starts
+std::pair<size_t, size_t> csv_shape(const std::string& text) {
+	size_t line_start = 0;
+	for (int line = 0; line < 2 && line_start < text.size(); ++line) {
+		size_t line_end = text.find('\n', line_start);
+		if (line_end == std::string::npos) {
+			line_end = text.size();
+		}
+		std::vector<double> values;
+		const long count = parse_line(text.data() + line_start, text.data() + line_end, values);
+		if (count > 0) {
+			return std::make_pair(static_cast<size_t>(count), line_start);
+		}
+		// Not numbers, so a header
+		line_start = line_end + 1;
+	}
+	throw std::runtime_error("no numeric rows found");
+}
+
+template <typename T, size_t N>
+void write_means(std::ostream& out, const std::vector<std::array<T, N>>& means) {
+	out.precision(std::numeric_limits<T>::max_digits10);
+	for (const auto& mean : means) {
+		for (size_t j = 0; j < N; ++j) {
+			out << (j == 0 ? "" : ",") << mean[j];
+		}
+		out << "\n";
+	}
+}
+
+void append_text_labels(std::ostream& file, const uint32_t* labels, size_t count) {
+	std::string buffer;
+	buffer.reserve(1 << 20);
+	char digits[16];
+	for (size_t i = 0; i < count; ++i) {
+		const auto written = std::to_chars(digits, digits + sizeof(digits), labels[i]);
+		buffer.append(digits, written.ptr);
+		buffer.push_back('\n');
+		if (buffer.size() > (1 << 20) - 32) {
+			file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+			buffer.clear();
+		}
+	}
+	file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+}
+
+void write_labels(const std::string& path, const uint32_t* labels, size_t count) {
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (ends_with(path, ".bin")) {
+		file.write(reinterpret_cast<const char*>(labels), static_cast<std::streamsize>(count * sizeof(uint32_t)));
+	} else {
+		append_text_labels(file, labels, count);
+	}
+	if (!file) {
+		throw std::runtime_error("unable to write " + path);
+	}
+}
+
+/*
+Rewrite a file of native uint32 labels as text, one block at a time, so labels of datasets larger
+than memory never have to be held in RAM.
+*/
+void convert_labels(const std::string& binary_path, const std::string& text_path) {
+	std::ifstream binary(binary_path, std::ios::binary);
+	std::ofstream text(text_path, std::ios::binary | std::ios::trunc);
+	std::vector<uint32_t> block(size_t(1) << 18);
+	while (binary) {
+		binary.read(reinterpret_cast<char*>(block.data()), static_cast<std::streamsize>(block.size() * sizeof(uint32_t)));
+		append_text_labels(text, block.data(), static_cast<size_t>(binary.gcount()) / sizeof(uint32_t));
+	}
+	if (!binary.eof() || !text) {
+		throw std::runtime_error("unable to write " + text_path);
+	}
+}
+
+const char* reason_name(dkm::convergence_reason reason) {
+	switch (reason) {
+	case dkm::convergence_reason::converged: return "converged";
+	case dkm::convergence_reason::oscillating: return "oscillating";
+	case dkm::convergence_reason::max_iterations: return "maximum iterations";
+	case dkm::convergence_reason::min_delta: return "minimum delta";
+	case dkm::convergence_reason::labels_stable: return "labels stable";
+	case dkm::convergence_reason::inertia_stalled: return "inertia stalled";
+	case dkm::convergence_reason::deadline: return "deadline";
+	case dkm::convergence_reason::cancelled: return "cancelled";
+	}
+	return "unknown";
+}
+
+template <typename T, size_t N>
+void run(const options& settings, const std::string* csv, size_t first_line) {
+	dkm::clustering_parameters<T> parameters(settings.k);
+	parameters.set_threads(settings.threads);
+	if (settings.has_seed) {
+		parameters.set_random_seed(settings.seed);
+	}
+	if (settings.max_iterations > 0) {
+		parameters.set_max_iteration(settings.max_iterations);
+	}
+	if (settings.has_min_delta) {
+		parameters.set_min_delta(static_cast<T>(settings.min_delta));
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	dkm::clustering_result<T, N> result;
+	size_t points = 0;
+	if (settings.algorithm == "lloyd") {
+		const auto data = csv ? parse_csv<T, N>(*csv, first_line, settings.threads) : read_binary<T, N>(settings.input, settings.threads);
+		points = data.size();
+		std::cerr << "read " << points << " points of " << N << " dimensions in " << seconds_since(start) << "s\n";
+		if (points < settings.k) {
+			throw std::runtime_error("there are fewer points than clusters");
+		}
+		parameters.set_keep_labels(!settings.labels_path.empty());
+		start = std::chrono::steady_clock::now();
+		result = dkm::kmeans_cluster<T, N>(data, parameters);
+		if (!settings.labels_path.empty()) {
+			write_labels(settings.labels_path, result.labels.data(), result.labels.size());
+		}
+	} else if (settings.algorithm == "mapped") {
+		const dkm::mapped_dataset<T, N> data(settings.input);
+		points = data.size();
+		if (points < settings.k) {
+			throw std::runtime_error("there are fewer points than clusters");
+		}
+		// Text labels are converted from the binary ones the final pass writes, so both are the same labels
+		const bool text_labels = !settings.labels_path.empty() && !ends_with(settings.labels_path, ".bin");
+		const std::string binary_path = text_labels ? settings.labels_path + ".dkm-tmp" : settings.labels_path;
+		try {
+			result = dkm::kmeans_cluster<T, N>(data, parameters, binary_path);
+			if (text_labels) {
+				convert_labels(binary_path, settings.labels_path);
+			}
+		} catch (...) {
+			if (text_labels) {
+				std::remove(binary_path.c_str());
+			}
+			throw;
+		}
+		if (text_labels) {
+			std::remove(binary_path.c_str());
+		}
+	} else {
+		if (!settings.labels_path.empty()) {
+			throw std::runtime_error("the stream algorithm doesn't produce labels");
+		}
+		auto source = dkm::make_file_source<T, N>(settings.input);
+		result = dkm::kmeans_cluster_chunked(*source, parameters);
+		for (uint64_t count : result.counts) {
+			points += count;
+		}
+	}
+	std::cerr << "clustered " << points << " points into " << settings.k << " clusters in " << seconds_since(start)
+		<< "s: " << result.iterations << " iterations (" << reason_name(result.reason) << "), inertia " << result.inertia << "\n";
+
+	if (settings.means_path.empty()) {
+		write_means(std::cout, result.means);
+	} else {
+		std::ofstream file(settings.means_path);
+		write_means(file, result.means);
+		if (!file) {
+			throw std::runtime_error("unable to write " + settings.means_path);
+		}
+	}
+	if (!settings.model_path.empty()) {
+		dkm::save_model(dkm::kmeans_model<T, N>(result.means), settings.model_path);
+	}
+}
+
+template <typename T, size_t... Dimensions>
+void dispatch(const options& settings, size_t dimensions, const std::string* csv, size_t first_line,
+	std::index_sequence<Dimensions...>) {
+	bool found = false;
+	((dimensions == Dimensions ? (run<T, Dimensions>(settings, csv, first_line), found = true) : false), ...);
+	if (!found) {
+		throw std::runtime_error(std::to_string(dimensions) + " dimensions aren't supported; rebuild with it added to supported_dimensions");
+	}
+}
+
+void usage() {
+	std::cerr << "usage: dkm -k K [--type float|double|int] [--dims N] [--algorithm lloyd|mapped|stream]\n"
+		"           [--threads T] [--seed S] [--max-iter I] [--min-delta D]\n"
+		"           [--means FILE] [--labels FILE] [--model FILE] INPUT\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	options settings;
+	try {
+		for (int i = 1; i < argc; ++i) {
+			const std::string option = argv[i];
+			if (option == "--help" || option == "-h") {
+				usage();
+				return 0;
+			}
+			if (option[0] != '-') {
+				settings.input = option;
+				continue;
+			}
+			if (i + 1 >= argc) {
+				throw std::invalid_argument("missing value for " + option);
+			}
+			const std::string value = argv[++i];
+			if (option == "-k") {
+				settings.k = static_cast<uint32_t>(std::stoul(value));
+			} else if (option == "--type") {
+				settings.type = value;
+			} else if (option == "--dims") {
+				settings.dimensions = std::stoul(value);
+			} else if (option == "--algorithm") {
+				settings.algorithm = value;
+			} else if (option == "--threads") {
+				settings.threads = std::max(1u, static_cast<unsigned>(std::stoul(value)));
+				settings.has_threads = true;
+			} else if (option == "--seed") {
+				settings.seed = std::stoull(value);
+				settings.has_seed = true;
+			} else if (option == "--max-iter") {
+				settings.max_iterations = std::stoull(value);
+			} else if (option == "--min-delta") {
+				settings.min_delta = std::stod(value);
+				settings.has_min_delta = true;
+			} else if (option == "--means") {
+				settings.means_path = value;
+			} else if (option == "--labels") {
+				settings.labels_path = value;
+			} else if (option == "--model") {
+				settings.model_path = value;
+			} else {
+				throw std::invalid_argument("unknown option " + option);
+			}
+		}
+		if (settings.input.empty() || settings.k == 0) {
+			throw std::invalid_argument("an input file and -k are required");
+		}
+		if (settings.algorithm != "lloyd" && settings.algorithm != "mapped" && settings.algorithm != "stream") {
+			throw std::invalid_argument("unknown algorithm " + settings.algorithm);
+		}
+		if (settings.has_threads && settings.algorithm != "lloyd") {
+			throw std::invalid_argument("--threads only applies to the lloyd algorithm, not " + settings.algorithm);
+		}
+
+		// Binary input needs its dimensionality given; anything else is parsed as CSV
+		std::unique_ptr<std::string> csv;
+		size_t first_line = 0;
+		size_t dimensions = settings.dimensions;
+		if (dimensions == 0) {
+			if (settings.algorithm != "lloyd") {
+				throw std::invalid_argument("the " + settings.algorithm + " algorithm needs binary input and --dims");
+			}
+			const auto start = std::chrono::steady_clock::now();
+			csv.reset(new std::string(read_file(settings.input)));
+			const auto shape = csv_shape(*csv);
+			dimensions = shape.first;
+			first_line = shape.second;
+			std::cerr << "loaded " << csv->size() << " bytes in " << seconds_since(start) << "s\n";
+		}
+
+		if (settings.type == "float") {
+			dispatch<float>(settings, dimensions, csv.get(), first_line, supported_dimensions());
+		} else if (settings.type == "double") {
+			dispatch<double>(settings, dimensions, csv.get(), first_line, supported_dimensions());
+		} else if (settings.type == "int") {
+			dispatch<int>(settings, dimensions, csv.get(), first_line, supported_dimensions());
+		} else {
+			throw std::invalid_argument("unknown type " + settings.type);
+		}
+	} catch (const std::exception& error) {
+		std::cerr << "dkm: " << error.what() << "\n";
+		usage();
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
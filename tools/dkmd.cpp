@@ -0,0 +1,814 @@
+/*
+dkmd: a clustering daemon which keeps datasets and trained models in memory and serves train and
+predict requests over a Unix domain socket, so processes sharing data don't each load it and
+cluster it themselves. The protocol and a client are in tools/dkmd.hpp.
+
+Build from the repository root, e.g.:
+
+	g++ -std=c++17 -O3 -march=native -pthread -o dkmd tools/dkmd.cpp
+
+Usage:
+
+	dkmd [--socket PATH] [--data-dir DIR] [--threads T] [--max-trains M] [--max-connections C]
+	     [--cache-bytes B] [--batch-window-us U]
+
+	--socket PATH          where to listen (default /tmp/dkmd.sock)
+	--data-dir DIR         the directory dataset and model paths are relative to; requests can't
+	                       reach files outside it (default: the working directory)
+	--threads T            threads per training run unless the request asks for a number
+	                       (default: all hardware threads)
+	--max-trains M         training runs allowed at once; further ones wait (default 2)
+	--max-connections C    connections served at once; further ones wait to be accepted until one
+	                       closes (default 64)
+	--cache-bytes B        datasets are evicted, least recently used first, before loading one
+	                       which would take them over B bytes (default: no limit)
+	--batch-window-us U    how long a predict waits for others to join its batch (default 0)
+
+Each connection gets its own thread, up to --max-connections at once. Concurrent predict requests for the same model are combined:
+while one assignment pass runs, requests arriving for that model queue up and the next pass serves
+all of them at once, so under load the cost of a pass is shared instead of every request
+contending for the cores separately. A batch window above zero trades that much latency for larger
+batches when requests arrive just apart.
+
+The daemon stops on SIGINT or SIGTERM: it stops accepting connections, lets the requests in flight
+finish, closes every connection and removes its socket.
+*/
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../dkm/dkm.hpp"
+#include "../dkm/dkm_io.hpp"
+#include "dkmd.hpp"
+
+namespace {
+
+// Dimensionalities compiled in; N is a template parameter of dkm so others can't be served
+using supported_dimensions = std::index_sequence<1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 32, 64, 128>;
+
+struct options {
+	std::string socket_path = "/tmp/dkmd.sock";
+	// Resolved to an absolute path without symbolic links at startup
+	std::string data_dir = ".";
+	uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+	uint32_t max_trains = 2;
+	uint32_t max_connections = 64;
+	uint64_t cache_bytes = UINT64_MAX;
+	std::chrono::microseconds batch_window{0};
+};
+
+struct counters {
+	std::atomic<uint64_t> predict_requests{0};
+	std::atomic<uint64_t> predict_batches{0};
+	std::atomic<uint64_t> evictions{0};
+};
+
+counters statistics;
+
+/*
+A model of any element type and dimension. Predictions go through `predict`, which combines
+concurrent requests into batches; the typed subclass runs a batch as one assignment pass.
+*/
+class model_entry {
+public:
+	model_entry(uint32_t type_tag, uint32_t dimensions, uint32_t k) :
+	_type_tag(type_tag), _dimensions(dimensions), _k(k), _busy(false)
+	{}
+
+	virtual ~model_entry() {}
+
+	uint32_t type_tag() const { return _type_tag; }
+	uint32_t dimensions() const { return _dimensions; }
+	uint32_t k() const { return _k; }
+
+	virtual void save(const std::string& path) const = 0;
+
+	/*
+	Label `count` points stored as raw native values, which needn't be aligned. Blocks until a
+	batch containing them has run.
+	*/
+	void predict(const char* points, size_t count, uint32_t* labels, std::chrono::microseconds window) {
+		request pending_request{points, count, labels, false, nullptr};
+		std::unique_lock<std::mutex> lock(_mutex);
+		_pending.push_back(&pending_request);
+		while (!pending_request.done) {
+			if (_busy) {
+				_finished.wait(lock);
+				continue;
+			}
+			// Nobody is running a batch, so this thread runs one for everything queued
+			_busy = true;
+			if (window.count() > 0) {
+				lock.unlock();
+				std::this_thread::sleep_for(window);
+				lock.lock();
+			}
+			std::vector<request*> batch;
+			batch.swap(_pending);
+			lock.unlock();
+			std::exception_ptr error;
+			try {
+				run_batch(batch);
+			} catch (...) {
+				error = std::current_exception();
+			}
+			statistics.predict_requests += batch.size();
+			++statistics.predict_batches;
+			lock.lock();
+			for (request* finished : batch) {
+				finished->error = error;
+				finished->done = true;
+			}
+			_busy = false;
+			_finished.notify_all();
+		}
+		if (pending_request.error) {
+			std::rethrow_exception(pending_request.error);
+		}
+	}
+
+protected:
+	struct request {
+		const char* points;
+		size_t count;
+		uint32_t* labels;
+		bool done;
+		std::exception_ptr error;
+	};
+
+	virtual void run_batch(const std::vector<request*>& batch) = 0;
+
+private:
+	const uint32_t _type_tag;
+	const uint32_t _dimensions;
+	const uint32_t _k;
+	std::mutex _mutex;
+	std::condition_variable _finished;
+	std::vector<request*> _pending;
+	bool _busy;
+};
+
+template <typename T, size_t N>
+class typed_model : public model_entry {
+public:
+	explicit typed_model(dkm::kmeans_model<T, N> model) :
+	model_entry(dkm::details::type_tag<T>(), N, model.k()), _model(std::move(model))
+	{}
+
+	void save(const std::string& path) const override { dkm::save_model(_model, path); }
+
+private:
+	void run_batch(const std::vector<request*>& batch) override {
+		size_t total = 0;
+		for (const request* pending : batch) {
+			total += pending->count;
+		}
+		// Gather every request into one aligned buffer so the whole batch is one pass
+		_points.resize(total);
+		_labels.resize(total);
+		size_t offset = 0;
+		for (const request* pending : batch) {
+			std::memcpy(static_cast<void*>(_points.data() + offset), pending->points, pending->count * sizeof(std::array<T, N>));
+			offset += pending->count;
+		}
+		_model.predict_batch(_points.data(), total, _labels.data());
+		offset = 0;
+		for (const request* pending : batch) {
+			std::copy(_labels.begin() + offset, _labels.begin() + offset + pending->count, pending->labels);
+			offset += pending->count;
+		}
+	}
+
+	const dkm::kmeans_model<T, N> _model;
+	// Only touched by the thread running the current batch
+	std::vector<std::array<T, N>> _points;
+	std::vector<uint32_t> _labels;
+};
+
+/*
+A dataset of any element type and dimension held in memory.
+*/
+class dataset_entry {
+public:
+	virtual ~dataset_entry() {}
+	virtual uint64_t size() const = 0;
+	virtual uint64_t bytes() const = 0;
+	virtual std::shared_ptr<model_entry> train(uint32_t k, bool has_seed, uint64_t seed, uint64_t max_iterations,
+		uint32_t threads, dkmd::train_summary& summary) const = 0;
+};
+
+template <typename T, size_t N>
+class typed_dataset : public dataset_entry {
+public:
+	explicit typed_dataset(const std::string& path) {
+		const dkm::mapped_dataset<T, N> mapped(path);
+		_points.assign(mapped.data(), mapped.data() + mapped.size());
+	}
+
+	uint64_t size() const override { return _points.size(); }
+	uint64_t bytes() const override { return _points.size() * sizeof(std::array<T, N>); }
+
+	std::shared_ptr<model_entry> train(uint32_t k, bool has_seed, uint64_t seed, uint64_t max_iterations,
+		uint32_t threads, dkmd::train_summary& summary) const override {
+		if (k == 0 || k > _points.size()) {
+			throw std::runtime_error("k must be between 1 and the number of points");
+		}
+		dkm::clustering_parameters<T> parameters(k);
+		parameters.set_threads(threads);
+		if (has_seed) {
+			parameters.set_random_seed(seed);
+		}
+		if (max_iterations > 0) {
+			parameters.set_max_iteration(max_iterations);
+		}
+		parameters.set_keep_labels(false);
+		auto result = dkm::kmeans_cluster<T, N>(_points, parameters);
+		summary.iterations = result.iterations;
+		summary.inertia = result.inertia;
+		summary.reason = result.reason;
+		return std::make_shared<typed_model<T, N>>(dkm::kmeans_model<T, N>(result.means));
+	}
+
+private:
+	std::vector<std::array<T, N>> _points;
+};
+
+/*
+Call `make<T, N>()` for the element type and dimension given at runtime.
+*/
+template <typename Result, typename Make, typename T, size_t... Dimensions>
+Result dispatch_dimensions(uint32_t dimensions, Make make, std::index_sequence<Dimensions...>) {
+	Result result;
+	((dimensions == Dimensions ? (result = make.template operator()<T, Dimensions>(), true) : false) || ...);
+	if (!result) {
+		throw std::runtime_error(std::to_string(dimensions) + " dimensions aren't supported");
+	}
+	return result;
+}
+
+template <typename Result, typename Make>
+Result dispatch(uint32_t type_tag, uint32_t dimensions, Make make) {
+	if (type_tag == dkm::details::type_tag<float>()) {
+		return dispatch_dimensions<Result, Make, float>(dimensions, make, supported_dimensions());
+	} else if (type_tag == dkm::details::type_tag<double>()) {
+		return dispatch_dimensions<Result, Make, double>(dimensions, make, supported_dimensions());
+	} else if (type_tag == dkm::details::type_tag<int>()) {
+		return dispatch_dimensions<Result, Make, int>(dimensions, make, supported_dimensions());
+	}
+	throw std::runtime_error("unsupported element type");
+}
+
+struct make_dataset {
+	const std::string& path;
+	template <typename T, size_t N>
+	std::shared_ptr<dataset_entry> operator()() const { return std::make_shared<typed_dataset<T, N>>(path); }
+};
+
+struct open_model {
+	const std::string& path;
+	template <typename T, size_t N>
+	std::shared_ptr<model_entry> operator()() const {
+		return std::make_shared<typed_model<T, N>>(dkm::load_model<T, N>(path));
+	}
+};
+
+/*
+The datasets and models by name. Entries are shared pointers so a request keeps what it uses alive
+even if the entry is dropped or evicted meanwhile.
+*/
+class registry {
+public:
+	explicit registry(uint64_t cache_bytes) : _cache_bytes(cache_bytes), _clock(0), _dataset_bytes(0), _reserved_bytes(0) {}
+
+	/*
+	Room in the cache for a dataset of up to `bytes` bytes while it loads, made by evicting least
+	recently used datasets first, so loading never holds more than the cache allows. Released when
+	destroyed unless the dataset was added with `add_dataset`.
+	*/
+	class reservation {
+	public:
+		reservation(registry& owner, uint64_t bytes) : _owner(owner), _bytes(bytes) { _owner.reserve(bytes); }
+		~reservation() { _owner.release(_bytes); }
+
+		reservation(const reservation&) = delete;
+		reservation& operator=(const reservation&) = delete;
+
+	private:
+		friend class registry;
+		registry& _owner;
+		uint64_t _bytes;
+	};
+
+	void add_dataset(const std::string& name, std::shared_ptr<dataset_entry> dataset, reservation& room) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		assert(dataset->bytes() <= room._bytes);
+		_reserved_bytes -= room._bytes;
+		room._bytes = 0;
+		remove_dataset(name);
+		_dataset_bytes += dataset->bytes();
+		_datasets[name] = cached_dataset{std::move(dataset), ++_clock};
+	}
+
+	std::shared_ptr<dataset_entry> dataset(const std::string& name) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto found = _datasets.find(name);
+		if (found == _datasets.end()) {
+			throw std::runtime_error("no dataset named " + name);
+		}
+		found->second.last_used = ++_clock;
+		return found->second.entry;
+	}
+
+	void add_model(const std::string& name, std::shared_ptr<model_entry> model) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_models[name] = std::move(model);
+	}
+
+	std::shared_ptr<model_entry> model(const std::string& name) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto found = _models.find(name);
+		if (found == _models.end()) {
+			throw std::runtime_error("no model named " + name);
+		}
+		return found->second;
+	}
+
+	void drop(const std::string& name) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!remove_dataset(name) && _models.erase(name) == 0) {
+			throw std::runtime_error("nothing named " + name);
+		}
+	}
+
+	dkmd::server_stats stats() {
+		std::lock_guard<std::mutex> lock(_mutex);
+		dkmd::server_stats result;
+		result.datasets = _datasets.size();
+		result.dataset_bytes = _dataset_bytes;
+		result.models = _models.size();
+		result.predict_requests = statistics.predict_requests;
+		result.predict_batches = statistics.predict_batches;
+		result.evictions = statistics.evictions;
+		return result;
+	}
+
+private:
+	struct cached_dataset {
+		std::shared_ptr<dataset_entry> entry;
+		uint64_t last_used;
+	};
+
+	void reserve(uint64_t bytes) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (bytes > _cache_bytes) {
+			throw std::runtime_error("the dataset is larger than the cache");
+		}
+		while (!_datasets.empty() && _dataset_bytes + _reserved_bytes + bytes > _cache_bytes) {
+			auto oldest = std::min_element(_datasets.begin(), _datasets.end(),
+				[](const std::pair<const std::string, cached_dataset>& a, const std::pair<const std::string, cached_dataset>& b) {
+					return a.second.last_used < b.second.last_used;
+				});
+			remove_dataset(oldest->first);
+			++statistics.evictions;
+		}
+		if (_reserved_bytes + bytes > _cache_bytes) {
+			throw std::runtime_error("the cache is taken by datasets being loaded");
+		}
+		_reserved_bytes += bytes;
+	}
+
+	void release(uint64_t bytes) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		_reserved_bytes -= bytes;
+	}
+
+	bool remove_dataset(const std::string& name) {
+		auto found = _datasets.find(name);
+		if (found == _datasets.end()) {
+			return false;
+		}
+		_dataset_bytes -= found->second.entry->bytes();
+		_datasets.erase(found);
+		return true;
+	}
+
+	const uint64_t _cache_bytes;
+	std::mutex _mutex;
+	uint64_t _clock;
+	uint64_t _dataset_bytes;
+	// Promised to datasets still loading
+	uint64_t _reserved_bytes;
+	std::map<std::string, cached_dataset> _datasets;
+	std::map<std::string, std::shared_ptr<model_entry>> _models;
+};
+
+/*
+A counting semaphore bounding the training runs in flight, since each takes its threads and
+memory for the labels of every point.
+*/
+class train_slots {
+public:
+	explicit train_slots(uint32_t slots) : _free(slots) {}
+
+	// Holds a slot, waiting for one if they're all taken
+	class slot {
+	public:
+		explicit slot(train_slots& owner) : _owner(owner) {
+			std::unique_lock<std::mutex> lock(_owner._mutex);
+			_owner._released.wait(lock, [this] { return _owner._free > 0; });
+			--_owner._free;
+		}
+
+		~slot() {
+			{
+				std::lock_guard<std::mutex> lock(_owner._mutex);
+				++_owner._free;
+			}
+			_owner._released.notify_one();
+		}
+
+		slot(const slot&) = delete;
+		slot& operator=(const slot&) = delete;
+
+	private:
+		train_slots& _owner;
+	};
+
+private:
+	std::mutex _mutex;
+	std::condition_variable _released;
+	uint32_t _free;
+};
+
+/*
+The connections being served, each on its own thread. At most `limit` are open at once, since each
+may hold frame buffers of up to `dkmd::max_frame_size`; the threads are joined rather than detached
+so none outlives shutdown.
+*/
+class connection_set {
+public:
+	explicit connection_set(uint32_t limit) : _limit(limit), _open(0) {}
+
+	~connection_set() { close_all(); }
+
+	connection_set(const connection_set&) = delete;
+	connection_set& operator=(const connection_set&) = delete;
+
+	// Waits until another connection may be opened; false if `stopping` was set meanwhile
+	bool wait_for_room(const volatile std::sig_atomic_t& stopping) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		// Signal handlers can't notify, so the flag is polled
+		while (_open >= _limit && !stopping) {
+			_closed.wait_for(lock, std::chrono::milliseconds(100));
+		}
+		return !stopping;
+	}
+
+	// Serve `fd` on a new thread with `serve(fd)`, then close it
+	template <typename Serve>
+	void open(int fd, Serve serve) {
+		std::lock_guard<std::mutex> lock(_mutex);
+		join_closed();
+		_connections.emplace_back();
+		connection& added = _connections.back();
+		added.fd = fd;
+		added.closed = false;
+		++_open;
+		added.thread = std::thread([this, &added, fd, serve]() {
+			serve(fd);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				::close(fd);
+				added.fd = -1;
+				added.closed = true;
+				--_open;
+			}
+			_closed.notify_one();
+		});
+	}
+
+	/*
+	Stop reading from every connection, so each finishes the request it's serving and then sees the
+	end of its stream, and join their threads.
+	*/
+	void close_all() {
+		std::list<connection> closing;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			for (const connection& entry : _connections) {
+				if (entry.fd >= 0) {
+					::shutdown(entry.fd, SHUT_RD);
+				}
+			}
+			// Spliced out so the threads can still update their entries while being joined
+			closing.splice(closing.end(), _connections);
+		}
+		for (connection& entry : closing) {
+			entry.thread.join();
+		}
+	}
+
+private:
+	struct connection {
+		int fd;
+		bool closed;
+		std::thread thread;
+	};
+
+	// Must hold _mutex
+	void join_closed() {
+		for (auto entry = _connections.begin(); entry != _connections.end();) {
+			if (entry->closed) {
+				entry->thread.join();
+				entry = _connections.erase(entry);
+			} else {
+				++entry;
+			}
+		}
+	}
+
+	const uint32_t _limit;
+	uint32_t _open;
+	std::mutex _mutex;
+	std::condition_variable _closed;
+	std::list<connection> _connections;
+};
+
+// The absolute path without symbolic links, or empty if it doesn't exist
+std::string real_path(const std::string& path) {
+	char* resolved = ::realpath(path.c_str(), nullptr);
+	if (resolved == nullptr) {
+		return std::string();
+	}
+	const std::string result = resolved;
+	std::free(resolved);
+	return result;
+}
+
+// Whether `path` is below `directory`, both absolute and without symbolic links
+bool inside(const std::string& directory, const std::string& path) {
+	const std::string prefix = directory == "/" ? directory : directory + "/";
+	return path.size() > prefix.size() && path.compare(0, prefix.size(), prefix) == 0;
+}
+
+/*
+The file a request names, which must be a relative path that stays inside the data directory after
+symbolic links are followed. A file about to be created only needs its directory to exist.
+*/
+std::string resolve_path(const options& settings, const std::string& path, bool create) {
+	if (path.empty() || path[0] == '/') {
+		throw std::runtime_error("paths must be relative to the data directory");
+	}
+	for (size_t begin = 0; begin <= path.size();) {
+		size_t end = path.find('/', begin);
+		if (end == std::string::npos) {
+			end = path.size();
+		}
+		if (path.compare(begin, end - begin, "..") == 0) {
+			throw std::runtime_error("paths can't contain ..: " + path);
+		}
+		begin = end + 1;
+	}
+	const std::string joined = settings.data_dir + "/" + path;
+	std::string resolved = real_path(joined);
+	if (resolved.empty() && create) {
+		const size_t slash = joined.find_last_of('/');
+		const std::string directory = real_path(joined.substr(0, slash));
+		if (!directory.empty()) {
+			resolved = directory + joined.substr(slash);
+		}
+	}
+	if (resolved.empty()) {
+		throw std::runtime_error("no such file: " + path);
+	}
+	if (!inside(settings.data_dir, resolved)) {
+		throw std::runtime_error("path is outside the data directory: " + path);
+	}
+	return resolved;
+}
+
+uint64_t file_bytes(const std::string& path) {
+	struct stat status;
+	if (::stat(path.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) {
+		throw std::runtime_error("unable to read " + path);
+	}
+	return static_cast<uint64_t>(status.st_size);
+}
+
+void handle_request(const options& settings, registry& entries, train_slots& trains, dkmd::opcode code, const std::vector<char>& payload,
+	dkmd::message_writer& response) {
+	dkmd::message_reader request(payload);
+	switch (code) {
+	case dkmd::opcode::load_dataset: {
+		const std::string name = request.get_string();
+		const std::string path = resolve_path(settings, request.get_string(), false);
+		const uint32_t type_tag = request.get<uint32_t>();
+		const uint32_t dimensions = request.get<uint32_t>();
+		// The points take no more memory than the file; room is made for them before they're read
+		registry::reservation room(entries, file_bytes(path));
+		auto dataset = dispatch<std::shared_ptr<dataset_entry>>(type_tag, dimensions, make_dataset{path});
+		response.put(dataset->size());
+		entries.add_dataset(name, std::move(dataset), room);
+		break;
+	}
+	case dkmd::opcode::train: {
+		const std::string dataset_name = request.get_string();
+		const std::string model_name = request.get_string();
+		const uint32_t k = request.get<uint32_t>();
+		const bool has_seed = request.get<uint8_t>() != 0;
+		const uint64_t seed = request.get<uint64_t>();
+		const uint64_t max_iterations = request.get<uint64_t>();
+		const uint32_t threads = request.get<uint32_t>();
+		dkmd::train_summary summary;
+		const auto dataset = entries.dataset(dataset_name);
+		const train_slots::slot running(trains);
+		auto model = dataset->train(k, has_seed, seed, max_iterations,
+			threads > 0 ? threads : settings.threads, summary);
+		entries.add_model(model_name, std::move(model));
+		response.put(summary.iterations).put(summary.inertia).put(static_cast<uint32_t>(summary.reason));
+		break;
+	}
+	case dkmd::opcode::load_model: {
+		const std::string name = request.get_string();
+		const std::string path = resolve_path(settings, request.get_string(), false);
+		const uint32_t type_tag = request.get<uint32_t>();
+		const uint32_t dimensions = request.get<uint32_t>();
+		auto model = dispatch<std::shared_ptr<model_entry>>(type_tag, dimensions, open_model{path});
+		response.put(model->k());
+		entries.add_model(name, std::move(model));
+		break;
+	}
+	case dkmd::opcode::save_model: {
+		const std::string name = request.get_string();
+		const auto model = entries.model(name);
+		model->save(resolve_path(settings, request.get_string(), true));
+		break;
+	}
+	case dkmd::opcode::predict: {
+		const auto model = entries.model(request.get_string());
+		const uint32_t type_tag = request.get<uint32_t>();
+		const uint32_t dimensions = request.get<uint32_t>();
+		const uint64_t count = request.get<uint64_t>();
+		if (type_tag != model->type_tag() || dimensions != model->dimensions()) {
+			throw std::runtime_error("the points don't match the type or dimension of the model");
+		}
+		const size_t point_bytes = (type_tag & 0xff) * dimensions;
+		if (count > payload.size() / point_bytes) {
+			throw std::runtime_error("truncated message");
+		}
+		const char* points = request.take(static_cast<size_t>(count) * point_bytes);
+		std::vector<uint32_t> labels(static_cast<size_t>(count));
+		model->predict(points, labels.size(), labels.data(), settings.batch_window);
+		response.put_bytes(labels.data(), labels.size() * sizeof(uint32_t));
+		break;
+	}
+	case dkmd::opcode::drop:
+		entries.drop(request.get_string());
+		break;
+	case dkmd::opcode::stats:
+		response.put(entries.stats());
+		break;
+	default:
+		throw std::runtime_error("unknown request");
+	}
+}
+
+void serve_connection(const options& settings, registry& entries, train_slots& trains, int fd) {
+	try {
+		uint16_t code;
+		std::vector<char> payload;
+		while (dkmd::details::read_frame(fd, code, payload)) {
+			dkmd::message_writer response;
+			dkmd::status result = dkmd::status::ok;
+			try {
+				handle_request(settings, entries, trains, static_cast<dkmd::opcode>(code), payload, response);
+			} catch (const std::exception& error) {
+				result = dkmd::status::error;
+				response.payload().clear();
+				response.put_bytes(error.what(), std::strlen(error.what()));
+			}
+			if (!dkmd::details::write_frame(fd, static_cast<uint16_t>(result), response.payload())) {
+				break;
+			}
+		}
+	} catch (const std::exception& error) {
+		std::cerr << "dkmd: closing a connection: " << error.what() << "\n";
+	}
+}
+
+int listen_fd = -1;
+volatile std::sig_atomic_t stopping = 0;
+
+extern "C" void stop_listening(int) {
+	stopping = 1;
+	// Wakes the accept loop; shutdown is async-signal-safe
+	::shutdown(listen_fd, SHUT_RDWR);
+}
+
+void usage() {
+	std::cerr << "usage: dkmd [--socket PATH] [--data-dir DIR] [--threads T] [--max-trains M] [--max-connections C]"
+		" [--cache-bytes B] [--batch-window-us U]\n";
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	options settings;
+	try {
+		for (int i = 1; i < argc; ++i) {
+			const std::string option = argv[i];
+			if (option == "--help" || option == "-h") {
+				usage();
+				return 0;
+			}
+			if (i + 1 >= argc) {
+				throw std::invalid_argument("missing value for " + option);
+			}
+			const std::string value = argv[++i];
+			if (option == "--socket") {
+				settings.socket_path = value;
+			} else if (option == "--data-dir") {
+				settings.data_dir = value;
+			} else if (option == "--threads") {
+				settings.threads = std::max(1u, static_cast<uint32_t>(std::stoul(value)));
+			} else if (option == "--max-trains") {
+				settings.max_trains = std::max(1u, static_cast<uint32_t>(std::stoul(value)));
+			} else if (option == "--max-connections") {
+				settings.max_connections = std::max(1u, static_cast<uint32_t>(std::stoul(value)));
+			} else if (option == "--cache-bytes") {
+				settings.cache_bytes = std::stoull(value);
+			} else if (option == "--batch-window-us") {
+				settings.batch_window = std::chrono::microseconds(std::stoll(value));
+			} else {
+				throw std::invalid_argument("unknown option " + option);
+			}
+		}
+
+		const std::string data_dir = real_path(settings.data_dir);
+		if (data_dir.empty()) {
+			throw std::runtime_error("no such directory: " + settings.data_dir);
+		}
+		settings.data_dir = data_dir;
+
+		listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		const sockaddr_un address = dkmd::details::socket_address(settings.socket_path);
+		::unlink(settings.socket_path.c_str());
+		if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+			|| ::listen(listen_fd, 64) != 0) {
+			throw std::runtime_error("unable to listen on " + settings.socket_path);
+		}
+	} catch (const std::exception& error) {
+		std::cerr << "dkmd: " << error.what() << "\n";
+		usage();
+		return EXIT_FAILURE;
+	}
+	std::signal(SIGINT, stop_listening);
+	std::signal(SIGTERM, stop_listening);
+	std::cerr << "dkmd: listening on " << settings.socket_path << "\n";
+
+	registry entries(settings.cache_bytes);
+	train_slots trains(settings.max_trains);
+	// Declared last so its threads are joined before what they use is destroyed
+	connection_set connections(settings.max_connections);
+	while (connections.wait_for_room(stopping)) {
+		const int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+		connections.open(fd, [&settings, &entries, &trains](int connection) {
+			serve_connection(settings, entries, trains, connection);
+		});
+	}
+	::close(listen_fd);
+	connections.close_all();
+	::unlink(settings.socket_path.c_str());
+	std::cerr << "dkmd: stopped\n";
+	return 0;
+}
@@ -0,0 +1,356 @@
+#pragma once
+
+#ifndef DKMD_H
+#define DKMD_H
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../dkm/dkm_io.hpp"
+
+/*
+The wire protocol of the dkmd clustering daemon (tools/dkmd.cpp) and a client for it.
+
+Every request and response is a frame: a 16 byte `frame_header` followed by `size` bytes of
+payload. Integers and values are stored in the host's native byte order since both ends are on the
+same machine; strings are a uint32_t length followed by that many bytes. Requests carry an
+`opcode` and responses a `status`; a failed request answers with `status::error` and a message.
+
+	opcode         request payload                                      response payload
+	load_dataset   name, path, type tag, dimensions                     uint64 point count
+	train          dataset, model, uint32 k, uint8 has seed, uint64     uint64 iterations,
+	               seed, uint64 max iterations, uint32 threads          double inertia, uint32 reason
+	load_model     name, path, type tag, dimensions                     uint32 k
+	save_model     name, path                                           -
+	predict        model, type tag, dimensions, uint64 count, points    uint32 label per point
+	drop           name (dataset or model)                              -
+	stats          -                                                    uint64 each of `server_stats`
+
+Type tags are those of the model file format (`dkm::details::type_tag`). Datasets are flat binary
+files of native values as read by `dkm::mapped_dataset`; models are files written by
+`dkm::save_model`. Paths are relative to the daemon's data directory and may not leave it.
+
+Frames are limited to `max_frame_size` bytes in either direction; the client splits larger
+predictions into several requests.
+*/
+namespace dkmd {
+
+enum class opcode : uint16_t {
+	load_dataset = 1,
+	train = 2,
+	load_model = 3,
+	save_model = 4,
+	predict = 5,
+	drop = 6,
+	stats = 7
+};
+
+enum class status : uint16_t {
+	ok = 0,
+	error = 1
+};
+
+struct frame_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t code;
+	uint64_t size;
+};
+
+static_assert(sizeof(frame_header) == 16, "frame_header must be exactly 16 bytes");
+
+const uint32_t frame_magic = 0x444d4b44; // "DKMD"
+const uint16_t protocol_version = 1;
+// Larger frames are refused rather than allocated
+const uint64_t max_frame_size = uint64_t(64) << 20;
+
+struct train_summary {
+	uint64_t iterations;
+	double inertia;
+	dkm::convergence_reason reason;
+};
+
+struct server_stats {
+	uint64_t datasets;
+	uint64_t dataset_bytes;
+	uint64_t models;
+	uint64_t predict_requests;
+	// Assignment passes run for those requests; fewer than requests when they were batched
+	uint64_t predict_batches;
+	uint64_t evictions;
+};
+
+namespace details {
+
+// Read or write exactly `size` bytes, returning false if the peer went away
+inline bool read_fully(int fd, void* data, size_t size) {
+	char* position = static_cast<char*>(data);
+	while (size > 0) {
+		const ssize_t got = ::read(fd, position, size);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got <= 0) {
+			return false;
+		}
+		position += got;
+		size -= static_cast<size_t>(got);
+	}
+	return true;
+}
+
+inline bool write_fully(int fd, const void* data, size_t size) {
+	const char* position = static_cast<const char*>(data);
+	while (size > 0) {
+		const ssize_t sent = ::send(fd, position, size, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) {
+			continue;
+		}
+		if (sent <= 0) {
+			return false;
+		}
+		position += sent;
+		size -= static_cast<size_t>(sent);
+	}
+	return true;
+}
+
+inline bool read_frame(int fd, uint16_t& code, std::vector<char>& payload) {
+	frame_header header;
+	if (!read_fully(fd, &header, sizeof(header))) {
+		return false;
+	}
+	if (header.magic != frame_magic || header.version != protocol_version || header.size > max_frame_size) {
+		throw std::runtime_error("dkmd: malformed frame");
+	}
+	code = header.code;
+	payload.resize(static_cast<size_t>(header.size));
+	return payload.empty() || read_fully(fd, payload.data(), payload.size());
+}
+
+inline bool write_frame(int fd, uint16_t code, const std::vector<char>& payload) {
+	frame_header header;
+	header.magic = frame_magic;
+	header.version = protocol_version;
+	header.code = code;
+	header.size = payload.size();
+	return write_fully(fd, &header, sizeof(header)) && (payload.empty() || write_fully(fd, payload.data(), payload.size()));
+}
+
+inline sockaddr_un socket_address(const std::string& path) {
+	sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)) {
+		throw std::runtime_error("dkmd: socket path is too long: " + path);
+	}
+	std::memcpy(address.sun_path, path.c_str(), path.size());
+	return address;
+}
+
+} // namespace details
+
+/*
+Builds a payload out of fixed size values, strings and raw arrays.
+*/
+class message_writer {
+public:
+	template <typename V>
+	message_writer& put(const V& value) {
+		static_assert(std::is_trivially_copyable<V>::value, "only trivially copyable values can be sent");
+		return put_bytes(&value, sizeof(value));
+	}
+
+	message_writer& put_string(const std::string& value) {
+		put(static_cast<uint32_t>(value.size()));
+		return put_bytes(value.data(), value.size());
+	}
+
+	message_writer& put_bytes(const void* data, size_t size) {
+		const char* bytes = static_cast<const char*>(data);
+		_payload.insert(_payload.end(), bytes, bytes + size);
+		return *this;
+	}
+
+	std::vector<char>& payload() { return _payload; }
+
+private:
+	std::vector<char> _payload;
+};
+
+/*
+Reads back what a `message_writer` wrote, throwing if the payload is too short.
+*/
+class message_reader {
+public:
+	explicit message_reader(const std::vector<char>& payload) : _payload(payload), _position(0) {}
+
+	template <typename V>
+	V get() {
+		static_assert(std::is_trivially_copyable<V>::value, "only trivially copyable values can be received");
+		V value;
+		std::memcpy(&value, take(sizeof(V)), sizeof(V));
+		return value;
+	}
+
+	std::string get_string() {
+		const uint32_t size = get<uint32_t>();
+		const char* data = take(size);
+		return std::string(data, size);
+	}
+
+	// A view of the next `size` bytes; valid for as long as the payload
+	const char* take(size_t size) {
+		if (size > _payload.size() - _position) {
+			throw std::runtime_error("dkmd: truncated message");
+		}
+		const char* data = _payload.data() + _position;
+		_position += size;
+		return data;
+	}
+
+private:
+	const std::vector<char>& _payload;
+	size_t _position;
+};
+
+/*
+A connection to a dkmd daemon. Requests are answered in order; one client must not be used from
+several threads at once, but any number of clients may be connected at the same time and
+concurrent `predict` calls for the same model are served together.
+
+Every method throws `std::runtime_error` if the connection fails or the daemon reports an error.
+*/
+class client {
+public:
+	explicit client(const std::string& socket_path) : _fd(::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) {
+		if (_fd < 0) {
+			throw std::runtime_error("dkmd: unable to create a socket");
+		}
+		const sockaddr_un address = details::socket_address(socket_path);
+		if (::connect(_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+			::close(_fd);
+			throw std::runtime_error("dkmd: unable to connect to " + socket_path);
+		}
+	}
+
+	~client() { ::close(_fd); }
+
+	client(const client&) = delete;
+	client& operator=(const client&) = delete;
+
+	// Load a flat binary file of points of type T and dimension N as the dataset `name`
+	template <typename T, size_t N>
+	uint64_t load_dataset(const std::string& name, const std::string& path) {
+		message_writer request;
+		request.put_string(name).put_string(path).put(dkm::details::type_tag<T>()).put(static_cast<uint32_t>(N));
+		return call(opcode::load_dataset, request).get<uint64_t>();
+	}
+
+	// Cluster the dataset `dataset` into k clusters and keep the means as the model `model`
+	train_summary train(const std::string& dataset, const std::string& model, uint32_t k, bool has_seed = false,
+		uint64_t seed = 0, uint64_t max_iterations = 0, uint32_t threads = 0) {
+		message_writer request;
+		request.put_string(dataset).put_string(model).put(k).put(static_cast<uint8_t>(has_seed)).put(seed)
+			.put(max_iterations).put(threads);
+		const std::vector<char> response = call_raw(opcode::train, request);
+		message_reader reader(response);
+		train_summary summary;
+		summary.iterations = reader.get<uint64_t>();
+		summary.inertia = reader.get<double>();
+		summary.reason = static_cast<dkm::convergence_reason>(reader.get<uint32_t>());
+		return summary;
+	}
+
+	// Load a model written by `dkm::save_model` as the model `name`
+	template <typename T, size_t N>
+	uint32_t load_model(const std::string& name, const std::string& path) {
+		message_writer request;
+		request.put_string(name).put_string(path).put(dkm::details::type_tag<T>()).put(static_cast<uint32_t>(N));
+		return call(opcode::load_model, request).get<uint32_t>();
+	}
+
+	void save_model(const std::string& name, const std::string& path) {
+		message_writer request;
+		request.put_string(name).put_string(path);
+		call_raw(opcode::save_model, request);
+	}
+
+	// The index of the closest mean of the model `model` for each point
+	template <typename T, size_t N>
+	std::vector<uint32_t> predict(const std::string& model, const std::array<T, N>* points, size_t count) {
+		// Leave room in each frame for the model name and the fixed fields
+		const size_t per_request = static_cast<size_t>((max_frame_size - model.size() - 64) / sizeof(std::array<T, N>));
+		std::vector<uint32_t> labels(count);
+		for (size_t begin = 0; begin < count; begin += per_request) {
+			const size_t part = std::min(per_request, count - begin);
+			message_writer request;
+			request.put_string(model).put(dkm::details::type_tag<T>()).put(static_cast<uint32_t>(N))
+				.put(static_cast<uint64_t>(part)).put_bytes(points + begin, part * sizeof(std::array<T, N>));
+			const std::vector<char> response = call_raw(opcode::predict, request);
+			if (response.size() != part * sizeof(uint32_t)) {
+				throw std::runtime_error("dkmd: unexpected number of labels");
+			}
+			std::memcpy(labels.data() + begin, response.data(), response.size());
+		}
+		return labels;
+	}
+
+	template <typename T, size_t N>
+	std::vector<uint32_t> predict(const std::string& model, const std::vector<std::array<T, N>>& points) {
+		return predict(model, points.data(), points.size());
+	}
+
+	// Forget the dataset or model `name`
+	void drop(const std::string& name) {
+		message_writer request;
+		request.put_string(name);
+		call_raw(opcode::drop, request);
+	}
+
+	server_stats stats() {
+		message_writer request;
+		return call(opcode::stats, request).get<server_stats>();
+	}
+
+private:
+	// A reader over the response, which lives until the next call
+	message_reader call(opcode code, message_writer& request) {
+		_response = call_raw(code, request);
+		return message_reader(_response);
+	}
+
+	std::vector<char> call_raw(opcode code, message_writer& request) {
+		if (!details::write_frame(_fd, static_cast<uint16_t>(code), request.payload())) {
+			throw std::runtime_error("dkmd: connection lost");
+		}
+		uint16_t result;
+		std::vector<char> response;
+		if (!details::read_frame(_fd, result, response)) {
+			throw std::runtime_error("dkmd: connection lost");
+		}
+		if (result != static_cast<uint16_t>(status::ok)) {
+			throw std::runtime_error("dkmd: " + std::string(response.begin(), response.end()));
+		}
+		return response;
+	}
+
+	int _fd;
+	std::vector<char> _response;
+};
+
+} // namespace dkmd
+
+#endif /* DKMD_H */